@@ -3,6 +3,56 @@
 // DMT 4/8/2012 - Added dsReloadBatteryCapacity so caller can request a refresh of 
 //                battery capacity outside the constructor and without including it in
 //                every dsRefresh call.
+// 10/19/2026   - Added dsPollProtection fast path that reads only the Protection and
+//                Status registers and fires a configurable response on a trip.
+// 10/19/2026   - Packed per-instance state into raw register bytes and flag bits,
+//                readings are now decoded in the getters.
+// 10/19/2026   - Added DS_USE_xxx build switches to leave out unused subsystems.
+// 10/19/2026   - Added dsInitFast, one burst read at start up and the battery capacity
+//                is only read from EEPROM when it's first needed.
+// 10/19/2026   - Added an extended accumulated current count and a checkpoint log in
+//                EEPROM Block 2 (dsCheckpoint, dsRestoreCheckpoint).
+// 10/19/2026   - Scale factors and register addresses come from DSChipTraits, selected
+//                with DS_SENSE_MILLIOHM, integer getters no longer use float math.
+// 10/19/2026   - Added charge/discharge energy and power accounting (DS_USE_ENERGY)
+//                and dsSetClock for the time base.
+// 10/19/2026   - Added dsGetStateOfCharge, open circuit voltage lookup in a PROGMEM
+//                table blended with the coulomb count (DS_USE_OCV_SOC).
+// 10/19/2026   - Added capacity learning from full to empty and voltage anchored
+//                cycles, saved to Block 0 only when it drifts (DS_USE_CAPACITY_LEARNING).
+// 10/19/2026   - Added time to empty/full estimates from an exponentially weighted
+//                current average (DS_USE_RUNTIME).
+// 10/19/2026   - Added threshold watches with hysteresis and dwell time, checked
+//                after each dsRefresh (DS_USE_WATCH).
+// 10/19/2026   - Added a priority job queue serviced by dsService, EEPROM waits become
+//                due times instead of delay() (DS_USE_BUS_QUEUE).
+// 10/19/2026   - Queued jobs take a completion callback, added queued protection reset
+//                and accumulated current writes (dsSubmitResetProtection, dsSubmitAccumCurrent).
+// 10/19/2026   - Each instance has its own TwoWire bus and address, so gauges can be
+//                spread over several buses; added bus time and sample latency
+//                statistics (DS_USE_BUS_STATS).
+// 10/19/2026   - Added dsReadSnapshot, each refresh is published as one versioned
+//                record behind a sequence counter (DS_USE_SNAPSHOT).
+// 10/19/2026   - Reads follow the gauge's conversion period, unchanged frames aren't
+//                decoded again and dsGetFresh tells which readings are new
+//                (DS_USE_SYNC_SAMPLING).
+// 10/19/2026   - Added dsMarkCharge, average current and charge since a mark taken
+//                from accumulated current deltas (DS_USE_CHARGE_MARK).
+// 10/19/2026   - Added dsCalibrateCurrentOffset, measures the zero current reading
+//                and programs the Current Offset Register (DS_USE_OFFSET_CAL).
+// 10/19/2026   - Added begin/end tracing of bus phases, decoding and EEPROM waits
+//                into a ring buffer, dumped with dsDumpTrace (DS_USE_TRACE).
+// 10/19/2026   - Added dsEnterStandby/dsPollStandby, an off state that only polls
+//                the power switch latch (DS_USE_STANDBY).
+// 10/19/2026   - Added bus clock tuning, steps the I2C clock down on NACKs, short
+//                reads and garbage frames and back up after a clean run
+//                (DS_USE_BUS_TUNE).
+// 10/19/2026   - Added dsProvision, writes a golden image of EEPROM Blocks 0 - 2
+//                touching only the blocks that differ (DS_USE_PROVISION).
+// 10/19/2026   - Added dsSetFilter, median, rate clamp and IIR stages on the raw
+//                voltage and current ahead of the getters (DS_USE_FILTER).
+// 10/19/2026   - Added dsSetArchive, streams readings as compressed column blocks
+//                to any Print for extras/ds2764_archive (DS_USE_ARCHIVE).
 #include <Wire.h>
 #include <avr/pgmspace.h>
 
@@ -18,53 +68,309 @@
 #include "DS2764.h"
 
 
+// Trace points compile away unless DS_USE_TRACE is on.
+#if DS_USE_TRACE
+#define DS_TRACE_BEGIN(s)	dspTrace(s)
+#define DS_TRACE_END(s)		dspTrace((s) | DS_TRACE_END_BIT)
+#define DS_TRACED_DELAY(s, ms)	do { dspTrace(s); delay(ms); dspTrace((s) | DS_TRACE_END_BIT); } while (0)
+#else
+#define DS_TRACE_BEGIN(s)
+#define DS_TRACE_END(s)
+#define DS_TRACED_DELAY(s, ms)	delay(ms)
+#endif
+
+
+#if DS_USE_OCV_SOC
+// Resting voltage of a typical Li-ion/LiPo cell against state of charge
+const DSOcvPoint DS_OCV_LIION[DS_OCV_LIION_COUNT] PROGMEM = {
+    { 3000,    0 },
+    { 3250,   20 },
+    { 3450,   50 },
+    { 3680,  100 },
+    { 3740,  200 },
+    { 3770,  300 },
+    { 3790,  400 },
+    { 3820,  500 },
+    { 3870,  600 },
+    { 3920,  700 },
+    { 3980,  800 },
+    { 4200, 1000 }
+};
+#endif
+
+
 // Public Methods
+
+// The gauge on Wire at DS_ADDRESS.
+DS2764::DS2764(void) {
+    mpWire     = &Wire;
+    mbyAddress = DS_ADDRESS;
+    mpClock    = millis;
+#if DS_USE_BUS_TUNE
+    mulClockMax = DS_TUNE_MAX_CLOCK;
+    mulClockMin = DS_TUNE_MIN_CLOCK;
+#endif
+}
+
+
+
+// A gauge on another bus, e.g. Wire1, or at an address other than the
+// default.  Each instance only talks to its own bus, so gauges on separate
+// buses can be polled independently.  The sketch still calls begin() on
+// each bus.
+DS2764::DS2764(TwoWire &apWire, byte abAddress) {
+    mpWire     = &apWire;
+    mbyAddress = abAddress;
+    mpClock    = millis;
+#if DS_USE_BUS_TUNE
+    mulClockMax = DS_TUNE_MAX_CLOCK;
+    mulClockMin = DS_TUNE_MIN_CLOCK;
+#endif
+}
+
+
+
 void DS2764::dsInit(void) {
 
-    // initialize all member variables
-    miProtect           = 0;
-    miStatus            = 0;
-    miVolts             = 0;
-    miBatteryCapacity   = 0;
-    mbPowerOn           = false;
-    mbPowerSwitchOn     = false;
-    mbSleepEnabled      = false;
-    mfCurrent           = 0.0;
-    miAccCurrent        = 0;
-    mfTempC             = 0.0;
-    mfTempF             = 0.0;
-    
+    dspInitMembers();
     
-    mbPowerOn           = true;
+    mbyFlags           |= DS_FLAG_POWER_ON;
     dsResetProtection(DS_RESET_ENABLE);
+#if DS_USE_POWER_SWITCH
     dsSetPowerSwitchOn();
+#endif
     
+#if DS_USE_CAPACITY_EEPROM
     dspGetBatteryCapacity();
+#endif
     dspGetProtection();
     dspGetVoltageAndCurrent();  
     dspGetTemp();
+#if DS_USE_SNAPSHOT
+    dspPublishSnapshot();
+#endif
     
 }   // end init()
 
 
 
+//------------------------------------------------------------------------------
+// dsInitFast
+//
+// Warm start version of dsInit.  Registers 0x00 through 0x19 are read with one
+// burst, which fills in the protection, status, power switch, voltage, current
+// and temperature readings at once.  The protection reset and the power switch
+// write are only done if the burst shows they're needed, and the battery
+// capacity isn't read from EEPROM Block 0 until dsGetBatteryCapacity or
+// dsGetBatteryCapacityPercent first asks for it.
+//
+// dsInit takes 7 transactions and at least 14ms of delays before the first
+// sample is available.  On a gauge that is already enabled this takes one
+// 26 byte read, about 3ms at the default 100kHz bus clock.  If the burst
+// can't be read this falls back to dsInit.
+//
+// Arguments:
+//     None
+//
+//------------------------------------------------------------------------------
+void DS2764::dsInitFast(void) {
+    byte    abRegs[DS_BURST_LEN];
+
+    dspInitMembers();
+    mbyFlags           |= DS_FLAG_POWER_ON;
+
+    if (dspReadBytes(DS_PROTECTION_REGISTER, abRegs, DS_BURST_LEN) < DS_BURST_LEN) {
+        dsInit();
+        return;
+    }
+
+    mbyProtect = abRegs[DS_PROTECTION_REGISTER];
+    mbyStatus  = abRegs[DS_STATUS_REGISTER];
+    memcpy(mabVoltAndCurrent, &abRegs[DSTraits::VOLT_REG], sizeof(mabVoltAndCurrent));
+    memcpy(mabTemp, &abRegs[DSTraits::TEMP_REG], sizeof(mabTemp));
+    mbyFlags           |= DS_FLAG_TEMP_VALID;
+    dspProcessFrame();
+
+    // Only reset if charge or discharge is off or an OV/UV trip is latched.
+    if ((mbyProtect & (DS00OV | DS00UV | DS00CE | DS00DE)) != (DS00CE | DS00DE)) {
+        dsResetProtection(DS_RESET_ENABLE);
+    }
+
+#if DS_USE_POWER_SWITCH
+    if (abRegs[DS_SPECIAL_FEATURE_REG] & DS00PS) {
+        mbyFlags |= DS_FLAG_POWER_SWITCH_ON;
+    }
+    else {
+        dsSetPowerSwitchOn();
+    }
+#endif
+#if DS_USE_SNAPSHOT
+    dspPublishSnapshot();
+#endif
+
+}   // end dsInitFast()
+
+
+
+// initialize all member variables
+void DS2764::dspInitMembers(void) {
+    mbyProtect          = 0;
+    mbyStatus           = 0;
+    memset(mabVoltAndCurrent, 0, sizeof(mabVoltAndCurrent));
+    memset(mabTemp, 0, sizeof(mabTemp));
+    mbyFlags            = 0;
+    mlAccCurrentExt     = 0;
+#if DS_USE_CAPACITY_EEPROM
+    miBatteryCapacity   = 0;
+#endif
+#if DS_USE_PROTECTION_POLL
+    mbyProtectMask      = DS_PROTECTION_TRIP_MASK;
+    mbyProtectResponse  = DS_RESPONSE_NONE;
+    mbyProtectPolled    = 0;
+    mulPollMicrosMax    = 0;
+#endif
+#if DS_USE_ENERGY
+    dsResetEnergy();
+#endif
+#if DS_USE_OCV_SOC
+    dsSetOcvTable(DS_OCV_LIION, DS_OCV_LIION_COUNT);
+    dsSetRestCurrent(DS_REST_CURRENT);
+#endif
+#if DS_USE_CAPACITY_LEARNING
+    miStoredCapacity    = 0;
+    mlLearnFullAcc      = 0;
+    mbyLearnState       = DS_LEARN_IDLE;
+    dsSetLearningVoltages(DS_LEARN_FULL_VOLTS, DS_LEARN_EMPTY_VOLTS);
+    dsSetCapacityDrift(DS_LEARN_DRIFT_PERCENT);
+#if DS_USE_OCV_SOC
+    mlLearnAnchorAcc    = 0;
+    miLearnAnchorSoc    = -1;
+#endif
+#endif
+#if DS_USE_RUNTIME
+    mlAvgCurrent        = 0;
+    mulAvgLast          = 0;
+    dsSetAverageTime(DS_AVERAGE_TIME);
+#endif
+#if DS_USE_WATCH
+    dsSetWatches(NULL, 0, NULL);
+#endif
+#if DS_USE_BUS_QUEUE
+    memset(mabJobStep, 0, sizeof(mabJobStep));
+    memset(maulJobDue, 0, sizeof(maulJobDue));
+    memset(mapJobDone, 0, sizeof(mapJobDone));
+    mbyJobFailed        = 0;
+    mbyJobReset         = 0;
+    mbyJobSleep         = 0;
+    miJobAccum          = 0;
+    miJobCapacity       = 0;
+#endif
+#if DS_USE_BUS_STATS
+    mbyBusDepth         = 0;
+    mulSampleStart      = 0;
+    dsResetBusStats();
+#endif
+#if DS_USE_SNAPSHOT
+    memset(&msSnapshot, 0, sizeof(msSnapshot));
+    mbySnapshotSeq      = 0;
+#endif
+#if DS_USE_SYNC_SAMPLING
+    mulFrameSeen        = 0;
+    mulFrameRead        = 0;
+    mulFrameDue         = 0;
+    mbyFresh            = 0;
+    dsSetConversionPeriod(DS_CONVERSION_PERIOD);
+#endif
+#if DS_USE_CHARGE_MARK
+    mulAccMillis        = 0;
+    mbyAccEpoch         = 0;
+#endif
+#if DS_USE_STANDBY
+    mbStandby           = false;
+#endif
+#if DS_USE_FILTER
+    memset(masFilter, 0, sizeof(masFilter));	// no stages, seeded by the first frame
+#endif
+#if DS_USE_ARCHIVE
+    mpArchive           = 0;
+    mbyArchiveCount     = 0;
+#endif
+#if DS_USE_BUS_TUNE
+    muiBusErrors        = 0;
+    dsSetBusClock(mulClockMax, mulClockMin);	// Wire.begin has run by now
+#endif
+#if DS_USE_TRACE
+    mpTraceClock        = micros;
+    dsClearTrace();
+#endif
+#if DS_USE_CHECKPOINT
+    muiCycleCount       = 0;
+    mlCycleDischarge    = 0;
+    mulCheckpointMillis = mpClock();
+    mulCheckpointInterval = DS_CHECKPOINT_INTERVAL;
+    mbyCheckpointSeq    = 0;
+#endif
+}
+
+
+
 
+// Accumulated current is kept in units of .25mAh (DSTraits::ACR_Q16)
 int DS2764::dsGetAccumulatedCurrent(void) {
-    return miAccCurrent;
+    int acurrent = word(mabVoltAndCurrent[4], mabVoltAndCurrent[5]);
+
+    return dspScale(acurrent, DSTraits::ACR_Q16);
+}
+
+// Accumulated current in mAh without the 16 bit register's wrap around.
+// Follows the register from one dsRefresh to the next, so it's only exact
+// if the ACR moves less than 32768 counts between refreshes.
+long DS2764::dsGetAccumulatedCurrentExt(void) {
+    return dspAcrToMah(mlAccCurrentExt);
+}
+
+// Any number of ACR counts in mAh.  Each 65536 counts is ACR_Q16 mAh, and the
+// low 16 bits are scaled a byte at a time so the multiply can't overflow 32
+// bits for any DS_SENSE_MILLIOHM down to the limit of 4.
+long DS2764::dspAcrToMah(long alCounts) {
+    long    lHigh   = alCounts >> 16;
+    unsigned long ulLow = ((alCounts >> 8) & 0xFF) * DSTraits::ACR_Q16 +
+                          (((alCounts & 0xFF) * DSTraits::ACR_Q16) >> 8);
+
+    return lHigh * DSTraits::ACR_Q16 + (long) (ulLow >> 8);
 }
 
+// Voltage is in the upper 11 bits, in units of 4.88mV (DSTraits::VOLT_Q16)
 int DS2764::dsGetBatteryVoltage(void) {
-    return miVolts;
+#if DS_USE_FILTER
+    if (mbyFlags & DS_FLAG_FRAME_VALID) {
+        return dspScale(masFilter[DS_FILTER_VOLTAGE].out, DSTraits::VOLT_Q16);
+    }
+#endif
+    int voltage = mabVoltAndCurrent[0];
+
+    voltage = voltage << 8;
+    voltage += mabVoltAndCurrent[1];
+    voltage = voltage >> DSTraits::VOLT_SHIFT;
+    return dspScale(voltage, DSTraits::VOLT_Q16);
 }
     
+
+#if DS_USE_CAPACITY_EEPROM
 int DS2764::dsGetBatteryCapacity(void) {
+    if (!(mbyFlags & DS_FLAG_CAPACITY_LOADED)) {
+        dspGetBatteryCapacity();    // deferred by dsInitFast
+    }
     return miBatteryCapacity;
 }
 
 
+#if DS_USE_FLOAT
 float DS2764::dsGetBatteryCapacityPercent(void) {
-    return (((float) miAccCurrent / (float) miBatteryCapacity) * 100.0);
+    return (((float) dsGetAccumulatedCurrent() / (float) dsGetBatteryCapacity()) * 100.0);
 }
+#endif
+#endif
 
 
 
@@ -73,7 +379,7 @@ float DS2764::dsGetBatteryCapacityPercent(void) {
 
 int DS2764::dsGetChargeStatus(void) {
 
-    if (miProtect & DS00COC) { 
+    if (mbyProtect & DS00COC) { 
           //Serial.println("   Charge Current: *** OVER  ***"); 
           return DS_CHARGE_CURRENT_HI;
     }
@@ -87,7 +393,7 @@ int DS2764::dsGetChargeStatus(void) {
  
 int DS2764::dsGetDischargeStatus(void) {
  
-    if (miProtect & DS00DOC) { 
+    if (mbyProtect & DS00DOC) { 
         //Serial.println("Discharge Current: *** OVER  ***"); 
         return DS_DISCHARGE_CURRENT_HI;
         }
@@ -103,38 +409,78 @@ int DS2764::dsGetDischargeStatus(void) {
 
         
 
+// Current is in the upper 12 bits, returned in units of .625mA (DSTraits::CURRENT_Q16)
+int DS2764::dsGetCurrentRaw(void) {
+#if DS_USE_FILTER
+    if (mbyFlags & DS_FLAG_FRAME_VALID) {
+        return masFilter[DS_FILTER_CURRENT].out;
+    }
+#endif
+    // Through int16_t so the sign comes out right where int is 32 bits.
+    return (int16_t) word(mabVoltAndCurrent[2], mabVoltAndCurrent[3]) >> DSTraits::CURRENT_SHIFT;
+}
+
+
+#if DS_USE_FLOAT
 float DS2764::dsGetCurrent(void) {
-    return mfCurrent;
+    double c = (dsGetCurrentRaw() * (DSTraits::CURRENT_Q16 / 65536.0));
+    return c;
 }
+#endif
+
 
 
 
 
 
 
+// Temperature is in the upper 11 bits, returned in units of .125 degrees C (DSTraits::TEMP_Q16)
+int DS2764::dsGetTempRaw(void) {
+    int reading = 0;
+
+    if (!(mbyFlags & DS_FLAG_TEMP_VALID)) {
+        return 0;
+    }
+
+    reading = (int16_t) word(mabTemp[0], mabTemp[1]);
+    reading = reading >> DSTraits::TEMP_SHIFT;
+    return reading;
+}
+
 
+#if DS_USE_FLOAT
 float   DS2764::dsGetTempC(void) {
-    return mfTempC;
+    if (!(mbyFlags & DS_FLAG_TEMP_VALID)) {
+        return 0.0;
+    }
+
+    return dsGetTempRaw() * (DSTraits::TEMP_Q16 / 65536.0);
 }
 
 float   DS2764::dsGetTempF(void) {
-    return mfTempF;
+    if (!(mbyFlags & DS_FLAG_TEMP_VALID)) {
+        return 0.0;
+    }
+
+    // Convert temperature to Fahrenheit        
+    return (dsGetTempC() * 9.0 / 5.0) + 32.0;
 }
+#endif
 
 
 
 
 int DS2764::dsGetVoltageStatus(void) {
 
-    if (!(miProtect & (DS00OV + DS00UV))) {
+    if (!(mbyProtect & (DS00OV + DS00UV))) {
         //Serial.println("      Voltage: OK");
         return DS_VOLTS_OK;
     }
-    else if (miProtect & DS00OV) { 
+    else if (mbyProtect & DS00OV) { 
         //Serial.println("      Voltage: *** OVER  ***"); 
         return DS_VOLTS_HI;
     }
-    else if (miProtect & DS00UV) { 
+    else if (mbyProtect & DS00UV) { 
         //Serial.println("      Voltage: *** UNDER ***"); 
         return DS_VOLTS_LOW;
     }
@@ -145,6 +491,7 @@ int DS2764::dsGetVoltageStatus(void) {
 
 
 
+#if DS_USE_SLEEP
 void DS2764::dsDisableSleep(void) {
     dspSetSleepMode(DS_SLEEP_DISABLED);
 }
@@ -152,29 +499,32 @@ void DS2764::dsDisableSleep(void) {
 void DS2764::dsEnableSleep(void) {
     dspSetSleepMode(DS_SLEEP_ENABLED);
 }
+#endif
 
 boolean DS2764::dsIsChargeOn(void) {
-    return !(miProtect & DS00CC);
+    return !(mbyProtect & DS00CC);
 }
 
 boolean DS2764::dsIsChargeEnabled(void) {
-    return (miProtect & DS00CE);
+    return (mbyProtect & DS00CE);
 }
 
 boolean DS2764::dsIsDischargeOn(void) {
-    return !(miProtect & DS00DC);
+    return !(mbyProtect & DS00DC);
 }
 
 boolean DS2764::dsIsDischargeEnabled(void) {
-    return (miProtect & DS00DE);
+    return (mbyProtect & DS00DE);
 }
 
 
 
 
+#if DS_USE_POWER_SWITCH
 boolean DS2764::dsIsPowerOn(void) {
-    return mbPowerOn;   
+    return (mbyFlags & DS_FLAG_POWER_ON);   
 }
+#endif
 
 
         
@@ -182,7 +532,7 @@ boolean DS2764::dsIsSleepEnabled(void) {
 // check bit 5 in the Status Register.
 // this value is read only, but the default
 // value is set in Byte 2 of EEPROM block 1, aka Addr 0x31
-    return (miStatus & DS00SLP);
+    return (mbyStatus & DS00SLP);
 }
 
 
@@ -190,10 +540,43 @@ boolean DS2764::dsIsSleepEnabled(void) {
 
 void DS2764::dsRefresh(void) {
     
+#if DS_USE_STANDBY
+    if (mbStandby) {
+        dsPollStandby();	// nothing else is read until the switch is pressed
+        return;
+    }
+#endif
+    DS_TRACE_BEGIN(DS_TRACE_REFRESH);
+#if DS_USE_BUS_STATS
+    dspBusBegin();
+    mulSampleStart = micros();
+#endif
+#if DS_USE_POWER_SWITCH
     dspHandlePower();            // check if powerbutton was pushed
+#endif
     dspGetProtection();
+#if DS_USE_SYNC_SAMPLING
+    dspSyncFrame();
+#else
     dspGetVoltageAndCurrent();  
     dspGetTemp();
+#if DS_USE_ARCHIVE
+    if (mbyFlags & DS_FLAG_FRAME_VALID) {
+        dspArchiveFrame();
+    }
+#endif
+#endif
+#if DS_USE_BUS_STATS
+    dspSampleDone();
+    dspBusEnd();
+#endif
+#if DS_USE_SNAPSHOT
+    dspPublishSnapshot();
+#endif
+#if DS_USE_WATCH
+    dspCheckWatches();
+#endif
+    DS_TRACE_END(DS_TRACE_REFRESH);
 }
 
 
@@ -202,10 +585,7 @@ void DS2764::dsRefresh(void) {
 // but by the chip once the problem is corrected.
 void DS2764::dsResetProtection(int aiOn) {
     int dsProtect  = 0;
-    int dsStatus   = 0;
 
-    // Read Protection Register
-    
     if(aiOn == DS_RESET_ENABLE) {
         dsProtect = DS_PROTECTION_CLEAR_ENABLE;     //Clear OV and UV and enable both charge and discharge
     }
@@ -213,44 +593,92 @@ void DS2764::dsResetProtection(int aiOn) {
         dsProtect = DS_PROTECTION_CLEAR_DISABLE;    //Clear OV and UV and disable both charge and discharge
     }
     
-    //Serial.print("About to send Protection Flags: ");
-    //Serial.println(lowByte(dsProtect), HEX);
-    
-    Wire.beginTransmission(DS_ADDRESS);
-    
-#if defined(ARDUINO) && ARDUINO >= 100
-    Wire.write((uint8_t)DS_PROTECTION_REGISTER);
-    Wire.write(lowByte(dsProtect));
-#else
-    Wire.send(DS_PROTECTION_REGISTER);
-    Wire.send(lowByte(dsProtect));
+    dspWriteProtection(dsProtect);
+}
+
+
+
+#if DS_USE_PROTECTION_POLL
+//------------------------------------------------------------------------------
+// dsPollProtection
+//
+// Fast path for catching OV/UV/COC/DOC trips.  Only the Protection and Status
+// registers are read (one 2 byte transaction, no delays), so this can be
+// called many times between full dsRefresh calls.
+//
+// When any of the watched bits (see dsSetProtectionResponse) change, the
+// configured response is carried out before returning, so a trip is acted on
+// in the same call that detected it.  The worst case detection latency is the
+// caller's poll period plus dsGetPollMicrosMax().
+//
+// Arguments:
+//     None
+//
+// Return Value:
+//     true if any watched bit changed since the last good dsPollProtection
+//     read, false otherwise or if the registers could not be read.
+//------------------------------------------------------------------------------
+boolean DS2764::dsPollProtection(void) {
+    unsigned long ulStart   = micros();
+    unsigned long ulElapsed = 0;
+    int     iPrevious   = mbyProtectPolled;
+    int     iChanged    = 0;
+    int     iTripped    = 0;
+
+#if DS_USE_BUS_STATS
+    dspBusBegin();
+#endif
+    if (!dspGetProtection()) {
+#if DS_USE_BUS_STATS
+        dspBusEnd();
 #endif
+        return false;
+    }
 
-    Wire.endTransmission();
-    //delay(10);
-    Wire.requestFrom(DS_ADDRESS, 2);
-    if(1 <= Wire.available())                    //if two bytes were received 
-    { 
-#if defined(ARDUINO) && ARDUINO >= 100
-		miProtect = Wire.read();
-        miStatus  = Wire.read(); 
-#else
-		miProtect = Wire.receive();
-        miStatus  = Wire.receive(); 
-#endif        
+    // Compare against what the last good poll saw, not mbyProtect, which
+    // dsRefresh and the protection writes also update.
+    mbyProtectPolled = mbyProtect;
+    iChanged = (mbyProtectPolled ^ iPrevious) & mbyProtectMask;
+    iTripped = iChanged & mbyProtectPolled;
+
+    if (iTripped && (mbyProtectResponse & DS_RESPONSE_DISABLE)) {
+        // Leave alone whichever of CE/DE the response doesn't ask us to clear,
+        // and write OV/UV back as 1 so a latched trip isn't cleared by the write.
+        dspWriteProtection((mbyProtectPolled & (DS00OV | DS00UV)) |
+                           (mbyProtectPolled & ~mbyProtectResponse & DS_RESPONSE_DISABLE));
     }
-    else {
-      //  Serial.println("Nothing received from resetdsProtection Request");
-        
-        miProtect = -1;
-        miStatus  = -1;        
+    if (iChanged && (mbyProtectResponse & DS_RESPONSE_REFRESH)) {
+        dsRefresh();
+    }
+
+    ulElapsed = micros() - ulStart;
+    if (ulElapsed > mulPollMicrosMax) {
+        mulPollMicrosMax = ulElapsed;
     }
-    //Serial.print("dsResetProtection miProtect: ");
-    //Serial.println(miProtect, HEX);
-    //Serial.print("dsResetProtection  miStatus: ");
-    //Serial.println(miStatus, HEX);
+#if DS_USE_BUS_STATS
+    dspBusEnd();
+#endif
+
+    return (iChanged != 0);
+}
 
+
+
+// aiMask is the set of Protection Register bits to watch (DS_PROTECTION_TRIP_MASK
+// by default), aiResponse is an OR of the DS_RESPONSE_xxx values.
+void DS2764::dsSetProtectionResponse(int aiMask, int aiResponse) {
+    mbyProtectMask     = aiMask;
+    mbyProtectResponse = aiResponse;
+}
+
+
+
+// Longest time in microseconds that dsPollProtection has taken, including the
+// response.  At the default 100kHz bus clock the read alone is about 0.5ms.
+unsigned long DS2764::dsGetPollMicrosMax(void) {
+    return mulPollMicrosMax;
 }
+#endif
 
 
 
@@ -260,32 +688,86 @@ void DS2764::dsResetProtection(int aiOn) {
 void DS2764::dsSetAccumCurrent(int iNewVal) {
   
     // Convert our new value in mAh to units of .25mAh
-    int acurrent = iNewVal / 0.25;
+    int acurrent = dspScale(iNewVal, DSTraits::ACR_PER_MAH_Q16);
     byte loByte = 0;
     byte hiByte = 0;
+    byte abBuf[2];
         
     loByte = acurrent & 0x00FF;
     hiByte = acurrent >> 8;
         
     // Send Data to Accumulated Current Variable
-    Wire.beginTransmission(DS_ADDRESS);
-    
-#if defined(ARDUINO) && ARDUINO >= 100
-    Wire.write(DS_ACC_CURRENT_REG_HI);
-    delay(5);
-    Wire.write(hiByte);
-    Wire.write(loByte); 
-#else    
-    Wire.send(DS_ACC_CURRENT_REG_HI);
+    abBuf[0] = hiByte;
+    abBuf[1] = loByte;
     delay(5);
-    Wire.send(hiByte);
-    Wire.send(loByte); 
-#endif 
-
-    Wire.endTransmission();
+    dspWriteBytes(DSTraits::ACR_REG, abBuf, 2);
     
-    miAccCurrent = iNewVal;
+    mabVoltAndCurrent[4] = hiByte;
+    mabVoltAndCurrent[5] = loByte;
+    mlAccCurrentExt      = (int16_t) word(hiByte, loByte);
+#if DS_USE_CHARGE_MARK
+    mbyAccEpoch++;
+#endif
+
+}
+
+
+
+
+// Sets the function the driver uses as its clock, in ms, millis() unless this
+// says otherwise.  dsInit keeps it, so it's best set before dsInit.  Set
+// later, the times already taken are moved onto the new clock, so energy,
+// averages, checkpoints, jobs and watch dwell times carry on without a jump.
+// DSChargeMarks taken before the change are no longer valid.
+void DS2764::dsSetClock(DSClock apClock) {
+    unsigned long ulOld = mpClock();
+
+    mpClock = apClock;
+    dspMoveClock(mpClock() - ulOld);
+}
+
+
+
+// Adds aulShift to every clock time the driver keeps.
+void DS2764::dspMoveClock(unsigned long aulShift) {
+#if DS_USE_WATCH || DS_USE_BUS_QUEUE
+    byte    i   = 0;
+#endif
+
+    (void) aulShift;	// nothing keeps a clock time in the default build
 
+#if DS_USE_ENERGY
+    mulEnergyStart += aulShift;
+    mulEnergyLast  += aulShift;
+#endif
+#if DS_USE_RUNTIME
+    mulAvgLast     += aulShift;
+#endif
+#if DS_USE_WATCH
+    for (i = 0; i < mbyWatchCount; i++) {
+        mpWatches[i].since += aulShift;
+    }
+#endif
+#if DS_USE_BUS_QUEUE
+    for (i = 0; i < DS_JOBS; i++) {
+        maulJobDue[i] += aulShift;
+    }
+#endif
+#if DS_USE_SYNC_SAMPLING
+    mulFrameSeen   += aulShift;
+    mulFrameRead   += aulShift;
+    mulFrameDue    += aulShift;
+#endif
+#if DS_USE_ARCHIVE
+    mulArchiveStart += aulShift;
+#endif
+#if DS_USE_CHARGE_MARK
+    mulAccMillis   += aulShift;
+    mbyAccEpoch++;
+#endif
+#if DS_USE_CHECKPOINT
+    mulCheckpointMillis += aulShift;
+#endif
 }
 
 
@@ -296,6 +778,7 @@ void DS2764::dsSetAccumCurrent(int iNewVal) {
 
 
 
+#if DS_USE_CAPACITY_EEPROM
 void DS2764::dsSetBatteryCapacity(int aiValue) {
 
     int     iCapacity   = 0;
@@ -303,48 +786,45 @@ void DS2764::dsSetBatteryCapacity(int aiValue) {
     byte    bLow        = 0;
     byte    bCheck      = 0;
     byte    bFill       = 0xA;
+    byte    abBuf[4];
+
+    DS_TRACE_BEGIN(DS_TRACE_CAPACITY);
 
     // Recall EEPROM Block 0 Data to Shadow RAM
     // This automatically happens at Power Up, so this
     // step probably isn't necessary.
-    Wire.beginTransmission(DS_ADDRESS);
-    
-#if defined(ARDUINO) && ARDUINO >= 100
-    Wire.write(DS_FUNCTION_REGISTER);        // Write value to Function Command Address
-    Wire.write(DS_RECALL_EEPROM_BLK_0);      // Request refresh of Block 0 Shadow RAM from EEPROM
-#else    
-    Wire.send(DS_FUNCTION_REGISTER);        // Write value to Function Command Address
-    Wire.send(DS_RECALL_EEPROM_BLK_0);      // Request refresh of Block 0 Shadow RAM from EEPROM
-#endif
-
-    Wire.endTransmission();
-    delay(500);
+    abBuf[0] = DS_RECALL_EEPROM_BLK_0;
+    dspWriteBytes(DS_FUNCTION_REGISTER, abBuf, 1);
+    DS_TRACED_DELAY(DS_TRACE_EEPROM_WAIT, 500);
         
         
     // Read first 4 bytes of Block 0 Shadow RAM
-    Wire.beginTransmission(DS_ADDRESS);
+    mpWire->beginTransmission(mbyAddress);
     
 #if defined(ARDUINO) && ARDUINO >= 100
-	Wire.write(DS_BATTERY_CAP_ADDR);
+	mpWire->write(DS_BATTERY_CAP_ADDR);
 #else
-	Wire.send(DS_BATTERY_CAP_ADDR);
+	mpWire->send(DS_BATTERY_CAP_ADDR);
 #endif	
     
-    Wire.endTransmission();
-    delay(100);
-    Wire.requestFrom(DS_ADDRESS, 4);
+    mpWire->endTransmission();
+    DS_TRACED_DELAY(DS_TRACE_EEPROM_WAIT, 100);
+    mpWire->requestFrom((int) mbyAddress, 4);
+#if DS_USE_BUS_TUNE
+    dspBusResult(4 <= mpWire->available());
+#endif
 
-    if(4 <= Wire.available()) { 
+    if(4 <= mpWire->available()) { 
 #if defined(ARDUINO) && ARDUINO >= 100
-        bHi     = Wire.read();
-        bLow    = Wire.read();
-        bCheck  = Wire.read();
-        bFill   = Wire.read();
+        bHi     = mpWire->read();
+        bLow    = mpWire->read();
+        bCheck  = mpWire->read();
+        bFill   = mpWire->read();
 #else
-        bHi     = Wire.receive();
-        bLow    = Wire.receive();
-        bCheck  = Wire.receive();
-        bFill   = Wire.receive();
+        bHi     = mpWire->receive();
+        bLow    = mpWire->receive();
+        bCheck  = mpWire->receive();
+        bFill   = mpWire->receive();
 #endif
 	}
 
@@ -360,129 +840,248 @@ void DS2764::dsSetBatteryCapacity(int aiValue) {
         
     // Write the data back to Address 0x20, which is the
     // "shadow RAM" for EEPROM Block 0.    
-    Wire.beginTransmission(DS_ADDRESS);
-    
-#if defined(ARDUINO) && ARDUINO >= 100
-	Wire.write(DS_BATTERY_CAP_ADDR);
-    Wire.write(highByte(aiValue));
-    Wire.write(lowByte(aiValue));
-    Wire.write(bCheck);
-    Wire.write(bFill);
-#else
-	Wire.send(DS_BATTERY_CAP_ADDR);
-    Wire.send(highByte(aiValue));
-    Wire.send(lowByte(aiValue));
-    Wire.send(bCheck);
-    Wire.send(bFill);
-#endif
-
-    Wire.endTransmission();
-    delay(10);
+    abBuf[0] = highByte(aiValue);
+    abBuf[1] = lowByte(aiValue);
+    abBuf[2] = bCheck;
+    abBuf[3] = bFill;
+    dspWriteBytes(DS_BATTERY_CAP_ADDR, abBuf, 4);
+    DS_TRACED_DELAY(DS_TRACE_EEPROM_WAIT, 10);
         
     // Now that we've written to the Shadow RAM for EEPROM
     // Block 0, we need to ask the Gas Gauge to Save the
     // Block 0 Shadow RAM back to the EEPROM memory.    
-    Wire.beginTransmission(DS_ADDRESS);
-    
-#if defined(ARDUINO) && ARDUINO >= 100
-	Wire.write(DS_FUNCTION_REGISTER);        // Write value to Function Command Address
-    Wire.write(DS_SAVE_EEPROM_BLK_0);        // Request Write of Block 0 Shadow RAM back into EEPROM
-#else
-	Wire.send(DS_FUNCTION_REGISTER);        // Write value to Function Command Address
-    Wire.send(DS_SAVE_EEPROM_BLK_0);        // Request Write of Block 0 Shadow RAM back into EEPROM
-#endif
-
-    Wire.endTransmission();
-    delay(10);
+    abBuf[0] = DS_SAVE_EEPROM_BLK_0;
+    dspWriteBytes(DS_FUNCTION_REGISTER, abBuf, 1);
+    DS_TRACED_DELAY(DS_TRACE_EEPROM_WAIT, 10);
         
     miBatteryCapacity = aiValue;
+#if DS_USE_CAPACITY_LEARNING
+    miStoredCapacity  = aiValue;
+#endif
+    mbyFlags |= DS_FLAG_CAPACITY_LOADED;
+    if (aiValue > 0) {
+        mbyFlags |= DS_FLAG_CAPACITY_VALID;
+    }
+    DS_TRACE_END(DS_TRACE_CAPACITY);
 }
+#endif
 
 
 
+#if DS_USE_POWER_SWITCH
 void DS2764::dsSetPowerSwitchOn(void) {
     dspSetPowerSwitchOn();
 }
+#endif
 
 
 
 
 
+#if DS_USE_CAPACITY_EEPROM
 void DS2764::dsReloadBatteryCapacity() {
 	dspGetBatteryCapacity();
 }
+#endif
 
 
 // private methods
 
 
 
-
-
-
-
 //------------------------------------------------------------------------------
-// dspGetBatteryCapacity
-//
-// Retrieves the Battery Capacity in mAh from the Gas Gauge Chip's EEPROM Block
-// 0 memory that was saved previously.  Block 0 starts at address 0x20.
-//
-// The first 2 bytes hold the Battery Capacity in mAh
-//
-// The third byte is a checksum (calculated by XOR'ing the first two bytes
-// together.
+// dspReadBytes
 //
-// The 4th and final byte is the value 0xA which is used to indicate that
-// these 4 bytes contain a battery capacity that was saved previously.
-// 
+// Reads a run of consecutive registers with a single request.  The Wire
+// buffer holds 32 bytes, so that's the most that can be read at once.
 //
 // Arguments:
-//     None
+//     byte abReg   - address of the first register
+//     byte *abBuf  - where to put the bytes read
+//     byte abCount - number of registers to read
 //
+// Return Value:
+//     byte - number of bytes read, 0 if the request was not answered.
 //------------------------------------------------------------------------------
-void DS2764::dspGetBatteryCapacity() { 
+byte DS2764::dspReadBytes(byte abReg, byte *abBuf, byte abCount) {
+    byte    i       = 0;
+#if DS_USE_BUS_TUNE
+    byte    bNack   = 0;
+#endif
 
-    byte    bHi         = 0;
-    byte    bLow        = 0;
-    byte    bCheck      = 0;
-    byte    bFill       = 0;
+    DS_TRACE_BEGIN(DS_TRACE_ADDRESS);
+    mpWire->beginTransmission(mbyAddress);
 
-    // Read 4 bytes from the start of EEPROM Address 20, which is 
-    // EEPROM Block 0.  First two bytes should be the battery
-    // capacity in mAH, and the next byte should be the first
-    // two bytes ORed together.  The 4th byte should be 0xA to
-    // indicate that this is memory that's been set by this program
-    // 
-    Wire.beginTransmission(DS_ADDRESS);
-    
 #if defined(ARDUINO) && ARDUINO >= 100
-	Wire.write(DS_BATTERY_CAP_ADDR);
+    mpWire->write(abReg);
 #else
-	Wire.send(DS_BATTERY_CAP_ADDR);
+    mpWire->send(abReg);
 #endif
 
-	Wire.endTransmission();
-    
-    Wire.requestFrom(DS_ADDRESS, 4);
-    
-    if(4 <= Wire.available()) { 
+#if DS_USE_BUS_TUNE
+    bNack = mpWire->endTransmission();
+#else
+    mpWire->endTransmission();
+#endif
+    DS_TRACE_END(DS_TRACE_ADDRESS);
+    DS_TRACE_BEGIN(DS_TRACE_REQUEST);
+    mpWire->requestFrom((int) mbyAddress, (int) abCount);
+    DS_TRACE_END(DS_TRACE_REQUEST);
+    if (mpWire->available() < abCount) {
+#if DS_USE_BUS_TUNE
+        dspBusResult(false);
+#endif
+        return 0;
+    }
+
+    for (i = 0; i < abCount; i++) {
 #if defined(ARDUINO) && ARDUINO >= 100
-		bHi     = Wire.read();
-        bLow    = Wire.read();
-        bCheck  = Wire.read();
-        bFill   = Wire.read();  // should be set to 0xA
+        abBuf[i] = mpWire->read();
 #else
-		bHi     = Wire.receive();
-        bLow    = Wire.receive();
-        bCheck  = Wire.receive();
-        bFill   = Wire.receive();  // should be set to 0xA
+        abBuf[i] = mpWire->receive();
 #endif
-        
-        if ((bHi ^ bLow == bCheck) && bFill == 0xA) {
-            // checksum matches and our filler character
-            // matches.
-            miBatteryCapacity = word(bHi, bLow);
-        }
+    }
+#if DS_USE_BUS_TUNE
+    // the voltage register is never negative, a set sign bit is the 0xFF a
+    // floating bus reads back, so count it against the clock
+    if (abReg <= DSTraits::VOLT_REG && DSTraits::VOLT_REG < abReg + abCount) {
+        bNack |= abBuf[DSTraits::VOLT_REG - abReg] & 0x80;
+    }
+    dspBusResult(bNack == 0);
+#endif
+    return abCount;
+}
+
+
+
+//------------------------------------------------------------------------------
+// dspWriteBytes
+//
+// Writes a run of consecutive registers in one transmission.
+//
+// Arguments:
+//     byte abReg         - address of the first register
+//     const byte *abBuf  - bytes to write
+//     byte abCount       - number of registers to write, at most 31
+//
+// Return Value:
+//     boolean - true if the gauge acknowledged the write
+//------------------------------------------------------------------------------
+boolean DS2764::dspWriteBytes(byte abReg, const byte *abBuf, byte abCount) {
+    byte    i   = 0;
+    boolean bOk = false;
+
+    DS_TRACE_BEGIN(DS_TRACE_WRITE);
+    mpWire->beginTransmission(mbyAddress);
+
+#if defined(ARDUINO) && ARDUINO >= 100
+    mpWire->write(abReg);
+    for (i = 0; i < abCount; i++) {
+        mpWire->write(abBuf[i]);
+    }
+#else
+    mpWire->send(abReg);
+    for (i = 0; i < abCount; i++) {
+        mpWire->send(abBuf[i]);
+    }
+#endif
+
+    bOk = (mpWire->endTransmission() == 0);
+    DS_TRACE_END(DS_TRACE_WRITE);
+#if DS_USE_BUS_TUNE
+    dspBusResult(bOk);
+#endif
+    return bOk;
+}
+
+
+
+// Multiplies a raw reading by a Q16 scale factor from DSTraits.  Rounds
+// toward zero, the same as the float math it replaces.
+long DS2764::dspScale(long alRaw, long alScaleQ16) {
+    if (alRaw < 0) {
+        return -(long) (((unsigned long) -alRaw * alScaleQ16) >> 16);
+    }
+    return ((unsigned long) alRaw * alScaleQ16) >> 16;
+}
+
+
+
+
+
+
+
+#if DS_USE_CAPACITY_EEPROM
+//------------------------------------------------------------------------------
+// dspGetBatteryCapacity
+//
+// Retrieves the Battery Capacity in mAh from the Gas Gauge Chip's EEPROM Block
+// 0 memory that was saved previously.  Block 0 starts at address 0x20.
+//
+// The first 2 bytes hold the Battery Capacity in mAh
+//
+// The third byte is a checksum (calculated by XOR'ing the first two bytes
+// together.
+//
+// The 4th and final byte is the value 0xA which is used to indicate that
+// these 4 bytes contain a battery capacity that was saved previously.
+// 
+//
+// Arguments:
+//     None
+//
+//------------------------------------------------------------------------------
+void DS2764::dspGetBatteryCapacity() { 
+
+    byte    bHi         = 0;
+    byte    bLow        = 0;
+    byte    bCheck      = 0;
+    byte    bFill       = 0;
+
+    // Read 4 bytes from the start of EEPROM Address 20, which is 
+    // EEPROM Block 0.  First two bytes should be the battery
+    // capacity in mAH, and the next byte should be the first
+    // two bytes ORed together.  The 4th byte should be 0xA to
+    // indicate that this is memory that's been set by this program
+    // 
+    mpWire->beginTransmission(mbyAddress);
+    
+#if defined(ARDUINO) && ARDUINO >= 100
+	mpWire->write(DS_BATTERY_CAP_ADDR);
+#else
+	mpWire->send(DS_BATTERY_CAP_ADDR);
+#endif
+
+	mpWire->endTransmission();
+    
+    mpWire->requestFrom((int) mbyAddress, 4);
+#if DS_USE_BUS_TUNE
+    dspBusResult(4 <= mpWire->available());
+#endif
+    
+    if(4 <= mpWire->available()) { 
+#if defined(ARDUINO) && ARDUINO >= 100
+		bHi     = mpWire->read();
+        bLow    = mpWire->read();
+        bCheck  = mpWire->read();
+        bFill   = mpWire->read();  // should be set to 0xA
+#else
+		bHi     = mpWire->receive();
+        bLow    = mpWire->receive();
+        bCheck  = mpWire->receive();
+        bFill   = mpWire->receive();  // should be set to 0xA
+#endif
+        
+        mbyFlags &= ~DS_FLAG_CAPACITY_VALID;
+        if (((bHi ^ bLow) == bCheck) && bFill == 0xA) {
+            // checksum matches and our filler character
+            // matches.
+            miBatteryCapacity = word(bHi, bLow);
+            mbyFlags |= DS_FLAG_CAPACITY_VALID;
+#if DS_USE_CAPACITY_LEARNING
+            miStoredCapacity  = miBatteryCapacity;
+#endif
+        }
         else {
             // these 4 bytes may not have been initialized
             // with the battery capacity yet, use the
@@ -497,16 +1096,17 @@ void DS2764::dspGetBatteryCapacity() {
             // calculating remaining battery percent.
         	miBatteryCapacity = 1;
         }
+
+        mbyFlags |= DS_FLAG_CAPACITY_LOADED;
     }
 }
+#endif
 
 
 
 
 
-
-
-
+#if DS_USE_POWER_SWITCH
 //------------------------------------------------------------------------------
 // dspGetPowerSwitch
 //
@@ -528,34 +1128,38 @@ void DS2764::dspGetPowerSwitch(void) {
     int dsSpecial  = 0;
 
     // Read Protection Register
-    Wire.beginTransmission(DS_ADDRESS);
+    mpWire->beginTransmission(mbyAddress);
 #if defined(ARDUINO) && ARDUINO >= 100
-    Wire.write(DS_SPECIAL_FEATURE_REG);
+    mpWire->write(DS_SPECIAL_FEATURE_REG);
 #else    
-    Wire.send(DS_SPECIAL_FEATURE_REG);
+    mpWire->send(DS_SPECIAL_FEATURE_REG);
 #endif
 
-    Wire.endTransmission();
-    Wire.requestFrom(DS_ADDRESS, 1);
-    if(1 <= Wire.available()) {                 // if one byte was received 
+    mpWire->endTransmission();
+    mpWire->requestFrom((int) mbyAddress, 1);
+#if DS_USE_BUS_TUNE
+    dspBusResult(1 <= mpWire->available());
+#endif
+    if(1 <= mpWire->available()) {                 // if one byte was received 
 
 
 #if defined(ARDUINO) && ARDUINO >= 100
-		dsSpecial = Wire.read();
+		dsSpecial = mpWire->read();
 #else
-		dsSpecial = Wire.receive();
+		dsSpecial = mpWire->receive();
 #endif
 
         if (dsSpecial & DS00PS) { 
             //Serial.println("PsON");
-            mbPowerSwitchOn = true;
+            mbyFlags |= DS_FLAG_POWER_SWITCH_ON;
         }
         else {
             //Serial.println("PsOFF");
-            mbPowerSwitchOn = false;
+            mbyFlags &= ~DS_FLAG_POWER_SWITCH_ON;
         }
     }
 }
+#endif
 
 
 
@@ -587,30 +1191,37 @@ void DS2764::dspGetPowerSwitch(void) {
 //     None
 //
 // Return Value:
-//     int - byte containing the Protection Flags.  Also sets giProtect and 
-//           giStatus global variables.
+//     boolean - true if both registers were read.  Also sets mbyProtect and 
+//               mbyStatus, which are -1 if nothing was received.
 //------------------------------------------------------------------------------
-void DS2764::dspGetProtection(void) {
+boolean DS2764::dspGetProtection(void) {
 
     // Read Protection Register
-    Wire.beginTransmission(DS_ADDRESS);
+    DS_TRACE_BEGIN(DS_TRACE_ADDRESS);
+    mpWire->beginTransmission(mbyAddress);
     
 #if defined(ARDUINO) && ARDUINO >= 100
-	Wire.write((uint8_t)DS_PROTECTION_REGISTER);
+	mpWire->write((uint8_t)DS_PROTECTION_REGISTER);
 #else
-	Wire.send(DS_PROTECTION_REGISTER);
+	mpWire->send(DS_PROTECTION_REGISTER);
 #endif
 
-    Wire.endTransmission();
-    Wire.requestFrom(DS_ADDRESS, 2);
-    if(2 <= Wire.available()) {     // if two bytes were received 
+    mpWire->endTransmission();
+    DS_TRACE_END(DS_TRACE_ADDRESS);
+    DS_TRACE_BEGIN(DS_TRACE_REQUEST);
+    mpWire->requestFrom((int) mbyAddress, 2);
+    DS_TRACE_END(DS_TRACE_REQUEST);
+#if DS_USE_BUS_TUNE
+    dspBusResult(2 <= mpWire->available());
+#endif
+    if(2 <= mpWire->available()) {     // if two bytes were received 
     
 #if defined(ARDUINO) && ARDUINO >= 100
-		miProtect = Wire.read();
-        miStatus  = Wire.read();
+		mbyProtect = mpWire->read();
+        mbyStatus  = mpWire->read();
 #else
-		miProtect = Wire.receive();
-        miStatus  = Wire.receive();
+		mbyProtect = mpWire->receive();
+        mbyStatus  = mpWire->receive();
 #endif        
         
         /*
@@ -622,24 +1233,24 @@ void DS2764::dspGetProtection(void) {
         */
         
 #ifdef DEBUG && (DEBUG > 1)
-        if (!miProtect & (DS00OV + DS00UV)) {
+        if (!mbyProtect & (DS00OV + DS00UV)) {
           Serial.println("      Voltage: OK");
         }
-        else if (miProtect & DS00OV) { 
+        else if (mbyProtect & DS00OV) { 
           Serial.println("      Voltage: *** OVER  ***"); 
         }
-        else if (miProtect & DS00UV) { 
+        else if (mbyProtect & DS00UV) { 
           Serial.println("      Voltage: *** UNDER ***"); 
         }
         
-        if (miProtect & DS00COC) { 
+        if (mbyProtect & DS00COC) { 
           Serial.println("   Charge Current: *** OVER  ***"); 
         }
         else {
           Serial.println("   Charge Current: OK");
         }
         
-        if (miProtect & DS00DOC) { 
+        if (mbyProtect & DS00DOC) { 
           Serial.println("Discharge Current: *** OVER  ***"); 
         }
         else {
@@ -647,35 +1258,35 @@ void DS2764::dspGetProtection(void) {
         }
         
         
-        if (miProtect & DS00CC) { 
+        if (mbyProtect & DS00CC) { 
             Serial.println("       Charging: *** OFF ***");
         }
         else {
             Serial.println("       Charging: ON");
         }
         
-        if (miProtect & DS00CE) { 
+        if (mbyProtect & DS00CE) { 
             Serial.println("       Charging: Enabled"); 
         }
         else {
             Serial.println("       Charging: Disabled");
         }
     
-        if (miProtect & DS00DC) { 
+        if (mbyProtect & DS00DC) { 
             Serial.println("    Discharging: *** OFF ***"); 
         }
         else {
             Serial.println("    Discharging: ON");
         }
         
-        if (miProtect & DS00DE) { 
+        if (mbyProtect & DS00DE) { 
             Serial.println("    Discharging: Enabled");
         }
         else {
             Serial.println("    Discharging: Disabled");
         }
         
-        if (miProtect & DS00SLP) { 
+        if (mbyProtect & DS00SLP) { 
             Serial.println("     Sleep mode: Enabled");
         }
         else {
@@ -685,15 +1296,16 @@ void DS2764::dspGetProtection(void) {
     }
     else {
         //Serial.println("Nothing Received from Get Protection Settings Request");
-        miProtect    = -1;
-        miStatus     = -1;
-
+        mbyProtect    = -1;
+        mbyStatus     = -1;
+        return false;
     }
 
     //Serial.print("dsStatus & DS00SLP: ");
     //Serial.print(dsStatus, HEX);
     //Serial.print(" ");
     //Serial.println(DS00SLP, HEX);
+    return true;
 }
 
 
@@ -714,44 +1326,42 @@ void DS2764::dspGetProtection(void) {
 //     float - the temperature in Celsius
 //------------------------------------------------------------------------------
 void DS2764::dspGetTemp(void) {
-    int reading = 0;
     
-    // Read Voltage Register
-    Wire.beginTransmission(DS_ADDRESS);
+    // Read Temperature Register
+    DS_TRACE_BEGIN(DS_TRACE_ADDRESS);
+    mpWire->beginTransmission(mbyAddress);
 
 #if defined(ARDUINO) && ARDUINO >= 100
-	Wire.write(DS_TEMP_REG_HIBYTE);
+	mpWire->write(DSTraits::TEMP_REG);
 #else
-	Wire.send(DS_TEMP_REG_HIBYTE);
+	mpWire->send(DSTraits::TEMP_REG);
 #endif
 
-    Wire.endTransmission();
+    mpWire->endTransmission();
+    DS_TRACE_END(DS_TRACE_ADDRESS);
 
-    Wire.requestFrom(DS_ADDRESS, 2);
+    DS_TRACE_BEGIN(DS_TRACE_REQUEST);
+    mpWire->requestFrom((int) mbyAddress, 2);
+    DS_TRACE_END(DS_TRACE_REQUEST);
     
-    if(2 <= Wire.available()) {     // if two bytes were received 
+#if DS_USE_BUS_TUNE
+    dspBusResult(2 <= mpWire->available());
+#endif
+    if(2 <= mpWire->available()) {     // if two bytes were received 
     
 #if defined(ARDUINO) && ARDUINO >= 100
-		reading = Wire.read();   // receive high byte (overwrites previous reading) 
-        reading = reading << 8;     // shift high byte to be high 8 bits 
-        reading += Wire.read();  // receive low byte as lower 8 bits 
-        reading = reading >> 5;
+		mabTemp[0] = mpWire->read();   // receive high byte
+        mabTemp[1] = mpWire->read();   // receive low byte
 #else
-		reading = Wire.receive();   // receive high byte (overwrites previous reading) 
-        reading = reading << 8;     // shift high byte to be high 8 bits 
-        reading += Wire.receive();  // receive low byte as lower 8 bits 
-        reading = reading >> 5;
+		mabTemp[0] = mpWire->receive();   // receive high byte
+        mabTemp[1] = mpWire->receive();   // receive low byte
 #endif
 
-        mfTempC = reading * 0.125;
-        
-        // Convert temperature to Fahrenheit        
-        mfTempF  = (mfTempC * 9.0 / 5.0) + 32.0;
+        mbyFlags |= DS_FLAG_TEMP_VALID;
     }
     else {
         //Serial.println("Nothing Received from Get Temp Request");
-        mfTempC = 0.0;
-        mfTempF = 0.0;
+        mbyFlags &= ~DS_FLAG_TEMP_VALID;
     }
 }
 
@@ -759,6 +1369,7 @@ void DS2764::dspGetTemp(void) {
 
 
 
+
 //------------------------------------------------------------------------------
 // dspGetVoltageAndCurrent
 //
@@ -775,80 +1386,119 @@ void DS2764::dspGetTemp(void) {
 //             gdCurrent, and giAccCurrent Global Variables.
 //------------------------------------------------------------------------------
 void DS2764::dspGetVoltageAndCurrent(void) {
-    int voltage   = 0;
-    int current   = 0;
-    int acurrent  = 0;
+    byte i = 0;
 
     // Read Voltage Register
-    Wire.beginTransmission(DS_ADDRESS);
+    DS_TRACE_BEGIN(DS_TRACE_ADDRESS);
+    mpWire->beginTransmission(mbyAddress);
     
 #if defined(ARDUINO) && ARDUINO >= 100
-	Wire.write(DS_VOLT_REG_HIBYTE);
+	mpWire->write(DSTraits::VOLT_REG);
 #else
-	Wire.send(DS_VOLT_REG_HIBYTE);
+	mpWire->send(DSTraits::VOLT_REG);
 #endif
 
-    Wire.endTransmission();
+    mpWire->endTransmission();
+    DS_TRACE_END(DS_TRACE_ADDRESS);
 
     // read 6 bytes, hi and lo byte for voltage
     // hi and low byte for current
     // hi and low byte for accumulated current
-    Wire.requestFrom(DS_ADDRESS, 6);
-    delay(4);
-    if(6 <= Wire.available())     // if six bytes were received 
+    DS_TRACE_BEGIN(DS_TRACE_REQUEST);
+    mpWire->requestFrom((int) mbyAddress, 6);
+    DS_TRACE_END(DS_TRACE_REQUEST);
+    DS_TRACED_DELAY(DS_TRACE_DELAY, 4);
+    if(6 <= mpWire->available())     // if six bytes were received 
     { 
+        for (i = 0; i < 6; i++) {
 #if defined(ARDUINO) && ARDUINO >= 100
-		voltage = Wire.read();
-        voltage = voltage << 8;
-        voltage += Wire.read();
-        voltage = voltage >> 5;
-        voltage = voltage * 4.88;
-        
-        current = Wire.read();
-        current = current << 8;
-        current += Wire.read();
-        
-        acurrent = Wire.read();
-        acurrent = acurrent << 8;
-        acurrent += Wire.read();
+            mabVoltAndCurrent[i] = mpWire->read();
 #else
-		voltage = Wire.receive();
-        voltage = voltage << 8;
-        voltage += Wire.receive();
-        voltage = voltage >> 5;
-        voltage = voltage * 4.88;
-        
-        current = Wire.receive();
-        current = current << 8;
-        current += Wire.receive();
-        
-        acurrent = Wire.receive();
-        acurrent = acurrent << 8;
-        acurrent += Wire.receive();
+            mabVoltAndCurrent[i] = mpWire->receive();
 #endif
-
-        if ((current & 0x80) == 0x80) {
-            current = (current ^ 0xFFFFFFFF);
-            current = current * -1;
         }
-        
-        current = current >> 3;
-
-        double c = (current * 0.625);
-        
-        acurrent = acurrent * 0.25;
-
-        miVolts      = voltage;
-        mfCurrent    = c;
-        miAccCurrent = acurrent;
+#if DS_USE_BUS_TUNE
+        dspBusResult(!(mabVoltAndCurrent[0] & 0x80));
+#endif
+        dspProcessFrame();
     }
     else {
+#if DS_USE_BUS_TUNE
+        dspBusResult(false);
+#endif
         //Serial.println("Nothing received from get Voltage Request");
 
-        miVolts         = 0;
-        mfCurrent       = 0.0;
-        miAccCurrent    = 0;
+        memset(mabVoltAndCurrent, 0, sizeof(mabVoltAndCurrent));
+        mbyFlags &= ~DS_FLAG_FRAME_VALID;
+    }
+}
+
+
+
+
+
+
+// Called each time a new voltage/current frame has been read, so everything
+// derived from it is updated from the same sample.
+void DS2764::dspProcessFrame(void) {
+    DS_TRACE_BEGIN(DS_TRACE_DECODE);
+    mbyFlags |= DS_FLAG_FRAME_VALID;
+#if DS_USE_FILTER
+    dspFilterFrame();
+#endif
+    dspUpdateAccumExt();
+#if DS_USE_ENERGY
+    dspUpdateEnergy();
+#endif
+#if DS_USE_CAPACITY_LEARNING
+    dspLearnCapacity();
+#endif
+#if DS_USE_RUNTIME
+    dspUpdateAverage();
+#endif
+    DS_TRACE_END(DS_TRACE_DECODE);
+}
+
+
+
+//------------------------------------------------------------------------------
+// dspUpdateAccumExt
+//
+// Moves mlAccCurrentExt along by however much the Accumulated Current
+// Register changed since the last read.  The low 16 bits of mlAccCurrentExt
+// always match the last good register value, so the change is just the 16 bit
+// difference and a failed read in between doesn't throw it off.
+//
+// With DS_USE_CHECKPOINT, discharge is also added up into the cycle count,
+// one cycle for each battery capacity worth of discharge.  Cycles are only
+// counted against a good capacity record: the 10mAh default, or a stored 0
+// read as 1mAh, would count one every few frames.  The cached capacity is
+// used so decoding a frame never starts a Block 0 read; until dsInitFast's
+// deferred read has happened the discharge is held and counted after it.
+//
+// Arguments:
+//     None
+//
+//------------------------------------------------------------------------------
+void DS2764::dspUpdateAccumExt(void) {
+    int16_t iDelta = word(mabVoltAndCurrent[4], mabVoltAndCurrent[5]) - (uint16_t) mlAccCurrentExt;
+
+    mlAccCurrentExt += iDelta;
+#if DS_USE_CHARGE_MARK
+    mulAccMillis     = mpClock();
+#endif
+
+#if DS_USE_CHECKPOINT
+    boolean bCapacity = (mbyFlags & DS_FLAG_CAPACITY_VALID) && miBatteryCapacity > 1;
+
+    if (iDelta < 0 && (bCapacity || !(mbyFlags & DS_FLAG_CAPACITY_LOADED))) {
+        mlCycleDischarge -= iDelta;
     }
+    if (bCapacity && dspScale(mlCycleDischarge, DSTraits::ACR_Q16) >= miBatteryCapacity) {
+        mlCycleDischarge -= dspScale(miBatteryCapacity, DSTraits::ACR_PER_MAH_Q16);
+        muiCycleCount++;
+    }
+#endif
 }
 
 
@@ -856,29 +1506,76 @@ void DS2764::dspGetVoltageAndCurrent(void) {
 
 
 
+#if DS_USE_POWER_SWITCH
 void DS2764::dspHandlePower(void) {  
   
     dspGetPowerSwitch();  
 
-    if ((!mbPowerSwitchOn) && mbPowerOn) {
+    if (!(mbyFlags & DS_FLAG_POWER_SWITCH_ON) && (mbyFlags & DS_FLAG_POWER_ON)) {
         // power down
-        mbPowerOn = false;
+        mbyFlags &= ~DS_FLAG_POWER_ON;
         dsResetProtection(DS_RESET_DISABLE);
         dspSetPowerSwitchOn();    // so we can detect when it's pushed again.
     }
-    else if((!mbPowerSwitchOn) && (!mbPowerOn)) {
+    else if(!(mbyFlags & DS_FLAG_POWER_SWITCH_ON) && !(mbyFlags & DS_FLAG_POWER_ON)) {
         // power up
-        mbPowerOn = true;
+        mbyFlags |= DS_FLAG_POWER_ON;
         dsResetProtection(DS_RESET_ENABLE);
         dspSetPowerSwitchOn();
     }
 
 }
+#endif
+
+
+
+
+
+//------------------------------------------------------------------------------
+// dspWriteProtection
+//
+// Writes the Protection Register and reads the Protection and Status
+// registers back.  Writing 0 to the OV and UV bits clears them, bits 1 and 0
+// enable charge and discharge.
+//
+// Arguments:
+//     int aiProtect - value to write to the Protection Register
+//
+//------------------------------------------------------------------------------
+void DS2764::dspWriteProtection(int aiProtect) {
+    byte    abRegs[2];
+
+    //Serial.print("About to send Protection Flags: ");
+    //Serial.println(lowByte(aiProtect), HEX);
+    
+    abRegs[0] = lowByte(aiProtect);
+    dspWriteBytes(DS_PROTECTION_REGISTER, abRegs, 1);
+    //delay(10);
+
+    // The write left the chip's address pointer past the Protection Register,
+    // point it back at 0x00 before reading both registers.
+    if (dspReadBytes(DS_PROTECTION_REGISTER, abRegs, 2)) {
+        mbyProtect = abRegs[0];
+        mbyStatus  = abRegs[1];
+    }
+    else {
+      //  Serial.println("Nothing received from resetdsProtection Request");
+        
+        mbyProtect = -1;
+        mbyStatus  = -1;        
+    }
+    //Serial.print("dspWriteProtection mbyProtect: ");
+    //Serial.println(mbyProtect, HEX);
+    //Serial.print("dspWriteProtection  mbyStatus: ");
+    //Serial.println(mbyStatus, HEX);
+
+}
 
 
 
 
 
+#if DS_USE_POWER_SWITCH
 //------------------------------------------------------------------------------
 // dspSetPowerSwitchOn
 //
@@ -898,49 +1595,41 @@ void DS2764::dspHandlePower(void) {
 //------------------------------------------------------------------------------
 void DS2764::dspSetPowerSwitchOn(void) {
     int dsSpecial  = 0;
+    byte bPs       = DS00PS;
 
-    // Read Protection Register
-    Wire.beginTransmission(DS_ADDRESS);
-
-#if defined(ARDUINO) && ARDUINO >= 100
-	Wire.write(DS_SPECIAL_FEATURE_REG);
-    Wire.write(DS00PS);
-#else
-	Wire.send(DS_SPECIAL_FEATURE_REG);
-    Wire.send(DS00PS);
-#endif
-
-	Wire.endTransmission();
+    // Set the PS bit in the Special Feature Register
+    dspWriteBytes(DS_SPECIAL_FEATURE_REG, &bPs, 1);
     delay(10);
-    Wire.requestFrom(DS_ADDRESS, 1);
-    if(1 <= Wire.available())     // if one byte was received 
+    mpWire->requestFrom((int) mbyAddress, 1);
+#if DS_USE_BUS_TUNE
+    dspBusResult(1 <= mpWire->available());
+#endif
+    if(1 <= mpWire->available())     // if one byte was received 
     { 
 
 #if defined(ARDUINO) && ARDUINO >= 100
-		dsSpecial = Wire.read();
+		dsSpecial = mpWire->read();
 #else
-		dsSpecial = Wire.receive();
+		dsSpecial = mpWire->receive();
 #endif
 
         if (dsSpecial & DS00PS) { 
             //Serial.println("PsSetON");
-            mbPowerSwitchOn = true;
+            mbyFlags |= DS_FLAG_POWER_SWITCH_ON;
         }
         else {
             //Serial.println("PsSetOFF");
-            mbPowerSwitchOn = false;
+            mbyFlags &= ~DS_FLAG_POWER_SWITCH_ON;
         }      
     }
 }
+#endif
 
 
 
 
 
-
-
-
-
+#if DS_USE_SLEEP
 //------------------------------------------------------------------------------
 // dspSetSleepMode
 //
@@ -967,49 +1656,45 @@ void DS2764::dspSetSleepMode(int aiValue) {
     int iReturn    = 0;
     int iJunk      = 0;
     int iShadow    = 0;
+    byte abBuf[1];
         
+    DS_TRACE_BEGIN(DS_TRACE_SLEEP_MODE);
     // set in bit 5 in Address 31h
         
     // Recall EEPROM Block 1 Data to Shadow RAM
-    Wire.beginTransmission(DS_ADDRESS);
-
-#if defined(ARDUINO) && ARDUINO >= 100
-	Wire.write(DS_FUNCTION_REGISTER);            // Write value to Function Command Address
-    Wire.write(DS_RECALL_EEPROM_BLK_1);          // Request refresh of Block 1 Shadow RAM from EEPROM
-#else
-	Wire.send(DS_FUNCTION_REGISTER);            // Write value to Function Command Address
-    Wire.send(DS_RECALL_EEPROM_BLK_1);          // Request refresh of Block 1 Shadow RAM from EEPROM
-#endif
-
-	Wire.endTransmission();
-    delay(500);
+    abBuf[0] = DS_RECALL_EEPROM_BLK_1;
+    dspWriteBytes(DS_FUNCTION_REGISTER, abBuf, 1);
+    DS_TRACED_DELAY(DS_TRACE_EEPROM_WAIT, 500);
         
         
     // Read second byte of Block 1 Shadow RAM
-    Wire.beginTransmission(DS_ADDRESS);
+    mpWire->beginTransmission(mbyAddress);
 
 #if defined(ARDUINO) && ARDUINO >= 100
-	Wire.write(DS_SLEEP_MODE_ADDR);
+	mpWire->write(DS_SLEEP_MODE_ADDR);
 #else
-	Wire.send(DS_SLEEP_MODE_ADDR);
+	mpWire->send(DS_SLEEP_MODE_ADDR);
 #endif
 
-	Wire.endTransmission();
-    delay(100);
-    Wire.requestFrom(DS_ADDRESS, 1);
+	mpWire->endTransmission();
+    DS_TRACED_DELAY(DS_TRACE_EEPROM_WAIT, 100);
+    mpWire->requestFrom((int) mbyAddress, 1);
+#if DS_USE_BUS_TUNE
+    dspBusResult(1 <= mpWire->available());
+#endif
 
-    if(1 <= Wire.available()) { 
+    if(1 <= mpWire->available()) { 
 
 #if defined(ARDUINO) && ARDUINO >= 100
-		iShadow = Wire.read();
+		iShadow = mpWire->read();
 #else
-		iShadow = Wire.receive();
+		iShadow = mpWire->receive();
 #endif
 		//Serial.print("BEFORE Address 31h, Shadow Block 1 Byte 1: ");
         //Serial.println(iShadow, HEX);
         
         //Serial.print("BEFORE giStatus Variable from Address 02h: ");
-        //Serial.println(miStatus, HEX);
+        //Serial.println(mbyStatus, HEX);
         }
     //else {
     //    Serial.println("NOData on Sleep Bit");
@@ -1039,71 +1724,47 @@ void DS2764::dspSetSleepMode(int aiValue) {
 //    Serial.println(iShadow, HEX);
 //#endif
         
-    Wire.beginTransmission(DS_ADDRESS);
-
-#if defined(ARDUINO) && ARDUINO >= 100
-	Wire.write(DS_SLEEP_MODE_ADDR);
-    Wire.write(iShadow);
-#else
-	Wire.send(DS_SLEEP_MODE_ADDR);
-    Wire.send(iShadow);
-#endif
-
-	Wire.endTransmission();
-    delay(10);
+    abBuf[0] = iShadow;
+    dspWriteBytes(DS_SLEEP_MODE_ADDR, abBuf, 1);
+    DS_TRACED_DELAY(DS_TRACE_EEPROM_WAIT, 10);
         
         
     // copy data back into EEPROM
-    Wire.beginTransmission(DS_ADDRESS);
-
-#if defined(ARDUINO) && ARDUINO >= 100
-	Wire.write(DS_FUNCTION_REGISTER);        // Write value to Function Command Address
-    Wire.write(DS_SAVE_EEPROM_BLK_1);        // Request Write of Block 1 Shadow RAM back into EEPROM
-#else
-	Wire.send(DS_FUNCTION_REGISTER);        // Write value to Function Command Address
-    Wire.send(DS_SAVE_EEPROM_BLK_1);        // Request Write of Block 1 Shadow RAM back into EEPROM
-#endif
-
-	Wire.endTransmission();
-    delay(1000);
+    abBuf[0] = DS_SAVE_EEPROM_BLK_1;
+    dspWriteBytes(DS_FUNCTION_REGISTER, abBuf, 1);
+    DS_TRACED_DELAY(DS_TRACE_EEPROM_WAIT, 1000);
     
     // now, that we've updated the EEPROM memory, lets request a refresh of the shadow memory.
     // do another EEPROM refresh.
     
     // Recall EEPROM Block 1 Data to Shadow RAM
-    Wire.beginTransmission(DS_ADDRESS);
-
-#if defined(ARDUINO) && ARDUINO >= 100
-	Wire.write(DS_FUNCTION_REGISTER);          // Write value to Function Command Address
-    Wire.write(DS_RECALL_EEPROM_BLK_1);        // Request refresh of Block 1 Shadow RAM from EEPROM
-#else
-	Wire.send(DS_FUNCTION_REGISTER);          // Write value to Function Command Address
-    Wire.send(DS_RECALL_EEPROM_BLK_1);        // Request refresh of Block 1 Shadow RAM from EEPROM
-#endif
-
-	Wire.endTransmission();
-    delay(1000);
+    abBuf[0] = DS_RECALL_EEPROM_BLK_1;
+    dspWriteBytes(DS_FUNCTION_REGISTER, abBuf, 1);
+    DS_TRACED_DELAY(DS_TRACE_EEPROM_WAIT, 1000);
         
         
     // Read second byte of Block 1 Shadow RAM
-    Wire.beginTransmission(DS_ADDRESS);
+    mpWire->beginTransmission(mbyAddress);
 
 #if defined(ARDUINO) && ARDUINO >= 100
-	Wire.write(DS_SLEEP_MODE_ADDR);
+	mpWire->write(DS_SLEEP_MODE_ADDR);
 #else
-	Wire.send(DS_SLEEP_MODE_ADDR);
+	mpWire->send(DS_SLEEP_MODE_ADDR);
 #endif
 	
-	Wire.endTransmission();
-    delay(100);
-    Wire.requestFrom(DS_ADDRESS, 1);
+	mpWire->endTransmission();
+    DS_TRACED_DELAY(DS_TRACE_EEPROM_WAIT, 100);
+    mpWire->requestFrom((int) mbyAddress, 1);
+#if DS_USE_BUS_TUNE
+    dspBusResult(1 <= mpWire->available());
+#endif
 
-    if(1 <= Wire.available()) { 
+    if(1 <= mpWire->available()) { 
 
 #if defined(ARDUINO) && ARDUINO >= 100
-		iShadow = Wire.read();
+		iShadow = mpWire->read();
 #else
-		iShadow = Wire.receive();
+		iShadow = mpWire->receive();
 #endif
 
 		//Serial.print("Address 31h - Shadow After Update and Refresh Block 1 Byte 1: ");
@@ -1115,22 +1776,2399 @@ void DS2764::dspSetSleepMode(int aiValue) {
     
     if((iShadow & DS00SLP) > 0) {
         //iReturn = 1;
-        mbSleepEnabled = true;
+        mbyFlags |= DS_FLAG_SLEEP_ENABLED;
     }
     else {
         //iReturn = 0;
-        mbSleepEnabled = false;
+        mbyFlags &= ~DS_FLAG_SLEEP_ENABLED;
+    }
+
+    DS_TRACE_END(DS_TRACE_SLEEP_MODE);
+}
+#endif
+
+
+
+
+
+
+#if DS_USE_CHECKPOINT
+unsigned int DS2764::dsGetCycleCount(void) {
+    return muiCycleCount;
+}
+
+
+
+// Minimum time in ms between checkpoint saves.  Each save is one write cycle
+// of EEPROM Block 2, so keep this long; the default of an hour is under
+// 9000 writes a year.
+void DS2764::dsSetCheckpointInterval(unsigned long aulMillis) {
+    mulCheckpointInterval = aulMillis;
+}
+
+
+
+//------------------------------------------------------------------------------
+// dsCheckpoint
+//
+// Saves the extended accumulated current, battery capacity and cycle count
+// to EEPROM Block 2 so dsRestoreCheckpoint can pick them up after the
+// Arduino is reset.  Call it as often as you like, it only writes once
+// the checkpoint interval has passed and something has changed.
+//
+// Block 2 holds two 8 byte records and each save goes into the slot that
+// doesn't hold the newest one, so if power is lost part way through a save
+// the other record is still good.  The gauge copies the whole block to EEPROM
+// on every save, so the slots don't spread the wear out; that is what the
+// interval is for.
+//
+// Record layout:
+//     0-1  sequence number (top 4 bits) and cycle count (low 12 bits)
+//     2-4  extended accumulated current, .25mAh units, 24 bit signed
+//     5-6  battery capacity in mAh
+//     7    Dallas/Maxim CRC8 of bytes 0-6, inverted so a blank block of
+//          zeros doesn't pass as a record
+//
+// Arguments:
+//     None
+//
+// Return Value:
+//     true if a checkpoint was saved.
+//------------------------------------------------------------------------------
+boolean DS2764::dsCheckpoint(void) {
+    byte    abRecord[DS_CHECKPOINT_RECORD_LEN];
+    byte    abNewest[DS_CHECKPOINT_RECORD_LEN];
+    byte    bSlot   = (mbyCheckpointSeq & 0x80) ? 0 : 1;
+    byte    bSeq    = (mbyCheckpointSeq + 1) & 0x0F;
+
+    if (mpClock() - mulCheckpointMillis < mulCheckpointInterval) {
+        return false;
+    }
+
+    // Nothing to do if the newest record already matches.
+    dspEncodeCheckpoint(abNewest, mbyCheckpointSeq & 0x0F);
+    if (dspReadBytes(DS_EEPROM_BLOCK2_START + (1 - bSlot) * DS_CHECKPOINT_RECORD_LEN,
+                     abRecord, DS_CHECKPOINT_RECORD_LEN) == DS_CHECKPOINT_RECORD_LEN
+        && memcmp(abRecord, abNewest, DS_CHECKPOINT_RECORD_LEN) == 0) {
+        mulCheckpointMillis = mpClock();
+        return false;
     }
 
+    dspEncodeCheckpoint(abRecord, bSeq);
+
+    // Write the record to the Block 2 Shadow RAM, then copy it into EEPROM
+    dspWriteBytes(DS_EEPROM_BLOCK2_START + bSlot * DS_CHECKPOINT_RECORD_LEN,
+                  abRecord, DS_CHECKPOINT_RECORD_LEN);
+    abRecord[0] = DS_SAVE_EEPROM_BLK_2;
+    dspWriteBytes(DS_FUNCTION_REGISTER, abRecord, 1);
+    delay(10);
+
+    mbyCheckpointSeq    = bSeq | (bSlot << 7);
+    mulCheckpointMillis = mpClock();
+    return true;
 }
 
 
 
+//------------------------------------------------------------------------------
+// dsRestoreCheckpoint
+//
+// Reads both records from EEPROM Block 2 with one request and restores the
+// newest one with a good CRC.  Call it right after dsInit or dsInitFast.
+// The gauge keeps counting while the Arduino is reset, so the extended
+// accumulated current picks up whatever the register moved since the
+// record was saved.  The battery capacity is taken from the record, which
+// saves dsInitFast's deferred Block 0 read.
+//
+// Arguments:
+//     None
+//
+// Return Value:
+//     true if a record was restored, false if neither record was valid.
+//------------------------------------------------------------------------------
+boolean DS2764::dsRestoreCheckpoint(void) {
+    byte    abBlock[DS_CHECKPOINT_SLOTS * DS_CHECKPOINT_RECORD_LEN];
+    byte    *abRecord   = 0;
+    byte    bValid      = 0;
+    byte    bSlot       = 0;
+    byte    abSeq[DS_CHECKPOINT_SLOTS];
+
+    if (dspReadBytes(DS_EEPROM_BLOCK2_START, abBlock, sizeof(abBlock)) < sizeof(abBlock)) {
+        return false;
+    }
+
+    for (bSlot = 0; bSlot < DS_CHECKPOINT_SLOTS; bSlot++) {
+        abRecord = &abBlock[bSlot * DS_CHECKPOINT_RECORD_LEN];
+        abSeq[bSlot] = abRecord[0] >> 4;
+        if ((byte) ~dspCrc8(abRecord, DS_CHECKPOINT_RECORD_LEN - 1) == abRecord[DS_CHECKPOINT_RECORD_LEN - 1]) {
+            bValid |= (1 << bSlot);
+        }
+    }
+
+    if (bValid == 0) {
+        return false;
+    }
+    else if (bValid == 0x03) {
+        // Slot 1 is newer if its sequence number is 1 to 7 ahead of slot 0's.
+        bSlot = ((byte) (((abSeq[1] - abSeq[0]) & 0x0F) - 1) < 7) ? 1 : 0;
+    }
+    else {
+        bSlot = (bValid == 0x02) ? 1 : 0;
+    }
+    abRecord = &abBlock[bSlot * DS_CHECKPOINT_RECORD_LEN];
+
+    muiCycleCount   = word(abRecord[0] & 0x0F, abRecord[1]);
+    mlAccCurrentExt = ((long) (int8_t) abRecord[2] << 16) | ((long) abRecord[3] << 8) | abRecord[4];
+    dspUpdateAccumExt();
+#if DS_USE_CHARGE_MARK
+    mbyAccEpoch++;
+#endif
+
+    miBatteryCapacity = word(abRecord[5], abRecord[6]);
+    if (miBatteryCapacity < 1) {
+        miBatteryCapacity = 1;
+    }
+    mbyFlags |= DS_FLAG_CAPACITY_LOADED | DS_FLAG_CAPACITY_VALID;
+
+    mbyCheckpointSeq    = abSeq[bSlot] | (bSlot << 7);
+    mulCheckpointMillis = mpClock();
+    return true;
+}
 
 
 
+// Fills in an 8 byte checkpoint record from the current state.
+void DS2764::dspEncodeCheckpoint(byte *abRecord, byte abSeq) {
+    unsigned int uiCycles = (muiCycleCount > 0x0FFF) ? 0x0FFF : muiCycleCount;
+    int          iCapacity = dsGetBatteryCapacity();
 
+    abRecord[0] = (abSeq << 4) | highByte(uiCycles);
+    abRecord[1] = lowByte(uiCycles);
+    abRecord[2] = mlAccCurrentExt >> 16;
+    abRecord[3] = mlAccCurrentExt >> 8;
+    abRecord[4] = mlAccCurrentExt;
+    abRecord[5] = highByte(iCapacity);
+    abRecord[6] = lowByte(iCapacity);
+    abRecord[7] = ~dspCrc8(abRecord, DS_CHECKPOINT_RECORD_LEN - 1);
+}
 
 
 
+// Dallas/Maxim CRC8 (x^8 + x^5 + x^4 + 1), same as the 1-Wire ROM CRC.
+byte DS2764::dspCrc8(const byte *abData, byte abLen) {
+    byte    bCrc    = 0;
+    byte    i       = 0;
 
+    while (abLen--) {
+        bCrc ^= *abData++;
+        for (i = 0; i < 8; i++) {
+            bCrc = (bCrc & 0x01) ? (bCrc >> 1) ^ 0x8C : (bCrc >> 1);
+        }
+    }
+    return bCrc;
+}
+#endif
+
+
+
+
+
+
+#if DS_USE_ENERGY
+//------------------------------------------------------------------------------
+// dspUpdateEnergy
+//
+// Integrates power into the charge and discharge energy totals.  Power is
+// worked out in uW from the voltage and current of the frame just read, and
+// each step uses the average of this sample's power and the last one over the
+// time between them (trapezoid rule).  The totals are 64 bit uW x ms, which
+// is good for thousands of years at 10W.
+//
+// Arguments:
+//     None
+//
+//------------------------------------------------------------------------------
+void DS2764::dspUpdateEnergy(void) {
+    unsigned long ulNow   = mpClock();
+    unsigned long ulDelta = ulNow - mulEnergyLast;
+    long    lPower  = ((int64_t) dsGetBatteryVoltage() * dsGetCurrentRaw() * DSTraits::CURRENT_Q16) >> 16;
+    int64_t llStep  = (int64_t) (mlPower + lPower) * (int64_t) ulDelta / 2;
+
+    if (llStep > 0) {
+        mllChargeEnergy += llStep;
+    }
+    else {
+        mllDischargeEnergy -= llStep;
+    }
+
+    mlPower       = lPower;
+    mulEnergyLast = ulNow;
+}
+
+
+
+// Power in mW from the last dsRefresh, + when charging, - when discharging.
+long DS2764::dsGetPower(void) {
+    return mlPower / 1000;
+}
+
+
+
+// Average power in mW since dsInit or dsResetEnergy.
+long DS2764::dsGetAveragePower(void) {
+    unsigned long ulElapsed = mulEnergyLast - mulEnergyStart;
+
+    if (ulElapsed == 0) {
+        return dsGetPower();
+    }
+    return (mllChargeEnergy - mllDischargeEnergy) / (int64_t) ulElapsed / 1000;
+}
+
+
+
+// Energy in mWh taken in while charging.
+long DS2764::dsGetChargeEnergy(void) {
+    return mllChargeEnergy / 3600000000LL;
+}
+
+
+
+// Energy in mWh delivered while discharging.
+long DS2764::dsGetDischargeEnergy(void) {
+    return mllDischargeEnergy / 3600000000LL;
+}
+
+
+
+// Zeroes the energy totals and starts the average power over from now.
+void DS2764::dsResetEnergy(void) {
+    mllChargeEnergy    = 0;
+    mllDischargeEnergy = 0;
+    mlPower            = 0;
+    mulEnergyStart     = mpClock();
+    mulEnergyLast      = mulEnergyStart;
+}
+#endif
+
+
+
+
+
+
+#if DS_USE_OCV_SOC
+//------------------------------------------------------------------------------
+// dsGetOcvStateOfCharge
+//
+// Looks the battery voltage up in the open circuit voltage table with a
+// binary search and interpolates between the two points around it.  Only
+// meaningful when the battery has been resting, under load the voltage sags
+// and this reads low.
+//
+// Arguments:
+//     None
+//
+// Return Value:
+//     int - state of charge in tenths of a percent, 0 - 1000.
+//------------------------------------------------------------------------------
+int DS2764::dsGetOcvStateOfCharge(void) {
+    int     iVolts  = dsGetBatteryVoltage();
+    byte    bLow    = 0;
+    byte    bHigh   = mbyOcvCount - 1;
+    byte    bMid    = 0;
+    int     iV0     = 0;
+    int     iV1     = 0;
+    int     iS0     = 0;
+    int     iS1     = 0;
+    unsigned int uiFrac = 0;      // position between the two points, Q8
+
+    if (iVolts <= (int) pgm_read_word(&mpOcvTable[0].millivolts)) {
+        return pgm_read_word(&mpOcvTable[0].permille);
+    }
+    if (iVolts >= (int) pgm_read_word(&mpOcvTable[bHigh].millivolts)) {
+        return pgm_read_word(&mpOcvTable[bHigh].permille);
+    }
+
+    // find the segment with table[bLow] < iVolts <= table[bHigh]
+    while (bHigh - bLow > 1) {
+        bMid = (bLow + bHigh) >> 1;
+        if (iVolts > (int) pgm_read_word(&mpOcvTable[bMid].millivolts)) {
+            bLow = bMid;
+        }
+        else {
+            bHigh = bMid;
+        }
+    }
+
+    iV0 = pgm_read_word(&mpOcvTable[bLow].millivolts);
+    iV1 = pgm_read_word(&mpOcvTable[bHigh].millivolts);
+    iS0 = pgm_read_word(&mpOcvTable[bLow].permille);
+    iS1 = pgm_read_word(&mpOcvTable[bHigh].permille);
+
+    if (iV1 - iV0 < 256) {
+        uiFrac = ((unsigned int) (iVolts - iV0) << 8) / (unsigned int) (iV1 - iV0);
+    }
+    else {
+        uiFrac = ((unsigned long) (iVolts - iV0) << 8) / (unsigned long) (iV1 - iV0);
+    }
+    return iS0 + (int) (((long) (iS1 - iS0) * uiFrac) >> 8);
+}
+
+
+
+//------------------------------------------------------------------------------
+// dsGetStateOfCharge
+//
+// State of charge from the accumulated current and battery capacity,
+// pulled toward the open circuit voltage estimate as the current gets near
+// zero.  At or below the rest current (see dsSetRestCurrent) the voltage is
+// weighted the most, at zero it's used alone.  If the battery capacity was
+// never saved with dsSetBatteryCapacity only the voltage is used.
+//
+// Arguments:
+//     None
+//
+// Return Value:
+//     int - state of charge in tenths of a percent, 0 - 1000.
+//------------------------------------------------------------------------------
+int DS2764::dsGetStateOfCharge(void) {
+    int     iCapacity = dsGetBatteryCapacity();
+    int     iOcv    = dsGetOcvStateOfCharge();
+    int     iCount  = 0;
+    long    lCurrent = dsGetCurrentRaw();
+    unsigned int uiWeight = 0;    // weight of the voltage estimate, Q8
+
+    if (!(mbyFlags & DS_FLAG_CAPACITY_VALID)) {
+        return iOcv;
+    }
+
+    iCount = constrain(dsGetAccumulatedCurrent() * 1000L / iCapacity, 0, 1000);
+
+    lCurrent = dspScale((lCurrent < 0) ? -lCurrent : lCurrent, DSTraits::CURRENT_Q16);
+    if (lCurrent < miRestCurrent) {
+        uiWeight = 256 - (((unsigned long) lCurrent * mulRestRecip) >> 16);
+    }
+    return iCount + (int) (((long) (iOcv - iCount) * uiWeight) >> 8);
+}
+
+
+
+// Uses a different open circuit voltage table, which has to be in PROGMEM.
+// The default is DS_OCV_LIION.
+void DS2764::dsSetOcvTable(const DSOcvPoint *apTable, byte abCount) {
+    mpOcvTable  = apTable;
+    mbyOcvCount = abCount;
+}
+
+
+
+// Current in mA below which dsGetStateOfCharge starts trusting the battery
+// voltage, DS_REST_CURRENT by default.
+void DS2764::dsSetRestCurrent(int aiMilliAmps) {
+    miRestCurrent = (aiMilliAmps > 0) ? aiMilliAmps : 1;
+    mulRestRecip  = 0x1000000UL / miRestCurrent;
+}
+#endif
+
+
+
+
+
+
+#if DS_USE_CAPACITY_LEARNING
+// Voltages in mV that count as full (once the charge current has tapered
+// below DS_LEARN_TAPER_CURRENT) and as empty.
+void DS2764::dsSetLearningVoltages(int aiFullVolts, int aiEmptyVolts) {
+    miLearnFullVolts  = aiFullVolts;
+    miLearnEmptyVolts = aiEmptyVolts;
+}
+
+
+
+// How far, in percent, the learned capacity may drift from the one saved in
+// EEPROM Block 0 before it is saved again.  Without DS_USE_BUS_QUEUE the
+// save blocks the dsRefresh that makes it for about 0.6 seconds.
+void DS2764::dsSetCapacityDrift(byte abPercent) {
+    mbyDriftPercent = abPercent;
+}
+
+
+
+//------------------------------------------------------------------------------
+// dspLearnCapacity
+//
+// Watches each new frame for the points that tell us how big the battery
+// really is:
+//
+// Full to empty - the accumulated current is noted when the battery reaches
+// full and charging has tapered off.  If it then runs down to empty without
+// being charged in between, the charge taken out is the capacity.
+//
+// Voltage anchored (with DS_USE_OCV_SOC) - whenever the battery is resting
+// the open circuit voltage gives a state of charge.  Once it has moved by
+// DS_LEARN_MIN_SWING from the last anchor, the charge that moved in between
+// divided by the change in state of charge is the capacity.
+//
+// Learned values adjust the capacity in RAM right away.  It is only written
+// to EEPROM Block 0 (with dsSetBatteryCapacity, which blocks for about
+// 600ms, or queued for dsService with DS_USE_BUS_QUEUE) when it has drifted
+// past the dsSetCapacityDrift limit.
+//
+// Arguments:
+//     None
+//
+//------------------------------------------------------------------------------
+void DS2764::dspLearnCapacity(void) {
+    int     iVolts      = dsGetBatteryVoltage();
+    long    lCurrent    = dspScale(dsGetCurrentRaw(), DSTraits::CURRENT_Q16);
+    boolean bUnder      = (mbyProtect != 0xFF) && (mbyProtect & DS00UV);
+
+    if (iVolts >= miLearnFullVolts && lCurrent >= 0 && lCurrent < DS_LEARN_TAPER_CURRENT) {
+        mbyLearnState  = DS_LEARN_FROM_FULL;
+        mlLearnFullAcc = mlAccCurrentExt;
+    }
+    else if (mbyLearnState == DS_LEARN_FROM_FULL) {
+        if (lCurrent >= DS_LEARN_TAPER_CURRENT) {
+            // charged part way before reaching empty, start over
+            mbyLearnState = DS_LEARN_IDLE;
+        }
+        else if (bUnder || iVolts <= miLearnEmptyVolts) {
+            dspUpdateCapacity(dspScale(mlLearnFullAcc - mlAccCurrentExt, DSTraits::ACR_Q16), 1);
+            mbyLearnState = DS_LEARN_IDLE;
+        }
+    }
+
+#if DS_USE_OCV_SOC
+    if (lCurrent > -miRestCurrent && lCurrent < miRestCurrent) {
+        int     iSoc    = dsGetOcvStateOfCharge();
+        int     iSwing  = iSoc - miLearnAnchorSoc;
+        long    lMoved  = dspScale(mlAccCurrentExt - mlLearnAnchorAcc, DSTraits::ACR_Q16);
+
+        if (miLearnAnchorSoc >= 0 && (iSwing >= DS_LEARN_MIN_SWING || iSwing <= -DS_LEARN_MIN_SWING)) {
+            dspUpdateCapacity(lMoved * 1000 / iSwing, 2);
+            miLearnAnchorSoc = -1;
+        }
+        if (miLearnAnchorSoc < 0) {
+            miLearnAnchorSoc = iSoc;
+            mlLearnAnchorAcc = mlAccCurrentExt;
+        }
+    }
+#endif
+}
+
+
+
+//------------------------------------------------------------------------------
+// dspUpdateCapacity
+//
+// Folds a measured capacity into the one in RAM and saves it to EEPROM
+// Block 0 if it has drifted too far from the saved value.  Measurements
+// outside half to one and a half times the current capacity are thrown out,
+// unless there is no saved capacity yet, and so are any made before
+// dsInitFast's deferred Block 0 read has run, since this runs in the middle
+// of decoding a frame and mustn't start that read itself.
+//
+// Without DS_USE_BUS_QUEUE the save is dsSetBatteryCapacity, which blocks
+// for about 0.6 seconds inside the dsRefresh that found the drift.  With the
+// queue it is submitted and done by dsService a step at a time.
+//
+// Arguments:
+//     long alMeasured - measured capacity in mAh
+//     byte abShift    - how much to smooth, the capacity moves 1/2^abShift
+//                       of the way to the measurement
+//
+//------------------------------------------------------------------------------
+void DS2764::dspUpdateCapacity(long alMeasured, byte abShift) {
+    int     iCapacity   = miBatteryCapacity;
+    int     iDrift      = 0;
+
+    if (alMeasured < 1 || alMeasured > 32767 || !(mbyFlags & DS_FLAG_CAPACITY_LOADED)) {
+        return;
+    }
+
+    if (!(mbyFlags & DS_FLAG_CAPACITY_VALID)) {
+        iCapacity = alMeasured;
+        mbyFlags |= DS_FLAG_CAPACITY_VALID;
+    }
+    else if (alMeasured < iCapacity / 2 || alMeasured > (long) iCapacity + iCapacity / 2) {
+        return;
+    }
+    else {
+        iCapacity += (alMeasured - iCapacity) >> abShift;
+    }
+    miBatteryCapacity = iCapacity;
+
+    iDrift = iCapacity - miStoredCapacity;
+    if (iDrift < 0) {
+        iDrift = -iDrift;
+    }
+    if (miStoredCapacity == 0 || (long) iDrift * 100 > (long) miStoredCapacity * mbyDriftPercent) {
+#if DS_USE_BUS_QUEUE
+        dsSubmitBatteryCapacity(iCapacity);	// saved by dsService, without blocking
+#else
+        dsSetBatteryCapacity(iCapacity);
+#endif
+    }
+}
+#endif
+
+
+
+
+
+
+#if DS_USE_RUNTIME
+//------------------------------------------------------------------------------
+// dspUpdateAverage
+//
+// Moves the average current toward the latest reading by the fraction of the
+// time constant that has passed since the last frame, so the average settles
+// the same way however often dsRefresh is called.  One multiply per frame
+// and no history is kept.
+//
+// Arguments:
+//     None
+//
+//------------------------------------------------------------------------------
+void DS2764::dspUpdateAverage(void) {
+    unsigned long ulNow     = mpClock();
+    unsigned long ulDelta   = ulNow - mulAvgLast;
+    long    lCurrent        = ((long) dsGetCurrentRaw() * DSTraits::CURRENT_Q16) >> 8;
+    long    lAlpha          = 0x10000L;	// Q16 weight of the new reading
+
+    if ((mbyFlags & DS_FLAG_AVERAGE_VALID) && ulDelta < mulAvgMillis) {
+        lAlpha = (ulDelta * mulAvgRecip) >> 16;
+    }
+    mlAvgCurrent += ((int64_t) (lCurrent - mlAvgCurrent) * lAlpha) >> 16;
+
+    mulAvgLast = ulNow;
+    mbyFlags |= DS_FLAG_AVERAGE_VALID;
+}
+
+
+
+// Average current in mA, + when charging, - when discharging.
+int DS2764::dsGetAverageCurrent(void) {
+    return mlAvgCurrent / 256;
+}
+
+
+
+//------------------------------------------------------------------------------
+// dsGetTimeToEmpty
+//
+// Seconds until the accumulated current runs out at the average current.
+//
+// Arguments:
+//     None
+//
+// Return Value:
+//     unsigned long - seconds, DS_TIME_UNKNOWN if the battery isn't
+//                     discharging
+//------------------------------------------------------------------------------
+unsigned long DS2764::dsGetTimeToEmpty(void) {
+    long    lRemaining  = dsGetAccumulatedCurrentExt();
+    long    lDrain      = -mlAvgCurrent >> 4;	// mA x 16
+
+    if (lDrain <= 0) {
+        return DS_TIME_UNKNOWN;
+    }
+    if (lRemaining < 0) {
+        lRemaining = 0;
+    }
+    return (unsigned long) lRemaining * 57600 / lDrain;	// 3600 x 16
+}
+
+
+
+#if DS_USE_CAPACITY_EEPROM
+//------------------------------------------------------------------------------
+// dsGetTimeToFull
+//
+// Seconds until the accumulated current reaches the battery capacity at the
+// average current.
+//
+// Arguments:
+//     None
+//
+// Return Value:
+//     unsigned long - seconds, DS_TIME_UNKNOWN if the battery isn't charging
+//------------------------------------------------------------------------------
+unsigned long DS2764::dsGetTimeToFull(void) {
+    long    lMissing    = dsGetBatteryCapacity() - dsGetAccumulatedCurrentExt();
+    long    lCharge     = mlAvgCurrent >> 4;	// mA x 16
+
+    if (lCharge <= 0) {
+        return DS_TIME_UNKNOWN;
+    }
+    if (lMissing < 0) {
+        lMissing = 0;
+    }
+    return (unsigned long) lMissing * 57600 / lCharge;
+}
+#endif
+
+
+
+// Time constant of the average current in seconds, DS_AVERAGE_TIME by
+// default.  After this long a step in current has moved the average about
+// two thirds of the way.
+void DS2764::dsSetAverageTime(unsigned int auiSeconds) {
+    mulAvgMillis = (auiSeconds > 0) ? auiSeconds * 1000UL : 1000UL;
+    mulAvgRecip  = 0xFFFFFFFFUL / mulAvgMillis;
+}
+#endif
+
+
+
+
+
+
+#if DS_USE_WATCH
+//------------------------------------------------------------------------------
+// dsSetWatches
+//
+// Hands the driver a table of thresholds to check after each dsRefresh.
+// The table stays owned by the sketch and has to outlive the driver's use
+// of it.  Pass NULL and 0 to stop watching.
+//
+// Arguments:
+//     DSWatch *apWatches          - the table
+//     byte abCount                - number of entries
+//     DSWatchCallback apCallback  - called when a watch trips or clears,
+//                                   may be NULL
+//
+//------------------------------------------------------------------------------
+void DS2764::dsSetWatches(DSWatch *apWatches, byte abCount, DSWatchCallback apCallback) {
+    byte    i   = 0;
+
+    for (i = 0; i < abCount; i++) {
+        apWatches[i].mode &= DS_WATCH_BELOW;
+    }
+    mpWatches       = apWatches;
+    mbyWatchCount   = abCount;
+    mpWatchCallback = apCallback;
+}
+
+
+
+// true if watch abIndex of the table is tripped.
+boolean DS2764::dsIsWatchTripped(byte abIndex) {
+    return abIndex < mbyWatchCount && (mpWatches[abIndex].mode & DS_WATCH_TRIPPED);
+}
+
+
+
+//------------------------------------------------------------------------------
+// dspCheckWatches
+//
+// Decodes each channel once, then makes a single pass over the watch table.
+// The callback is only made when a watch changes state.  Channels whose last
+// read failed are skipped, so a bus error can't trip or clear anything.
+//
+// Arguments:
+//     None
+//
+//------------------------------------------------------------------------------
+void DS2764::dspCheckWatches(void) {
+    long    alValue[DS_WATCH_CHANNELS];
+    byte    bValid  = 0;	// bit per channel
+    unsigned long ulNow = mpClock();
+    DSWatch *pWatch = mpWatches;
+    long    lValue  = 0;
+    boolean bPast   = false;
+    byte    i       = 0;
+
+    if (mbyWatchCount == 0) {
+        return;
+    }
+
+    if (mbyFlags & DS_FLAG_FRAME_VALID) {
+        alValue[DS_WATCH_VOLTAGE] = dsGetBatteryVoltage();
+        alValue[DS_WATCH_CURRENT] = dspScale(dsGetCurrentRaw(), DSTraits::CURRENT_Q16);
+        alValue[DS_WATCH_ACCUM]   = dsGetAccumulatedCurrentExt();
+        bValid |= (1 << DS_WATCH_VOLTAGE) | (1 << DS_WATCH_CURRENT) | (1 << DS_WATCH_ACCUM);
+#if DS_USE_RUNTIME
+        alValue[DS_WATCH_AVERAGE_CURRENT] = dsGetAverageCurrent();
+        bValid |= (1 << DS_WATCH_AVERAGE_CURRENT);
+#endif
+    }
+    if (mbyFlags & DS_FLAG_TEMP_VALID) {
+        alValue[DS_WATCH_TEMP]    = dsGetTempRaw();
+        bValid |= (1 << DS_WATCH_TEMP);
+    }
+
+    for (i = 0; i < mbyWatchCount; i++, pWatch++) {
+        if (pWatch->channel >= DS_WATCH_CHANNELS || !(bValid & (1 << pWatch->channel))) {
+            continue;
+        }
+        lValue = alValue[pWatch->channel];
+
+        if (pWatch->mode & DS_WATCH_TRIPPED) {
+            if (pWatch->mode & DS_WATCH_BELOW) {
+                bPast = lValue > (long) pWatch->threshold + pWatch->hysteresis;
+            }
+            else {
+                bPast = lValue < (long) pWatch->threshold - pWatch->hysteresis;
+            }
+            if (bPast) {
+                pWatch->mode &= ~DS_WATCH_TRIPPED;
+                if (mpWatchCallback) {
+                    DS_TRACE_BEGIN(DS_TRACE_DISPATCH);
+                    mpWatchCallback(i, false);
+                    DS_TRACE_END(DS_TRACE_DISPATCH);
+                }
+            }
+            continue;
+        }
+
+        if (pWatch->mode & DS_WATCH_BELOW) {
+            bPast = lValue < pWatch->threshold;
+        }
+        else {
+            bPast = lValue > pWatch->threshold;
+        }
+        if (!bPast) {
+            pWatch->mode &= ~DS_WATCH_PENDING;
+            continue;
+        }
+        if (!(pWatch->mode & DS_WATCH_PENDING)) {
+            pWatch->mode |= DS_WATCH_PENDING;
+            pWatch->since = ulNow;
+        }
+        if (ulNow - pWatch->since >= pWatch->dwell) {
+            pWatch->mode = (pWatch->mode & ~DS_WATCH_PENDING) | DS_WATCH_TRIPPED;
+            if (mpWatchCallback) {
+                DS_TRACE_BEGIN(DS_TRACE_DISPATCH);
+                mpWatchCallback(i, true);
+                DS_TRACE_END(DS_TRACE_DISPATCH);
+            }
+        }
+    }
+}
+#endif
+
+
+
+
+
+
+#if DS_USE_BUS_QUEUE
+//------------------------------------------------------------------------------
+// dsService
+//
+// Runs one step of the highest priority job that is due.  A step is one
+// short group of bus transactions that leaves nothing half done on the
+// bus, so other devices can use Wire between calls.  The waits the EEPROM
+// needs between steps (up to a second) are due times rather than delay(),
+// and a protection poll submitted in the meantime goes ahead of them.
+// When a job's last step has run its completion callback is called from
+// here.
+//
+// Call it from loop() as often as possible.
+//
+// Arguments:
+//     None
+//
+// Return Value:
+//     boolean - true if a step was run
+//------------------------------------------------------------------------------
+boolean DS2764::dsService(void) {
+    unsigned long ulNow = mpClock();
+    byte    i   = 0;
+
+    for (i = 0; i < DS_JOBS; i++) {
+        if (mabJobStep[i] && (long) (ulNow - maulJobDue[i]) >= 0) {
+            DS_TRACE_BEGIN(DS_TRACE_SERVICE);
+#if DS_USE_BUS_STATS
+            dspBusBegin();
+            dspRunJob(i);
+            dspBusEnd();
+#else
+            dspRunJob(i);
+#endif
+            DS_TRACE_END(DS_TRACE_SERVICE);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+
+// true while job abJob (DS_JOB_xxx) has steps left to run.
+boolean DS2764::dsIsPending(byte abJob) {
+    return abJob < DS_JOBS && mabJobStep[abJob] != 0;
+}
+
+
+
+//------------------------------------------------------------------------------
+// dsSubmitXxx
+//
+// Each of these queues the matching blocking call as a job for dsService
+// and returns right away.  Only one job of each kind can be pending; if one
+// already is, nothing is queued and false is returned.
+//
+// Arguments:
+//     same as the blocking call, plus
+//     DSDoneCallback apDone - called when the job has finished, may be NULL
+//
+// Return Value:
+//     boolean - true if the job was queued
+//------------------------------------------------------------------------------
+boolean DS2764::dsSubmitRefresh(DSDoneCallback apDone) {
+#if DS_USE_STANDBY
+    if (mbStandby) {
+        return false;
+    }
+#endif
+    if (!dspSubmitJob(DS_JOB_REFRESH, apDone)) {
+        return false;
+    }
+#if DS_USE_SYNC_SAMPLING
+    // hold off until just after the next conversion
+    if (muiConvPeriod && !mbyConvLearn && (long) (mulFrameDue - maulJobDue[DS_JOB_REFRESH]) > 0) {
+        maulJobDue[DS_JOB_REFRESH] = mulFrameDue;
+    }
+#endif
+#if DS_USE_BUS_STATS
+    mulSampleStart = micros();
+#endif
+    return true;
+}
+
+
+
+boolean DS2764::dsSubmitResetProtection(int aiOn, DSDoneCallback apDone) {
+    if (!dspSubmitJob(DS_JOB_RESET, apDone)) {
+        return false;
+    }
+    mbyJobReset = (aiOn == DS_RESET_ENABLE) ? DS_PROTECTION_CLEAR_ENABLE : DS_PROTECTION_CLEAR_DISABLE;
+    return true;
+}
+
+
+
+boolean DS2764::dsSubmitAccumCurrent(int aiNewVal, DSDoneCallback apDone) {
+    if (!dspSubmitJob(DS_JOB_ACCUM, apDone)) {
+        return false;
+    }
+    miJobAccum = dspScale(aiNewVal, DSTraits::ACR_PER_MAH_Q16);
+    return true;
+}
+
+
+
+#if DS_USE_PROTECTION_POLL
+boolean DS2764::dsSubmitPoll(DSDoneCallback apDone) {
+    return dspSubmitJob(DS_JOB_POLL, apDone);
+}
+#endif
+
+
+
+#if DS_USE_SLEEP
+// aiValue > 0 for dsEnableSleep, otherwise dsDisableSleep.
+boolean DS2764::dsSubmitSleep(int aiValue, DSDoneCallback apDone) {
+    if (!dspSubmitJob(DS_JOB_SLEEP, apDone)) {
+        return false;
+    }
+    mbyJobSleep = (aiValue > 0);
+    return true;
+}
+#endif
+
+
+
+#if DS_USE_CAPACITY_EEPROM
+boolean DS2764::dsSubmitBatteryCapacity(int aiValue, DSDoneCallback apDone) {
+    if (!dspSubmitJob(DS_JOB_CAPACITY, apDone)) {
+        return false;
+    }
+    miJobCapacity = aiValue;
+    return true;
+}
+#endif
+
+
+
+// Marks job abJob pending from its first step, false if it already is.
+boolean DS2764::dspSubmitJob(byte abJob, DSDoneCallback apDone) {
+    if (mabJobStep[abJob]) {
+        return false;
+    }
+    mabJobStep[abJob]  = 1;
+    maulJobDue[abJob]  = mpClock();
+    mapJobDone[abJob]  = apDone;
+    mbyJobFailed      &= ~(1 << abJob);
+    return true;
+}
+
+
+
+// Moves job abJob on to its next step, which may not run for alMillis.
+void DS2764::dspJobWait(byte abJob, unsigned long aulMillis) {
+    mabJobStep[abJob]++;
+    maulJobDue[abJob] = mpClock() + aulMillis;
+}
+
+
+
+// Notes a failed transaction, the job carries on but reports false.
+void DS2764::dspJobCheck(byte abJob, boolean abOk) {
+    if (!abOk) {
+        mbyJobFailed |= (1 << abJob);
+    }
+}
+
+
+
+//------------------------------------------------------------------------------
+// dspRunJob
+//
+// Runs the current step of a job.  The sleep and capacity steps follow
+// dspSetSleepMode and dsSetBatteryCapacity with the same waits, except that
+// setting the address and reading the shadow RAM back are done together so
+// another job can't move the address pointer in between.  A step that
+// doesn't call dspJobWait is the job's last.
+//
+// Arguments:
+//     byte abJob - DS_JOB_xxx
+//
+//------------------------------------------------------------------------------
+void DS2764::dspRunJob(byte abJob) {
+    byte    abBuf[4];
+    byte    bStep   = mabJobStep[abJob];
+    DSDoneCallback pDone = NULL;
+
+    switch (abJob) {
+#if DS_USE_PROTECTION_POLL
+    case DS_JOB_POLL:
+        dsPollProtection();
+        dspJobCheck(abJob, mbyProtect != 0xFF);
+        break;
+#endif
+
+    case DS_JOB_RESET:
+        dspWriteProtection(mbyJobReset);
+        dspJobCheck(abJob, mbyProtect != 0xFF);
+        break;
+
+    case DS_JOB_REFRESH:
+        if (bStep == 1) {
+#if DS_USE_POWER_SWITCH
+            dspHandlePower();
+#endif
+            dspJobCheck(abJob, dspGetProtection());
+            dspJobWait(abJob, 0);
+        }
+#if DS_USE_SYNC_SAMPLING
+        else {
+            dspJobCheck(abJob, dspSyncFrame());
+#else
+        else if (bStep == 2) {
+            if (dspReadBytes(DSTraits::VOLT_REG, mabVoltAndCurrent, sizeof(mabVoltAndCurrent))) {
+                dspProcessFrame();
+            }
+            else {
+                memset(mabVoltAndCurrent, 0, sizeof(mabVoltAndCurrent));
+                mbyFlags &= ~DS_FLAG_FRAME_VALID;
+                dspJobCheck(abJob, false);
+            }
+            dspJobWait(abJob, 0);
+        }
+        else {
+            dspGetTemp();
+            dspJobCheck(abJob, mbyFlags & DS_FLAG_TEMP_VALID);
+#if DS_USE_ARCHIVE
+            if (mbyFlags & DS_FLAG_FRAME_VALID) {
+                dspArchiveFrame();
+            }
+#endif
+#endif
+#if DS_USE_BUS_STATS
+            dspSampleDone();
+#endif
+#if DS_USE_SNAPSHOT
+            dspPublishSnapshot();
+#endif
+#if DS_USE_WATCH
+            dspCheckWatches();
+#endif
+        }
+        break;
+
+    case DS_JOB_ACCUM:
+        abBuf[0] = highByte(miJobAccum);
+        abBuf[1] = lowByte(miJobAccum);
+        if (dspWriteBytes(DSTraits::ACR_REG, abBuf, 2)) {
+            mabVoltAndCurrent[4] = abBuf[0];
+            mabVoltAndCurrent[5] = abBuf[1];
+            mlAccCurrentExt      = (int16_t) miJobAccum;
+#if DS_USE_CHARGE_MARK
+            mbyAccEpoch++;
+#endif
+        }
+        else {
+            dspJobCheck(abJob, false);
+        }
+        break;
+
+#if DS_USE_SLEEP
+    case DS_JOB_SLEEP:
+        if (bStep == 1) {
+            abBuf[0] = DS_RECALL_EEPROM_BLK_1;
+            dspJobCheck(abJob, dspWriteBytes(DS_FUNCTION_REGISTER, abBuf, 1));
+            dspJobWait(abJob, 500);
+        }
+        else if (bStep == 2) {
+            if (dspReadBytes(DS_SLEEP_MODE_ADDR, abBuf, 1)) {
+                if (mbyJobSleep) {
+                    abBuf[0] |= DS00SLP;
+                }
+                else {
+                    abBuf[0] &= ~DS00SLP;
+                }
+                dspJobCheck(abJob, dspWriteBytes(DS_SLEEP_MODE_ADDR, abBuf, 1));
+            }
+            else {
+                dspJobCheck(abJob, false);
+            }
+            dspJobWait(abJob, 10);
+        }
+        else if (bStep == 3) {
+            abBuf[0] = DS_SAVE_EEPROM_BLK_1;
+            dspJobCheck(abJob, dspWriteBytes(DS_FUNCTION_REGISTER, abBuf, 1));
+            dspJobWait(abJob, 1000);
+        }
+        else if (bStep == 4) {
+            abBuf[0] = DS_RECALL_EEPROM_BLK_1;
+            dspJobCheck(abJob, dspWriteBytes(DS_FUNCTION_REGISTER, abBuf, 1));
+            dspJobWait(abJob, 1000);
+        }
+        else if (dspReadBytes(DS_SLEEP_MODE_ADDR, abBuf, 1)) {
+            if (abBuf[0] & DS00SLP) {
+                mbyFlags |= DS_FLAG_SLEEP_ENABLED;
+            }
+            else {
+                mbyFlags &= ~DS_FLAG_SLEEP_ENABLED;
+            }
+            dspJobCheck(abJob, (abBuf[0] & DS00SLP) == (mbyJobSleep ? DS00SLP : 0));
+        }
+        else {
+            dspJobCheck(abJob, false);
+        }
+        break;
+#endif
+
+#if DS_USE_CAPACITY_EEPROM
+    case DS_JOB_CAPACITY:
+        if (bStep == 1) {
+            abBuf[0] = DS_RECALL_EEPROM_BLK_0;
+            dspJobCheck(abJob, dspWriteBytes(DS_FUNCTION_REGISTER, abBuf, 1));
+            dspJobWait(abJob, 500);
+        }
+        else if (bStep == 2) {
+            abBuf[0] = highByte(miJobCapacity);
+            abBuf[1] = lowByte(miJobCapacity);
+            abBuf[2] = abBuf[0] ^ abBuf[1];
+            abBuf[3] = 0xA;
+            dspJobCheck(abJob, dspWriteBytes(DS_BATTERY_CAP_ADDR, abBuf, 4));
+            dspJobWait(abJob, 10);
+        }
+        else if (bStep == 3) {
+            abBuf[0] = DS_SAVE_EEPROM_BLK_0;
+            dspJobCheck(abJob, dspWriteBytes(DS_FUNCTION_REGISTER, abBuf, 1));
+            dspJobWait(abJob, 10);
+        }
+        else {
+            miBatteryCapacity = miJobCapacity;
+#if DS_USE_CAPACITY_LEARNING
+            miStoredCapacity  = miJobCapacity;
+#endif
+            mbyFlags |= DS_FLAG_CAPACITY_LOADED;
+            if (miJobCapacity > 0) {
+                mbyFlags |= DS_FLAG_CAPACITY_VALID;
+            }
+        }
+        break;
+#endif
+    }
+
+    if (mabJobStep[abJob] == bStep) {
+        // the last step; clear the slot first so the callback can submit again
+        mabJobStep[abJob] = 0;
+        pDone = mapJobDone[abJob];
+        mapJobDone[abJob] = NULL;
+        if (pDone) {
+            DS_TRACE_BEGIN(DS_TRACE_DISPATCH);
+            pDone(abJob, !(mbyJobFailed & (1 << abJob)));
+            DS_TRACE_END(DS_TRACE_DISPATCH);
+        }
+    }
+}
+#endif
+
+
+
+
+
+
+#if DS_USE_BUS_STATS
+// Microseconds the driver has spent in dsRefresh, dsPollProtection and
+// dsService since dsInit or dsResetBusStats.  Most of it is the bus being
+// busy, the rest is the delay(4) in dsRefresh.
+unsigned long DS2764::dsGetBusMicros(void) {
+    return mulBusMicros;
+}
+
+
+
+// Share of the time since dsInit or dsResetBusStats that the driver has
+// had the bus, in tenths of a percent.  micros() wraps after about 70
+// minutes, so reset the stats more often than that.
+int DS2764::dsGetBusUtilization(void) {
+    unsigned long ulElapsed = micros() - mulBusSince;
+
+    if (ulElapsed < 1000) {
+        return 0;
+    }
+    return mulBusMicros / (ulElapsed / 1000);
+}
+
+
+
+// Microseconds from the start of the last refresh (dsRefresh called, or
+// dsSubmitRefresh queued) until its readings were all in.
+unsigned long DS2764::dsGetSampleMicros(void) {
+    return mulSampleMicros;
+}
+
+
+
+unsigned long DS2764::dsGetSampleMicrosMax(void) {
+    return mulSampleMicrosMax;
+}
+
+
+
+void DS2764::dsResetBusStats(void) {
+    mulBusMicros       = mbyBusDepth ? 0 - micros() : 0;	// may be called from a callback
+    mulBusSince        = micros();
+    mulSampleMicros    = 0;
+    mulSampleMicrosMax = 0;
+}
+
+
+
+// Bus time is counted from the outermost dspBusBegin to its dspBusEnd, so
+// a dsRefresh run from dsPollProtection isn't counted twice.
+void DS2764::dspBusBegin(void) {
+    if (mbyBusDepth++ == 0) {
+        mulBusMicros -= micros();
+    }
+}
+
+
+
+void DS2764::dspBusEnd(void) {
+    if (--mbyBusDepth == 0) {
+        mulBusMicros += micros();
+    }
+}
+
+
+
+void DS2764::dspSampleDone(void) {
+    mulSampleMicros = micros() - mulSampleStart;
+    if (mulSampleMicros > mulSampleMicrosMax) {
+        mulSampleMicrosMax = mulSampleMicros;
+    }
+}
+#endif
+
+
+
+
+
+
+#if DS_USE_SNAPSHOT
+// Keeps the compiler from moving memory accesses across it, so the sequence
+// counter is bumped strictly before and after the snapshot is written.
+#define DS_BARRIER()	__asm__ __volatile__ ("" ::: "memory")
+
+//------------------------------------------------------------------------------
+// dsReadSnapshot
+//
+// Copies out the readings of the last finished refresh.  They're decoded
+// already and come from a single refresh, even with DS_USE_BUS_QUEUE where
+// the registers of a refresh are read over several dsService calls.  No bus
+// traffic, so any part of the sketch can call it as often as it likes.
+//
+// The snapshot is written between two bumps of a sequence counter.  If the
+// counter is odd, or changes while the copy is made, the refresh was being
+// published at the time (from an interrupt, say) and the copy is made
+// again.  Don't call this from an interrupt that can preempt the refresh.
+//
+// Arguments:
+//     DSSnapshot &asOut - where to copy the snapshot
+//
+// Return Value:
+//     boolean - false if nothing has been published yet
+//------------------------------------------------------------------------------
+boolean DS2764::dsReadSnapshot(DSSnapshot &asOut) {
+    byte    bSeq    = 0;
+
+    do {
+        bSeq = mbySnapshotSeq;
+        DS_BARRIER();
+        memcpy(&asOut, &msSnapshot, sizeof(asOut));
+        DS_BARRIER();
+    } while ((bSeq & 1) || bSeq != mbySnapshotSeq);
+
+    return (msSnapshot.version != 0);
+}
+
+
+
+// Goes up by 2 each time a refresh is published (wrapping at 256), so a
+// reader can tell a new snapshot from one it has already seen.
+byte DS2764::dsGetSnapshotSequence(void) {
+    return mbySnapshotSeq;
+}
+
+
+
+void DS2764::dspPublishSnapshot(void) {
+    mbySnapshotSeq++;
+    DS_BARRIER();
+
+    msSnapshot.version     = DS_SNAPSHOT_VERSION;
+    msSnapshot.protect     = mbyProtect;
+    msSnapshot.status      = mbyStatus;
+    msSnapshot.valid       = 0;
+    if (mbyFlags & DS_FLAG_FRAME_VALID) {
+        msSnapshot.valid  |= DS_SNAPSHOT_FRAME_VALID;
+    }
+    if (mbyFlags & DS_FLAG_TEMP_VALID) {
+        msSnapshot.valid  |= DS_SNAPSHOT_TEMP_VALID;
+    }
+    msSnapshot.millivolts  = dsGetBatteryVoltage();
+    msSnapshot.milliamps   = dspScale(dsGetCurrentRaw(), DSTraits::CURRENT_Q16);
+    msSnapshot.temp        = dsGetTempRaw();
+    msSnapshot.accumulated = dsGetAccumulatedCurrentExt();
+    msSnapshot.millis      = mpClock();
+
+    DS_BARRIER();
+    mbySnapshotSeq++;
+}
+#endif
+
+
+
+
+
+
+#if DS_USE_SYNC_SAMPLING
+//------------------------------------------------------------------------------
+// dspSyncFrame
+//
+// Reads voltage, current, accumulated current and temperature, but only once
+// the gauge's next conversion can have happened; before that the registers
+// can't have changed and the reads are skipped.  A frame that reads back the
+// same as the last one isn't decoded again, except that the energy and
+// average current still need the time to have passed.
+//
+// A changed frame was converted between the read that found it and the one
+// before.  If a period after the last conversion falls in there, that's
+// taken as when it was converted, otherwise halfway between the two reads.
+// The next read is due a period after it, plus DS_CONVERSION_MARGIN.  While
+// the readings hold steady the phase isn't known, and the frame is read
+// every half period, which still can't step over a conversion.
+//
+// The period is the one set with dsSetConversionPeriod.  With 0 it's learned
+// first: every refresh reads, and DS_CONVERSION_SAMPLES gaps between changed
+// frames (up to 255 ms each) are timed and averaged.  A gap that spans two
+// conversions because one read back the same counts as two.
+//
+// Arguments:
+//     None
+//
+// Return Value:
+//     boolean - false if a read failed
+//------------------------------------------------------------------------------
+boolean DS2764::dspSyncFrame(void) {
+    unsigned long ulNow     = mpClock();
+    unsigned long ulPrev;
+    byte    abFrame[sizeof(mabVoltAndCurrent)];
+    byte    abTemp[sizeof(mabTemp)];
+    boolean bOk     = true;
+#if DS_USE_ARCHIVE
+    boolean bNew    = false;
+#endif
+
+    mbyFresh = 0;
+    if (muiConvPeriod && !mbyConvLearn && (long) (ulNow - mulFrameDue) < 0
+            && (mbyFlags & DS_FLAG_FRAME_VALID)) {
+        return true;	// nothing new yet
+    }
+    ulPrev       = mulFrameRead;
+    mulFrameRead = ulNow;
+
+    if (!dspReadBytes(DSTraits::VOLT_REG, abFrame, sizeof(abFrame))) {
+        memset(mabVoltAndCurrent, 0, sizeof(mabVoltAndCurrent));
+        mbyFlags &= ~DS_FLAG_FRAME_VALID;
+        bOk = false;
+    }
+    else {
+        if (abFrame[0] != mabVoltAndCurrent[0] || abFrame[1] != mabVoltAndCurrent[1]) {
+            mbyFresh |= DS_FRESH_VOLTAGE;
+        }
+        if (abFrame[2] != mabVoltAndCurrent[2] || abFrame[3] != mabVoltAndCurrent[3]) {
+            mbyFresh |= DS_FRESH_CURRENT;
+        }
+        if (abFrame[4] != mabVoltAndCurrent[4] || abFrame[5] != mabVoltAndCurrent[5]) {
+            mbyFresh |= DS_FRESH_ACCUM;
+        }
+
+        if (mbyFresh || !(mbyFlags & DS_FLAG_FRAME_VALID)) {
+            unsigned long ulSeen = mulFrameSeen + muiConvPeriod;
+
+            if (!muiConvPeriod || (long) (ulSeen - ulPrev) <= 0 || (long) (ulSeen - ulNow) > 0) {
+                ulSeen = ulPrev + (ulNow - ulPrev) / 2;	// phase lost, or not known yet
+            }
+            if (mbyConvLearn && mbyFresh && (mbyFlags & DS_FLAG_FRAME_VALID)) {
+                unsigned long ulGap = ulSeen - mulFrameSeen;
+
+                if (mbyConvLearn > DS_CONVERSION_SAMPLES) {
+                    mbyConvLearn--;	// the first one only starts the clock
+                }
+                else if (ulGap >= DS_CONVERSION_MIN) {
+                    mabConvGap[DS_CONVERSION_SAMPLES - mbyConvLearn] = ulGap > 255 ? 255 : ulGap;
+                    if (--mbyConvLearn == 0) {
+                        dspLearnConversionPeriod();
+                    }
+                }
+            }
+            mulFrameSeen = ulSeen;
+            memcpy(mabVoltAndCurrent, abFrame, sizeof(abFrame));
+            dspProcessFrame();
+            mulFrameDue = ulSeen + muiConvPeriod + DS_CONVERSION_MARGIN;
+#if DS_USE_ARCHIVE
+            bNew = true;
+#endif
+        }
+        else {
+#if DS_USE_ENERGY || DS_USE_RUNTIME
+            dspProcessFrame();	// same readings, but they've been held for longer
+#endif
+            mulFrameDue = ulNow + muiConvPeriod / 2;
+        }
+    }
+
+    if (!dspReadBytes(DSTraits::TEMP_REG, abTemp, sizeof(abTemp))) {
+        mbyFlags &= ~DS_FLAG_TEMP_VALID;
+        bOk = false;
+    }
+    else if (memcmp(abTemp, mabTemp, sizeof(abTemp)) || !(mbyFlags & DS_FLAG_TEMP_VALID)) {
+        memcpy(mabTemp, abTemp, sizeof(abTemp));
+        mbyFlags |= DS_FLAG_TEMP_VALID;
+        mbyFresh |= DS_FRESH_TEMP;
+    }
+#if DS_USE_ARCHIVE
+    if (bNew) {
+        dspArchiveFrame();	// a new conversion, not the same one held
+    }
+#endif
+
+    return bOk;
+}
+
+
+
+// Which readings changed in the last refresh, DS_FRESH_xxx bits.  0 if the
+// refresh came before the gauge's next conversion and nothing was read.
+byte DS2764::dsGetFresh(void) {
+    return mbyFresh;
+}
+
+
+
+// The gauge's conversion period in ms, DS_CONVERSION_PERIOD by default.
+// Pass 0 to learn it from how often the readings change instead; until
+// that's done every refresh still reads.
+void DS2764::dsSetConversionPeriod(unsigned int auiMillis) {
+    muiConvPeriod = auiMillis;
+    mbyConvLearn  = auiMillis ? 0 : DS_CONVERSION_SAMPLES + 1;
+}
+
+
+
+unsigned int DS2764::dsGetConversionPeriod(void) {
+    return muiConvPeriod;
+}
+
+
+
+// Sets the period from the gaps timed while learning.  Each gap is off by
+// up to a refresh interval, but the errors cancel over a run of gaps, so it's
+// their sum over the number of conversions in them, found by rounding each
+// gap to a multiple of the median.
+void DS2764::dspLearnConversionPeriod(void) {
+    unsigned int uiSum  = 0;
+    unsigned int uiMedian;
+    byte    bCount  = 0;
+    byte    bGap;
+    byte    i   = 0;
+    byte    j   = 0;
+
+    for (i = 1; i < DS_CONVERSION_SAMPLES; i++) {
+        bGap = mabConvGap[i];
+        for (j = i; j > 0 && mabConvGap[j - 1] > bGap; j--) {
+            mabConvGap[j] = mabConvGap[j - 1];
+        }
+        mabConvGap[j] = bGap;
+    }
+    uiMedian = mabConvGap[DS_CONVERSION_SAMPLES / 2];
+
+    for (i = 0; i < DS_CONVERSION_SAMPLES; i++) {
+        uiSum  += mabConvGap[i];
+        bCount += (mabConvGap[i] + uiMedian / 2) / uiMedian;
+    }
+    muiConvPeriod = (uiSum + bCount / 2) / bCount;
+}
+#endif
+
+
+
+
+
+
+#if DS_USE_CHARGE_MARK
+// Takes a mark at the accumulated current as of the last refresh, for
+// dsGetAverageCurrentSince and dsGetChargeSince to measure from.
+void DS2764::dsMarkCharge(DSChargeMark &asMark) {
+    asMark.acr    = mlAccCurrentExt;
+    asMark.millis = mulAccMillis;
+    asMark.epoch  = mbyAccEpoch;
+}
+
+
+
+//------------------------------------------------------------------------------
+// dsGetAverageCurrentSince
+//
+// The mean current between a mark and the last refresh, from how far the
+// Accumulated Current Register moved in between.  The gauge integrates every
+// conversion, so unlike averaging dsGetCurrent readings nothing between two
+// refreshes is missed and pulsed loads don't need fast polling.  An ACR count
+// is .25mAh with the internal sense resistor, so the longer the interval the
+// finer the result: 900mA over one second, 15mA over a minute.
+//
+// Arguments:
+//     const DSChargeMark &asMark - taken earlier with dsMarkCharge
+//     int &aiMilliamps - set to the mean current in mA, + when charging
+//
+// Return Value:
+//     boolean - false if no time has passed since the mark, or the ACR was
+//               written since it was taken
+//------------------------------------------------------------------------------
+boolean DS2764::dsGetAverageCurrentSince(const DSChargeMark &asMark, int &aiMilliamps) {
+    long    lCounts = mlAccCurrentExt - asMark.acr;
+    unsigned long ulMillis = mulAccMillis - asMark.millis;
+    long    lMilliamps;
+
+    if (asMark.epoch != mbyAccEpoch || ulMillis == 0) {
+        return false;
+    }
+
+    // halve both until the multiply fits, the ratio barely changes
+    while (lCounts > 0x7FFFFFFFL / DSTraits::ACR_MA_MS || lCounts < -0x7FFFFFFFL / DSTraits::ACR_MA_MS
+            || ulMillis > 0x7FFFFFFFUL) {
+        lCounts  /= 2;
+        ulMillis = (ulMillis + 1) / 2;
+    }
+    lMilliamps  = lCounts * DSTraits::ACR_MA_MS / (long) ulMillis;
+    aiMilliamps = constrain(lMilliamps, -32767L, 32767L);
+    return true;
+}
+
+
+
+// Net charge in mAh that went into the battery between a mark and the last
+// refresh, negative if more came out.  false if the ACR was written since.
+boolean DS2764::dsGetChargeSince(const DSChargeMark &asMark, long &alMilliAh) {
+    if (asMark.epoch != mbyAccEpoch) {
+        return false;
+    }
+    alMilliAh = dspAcrToMah(mlAccCurrentExt - asMark.acr);
+    return true;
+}
+#endif
+
+
+
+
+
+
+#if DS_USE_OFFSET_CAL
+//------------------------------------------------------------------------------
+// dsCalibrateCurrentOffset
+//
+// Measures the current reading with no load and programs the Current Offset
+// Register (0x33) to cancel it.  The gauge adds the register to every
+// conversion before it reaches the current and accumulated current
+// registers, so once it's set the ACR no longer drifts while the pack is
+// idle.  Only call it when nothing is being charged or drawn.
+//
+// One reading is taken per conversion for the whole window and averaged.
+// The new offset is the old one less that average, written with a single
+// recall, modify and save of EEPROM Block 1; if it comes out the same
+// nothing is saved.  Blocks for the window plus about 10ms.
+//
+// Arguments:
+//     unsigned int auiMillis - how long to average for, DS_OFFSET_WINDOW
+//                              by default
+//
+// Return Value:
+//     boolean - false if a read or write failed, or the offset needed is
+//               more than the register holds, which means it wasn't idle
+//------------------------------------------------------------------------------
+boolean DS2764::dsCalibrateCurrentOffset(unsigned int auiMillis) {
+    byte    abBuf[2];
+    long    lSum    = 0;
+    int     iCount  = 0;
+    int     iOffset = 0;
+
+    do {
+        delay(DS_CONVERSION_PERIOD);
+        if (!dspReadBytes(DSTraits::CURRENT_REG, abBuf, 2)) {
+            return false;
+        }
+        lSum += (int16_t) word(abBuf[0], abBuf[1]) >> DSTraits::CURRENT_SHIFT;
+        iCount++;
+    } while ((unsigned long) iCount * DS_CONVERSION_PERIOD < auiMillis);
+
+    // Recall EEPROM Block 1 Data to Shadow RAM, which is done by the time
+    // the next transaction starts (as in dspRecallBlock)
+    abBuf[0] = DS_RECALL_EEPROM_BLK_1;
+    if (!dspWriteBytes(DS_FUNCTION_REGISTER, abBuf, 1)) {
+        return false;
+    }
+    if (!dspReadBytes(DS_CURRENT_OFFSET_REG, abBuf, 1)) {
+        return false;
+    }
+
+    // round the average to the nearest step
+    iOffset = (int8_t) abBuf[0] - (lSum + (lSum < 0 ? -iCount : iCount) / 2) / iCount;
+    if (iOffset < -DS_OFFSET_MAX - 1 || iOffset > DS_OFFSET_MAX) {
+        return false;
+    }
+    if ((int8_t) abBuf[0] == iOffset) {
+        return true;
+    }
+
+    abBuf[0] = (byte) iOffset;
+    if (!dspWriteBytes(DS_CURRENT_OFFSET_REG, abBuf, 1)) {
+        return false;
+    }
+
+    // Copy the Block 1 Shadow RAM into EEPROM
+    abBuf[0] = DS_SAVE_EEPROM_BLK_1;
+    if (!dspWriteBytes(DS_FUNCTION_REGISTER, abBuf, 1)) {
+        return false;
+    }
+    delay(10);
+    return true;
+}
+
+
+
+// The Current Offset Register in 15.625uV steps, the same units as
+// dsGetCurrentRaw, or 0 if it couldn't be read.
+int DS2764::dsGetCurrentOffset(void) {
+    byte    bOffset = 0;
+
+    dspReadBytes(DS_CURRENT_OFFSET_REG, &bOffset, 1);
+    return (int8_t) bOffset;
+}
+#endif
+
+
+
+
+
+
+#if DS_USE_TRACE
+// Stage names for dsDumpTrace, in DS_TRACE_xxx order.
+static const char DS_TRACE_NAMES[] PROGMEM =
+    "refresh\0address\0request\0write\0delay\0decode\0dispatch\0"
+    "sleep_mode\0capacity\0eeprom_wait\0service";
+
+// Adds one event to the ring buffer, over the oldest once it's full.
+void DS2764::dspTrace(byte abStage) {
+    DSTraceEvent *pEvent = &masTrace[mbyTraceNext];
+
+    pEvent->micros = mpTraceClock();
+    pEvent->stage  = abStage;
+    if (++mbyTraceNext == DS_TRACE_DEPTH) {
+        mbyTraceNext = 0;
+    }
+    if (mbyTraceCount < DS_TRACE_DEPTH) {
+        mbyTraceCount++;
+    }
+}
+
+
+
+// Time base for trace events in microseconds, micros() by default.  A
+// simulator or a hardware timer can stand in for it.
+void DS2764::dsSetTraceClock(DSClock apClock) {
+    mpTraceClock = apClock;
+}
+
+
+
+//------------------------------------------------------------------------------
+// dsDumpTrace
+//
+// Prints the events in the ring buffer, oldest first, one per line:
+//     # DS2764 0x34
+//     B refresh 1200448
+//     B address 1200452
+//     E address 1200580
+//     ...
+// B and E are the begin and end of a stage, followed by the trace clock.
+// extras/trace_to_chrome.sh turns one or more dumps into Chrome trace JSON
+// (chrome://tracing or Perfetto), one track per gauge address.  The buffer
+// is left as it is, dsClearTrace empties it.
+//
+// Arguments:
+//     Print &apOut - Serial or any other Print
+//
+//------------------------------------------------------------------------------
+void DS2764::dsDumpTrace(Print &apOut) {
+    byte    bSlot   = (mbyTraceNext + DS_TRACE_DEPTH - mbyTraceCount) % DS_TRACE_DEPTH;
+    byte    bStage  = 0;
+    const char *pName = NULL;
+    char    cName   = 0;
+    byte    i       = 0;
+
+    apOut.print("# DS2764 0x");
+    apOut.println(mbyAddress, HEX);
+    for (i = 0; i < mbyTraceCount; i++) {
+        bStage = masTrace[bSlot].stage & ~DS_TRACE_END_BIT;
+        apOut.print((masTrace[bSlot].stage & DS_TRACE_END_BIT) ? "E " : "B ");
+        if (bStage < DS_TRACE_STAGES) {
+            // skip to the bStage'th name
+            for (pName = DS_TRACE_NAMES; bStage; pName++) {
+                if (pgm_read_byte(pName) == 0) {
+                    bStage--;
+                }
+            }
+            while ((cName = pgm_read_byte(pName++)) != 0) {
+                apOut.print(cName);
+            }
+        }
+        else {
+            apOut.print(bStage);
+        }
+        apOut.print(' ');
+        apOut.println(masTrace[bSlot].micros);
+        if (++bSlot == DS_TRACE_DEPTH) {
+            bSlot = 0;
+        }
+    }
+}
+
+
+
+void DS2764::dsClearTrace(void) {
+    mbyTraceNext  = 0;
+    mbyTraceCount = 0;
+}
+#endif
+
+
+
+
+
+
+#if DS_USE_STANDBY
+//------------------------------------------------------------------------------
+// dsEnterStandby
+//
+// Turns the pack off the same way a power switch press does in dsRefresh,
+// charge and discharge disabled, and arms the Power Switch bit with a single
+// write.  The gauge clears the bit when the switch is pressed and it stays
+// clear until it's written again, so a press can't be missed however long
+// the Arduino sleeps; all that changes is how long it takes to be noticed.
+// From here on dsRefresh only calls dsPollStandby, one 1 byte read.
+//
+// A press is seen at the first dsPollStandby after it, so the sketch's sleep
+// between calls, DS_STANDBY_SLEEP say, is how late it can be.
+//
+// Only the power switch is read while in standby, so the accumulated current
+// is read again on the press; the extended count stays right as long as the
+// register moved less than half its range while the pack was off.  That is
+// 8192mAh either way with the internal sense resistor, which limits how long
+// standby can last: about 11 months at 1mA of self discharge and leakage.
+//
+// Arguments:
+//     None
+//
+// Return Value:
+//     None
+//------------------------------------------------------------------------------
+void DS2764::dsEnterStandby(void) {
+    byte    bArm    = DS00PS;
+
+    if (mbyFlags & DS_FLAG_POWER_ON) {
+        mbyFlags &= ~DS_FLAG_POWER_ON;
+        dsResetProtection(DS_RESET_DISABLE);
+    }
+    if (dspWriteBytes(DS_SPECIAL_FEATURE_REG, &bArm, 1)) {
+        mbyFlags |= DS_FLAG_POWER_SWITCH_ON;
+    }
+    mbStandby = true;
+}
+
+
+
+//------------------------------------------------------------------------------
+// dsPollStandby
+//
+// Reads the Special Feature Register to see if the power switch has been
+// pressed.  If it has, everything else is read back with one burst of
+// registers 0x00 - 0x19, charge and discharge are enabled again, the switch
+// is re-armed and standby ends.
+//
+// Arguments:
+//     None
+//
+// Return Value:
+//     boolean - true if the switch was pressed and standby is over
+//------------------------------------------------------------------------------
+boolean DS2764::dsPollStandby(void) {
+    byte    abRegs[DS_BURST_LEN];
+
+    if (!mbStandby) {
+        return false;
+    }
+    if (!dspReadBytes(DS_SPECIAL_FEATURE_REG, abRegs, 1) || (abRegs[0] & DS00PS)) {
+        return false;
+    }
+
+    mbStandby = false;
+    mbyFlags &= ~DS_FLAG_POWER_SWITCH_ON;
+    if (dspReadBytes(DS_PROTECTION_REGISTER, abRegs, DS_BURST_LEN)) {
+        mbyProtect = abRegs[DS_PROTECTION_REGISTER];
+        mbyStatus  = abRegs[DS_STATUS_REGISTER];
+        memcpy(mabVoltAndCurrent, &abRegs[DSTraits::VOLT_REG], sizeof(mabVoltAndCurrent));
+        memcpy(mabTemp, &abRegs[DSTraits::TEMP_REG], sizeof(mabTemp));
+        mbyFlags |= DS_FLAG_TEMP_VALID;
+        dspProcessFrame();
+#if DS_USE_ARCHIVE
+        dspArchiveFrame();
+#endif
+    }
+
+    mbyFlags |= DS_FLAG_POWER_ON;
+    dsResetProtection(DS_RESET_ENABLE);
+    abRegs[0] = DS00PS;
+    if (dspWriteBytes(DS_SPECIAL_FEATURE_REG, abRegs, 1)) {
+        mbyFlags |= DS_FLAG_POWER_SWITCH_ON;
+    }
+#if DS_USE_SNAPSHOT
+    dspPublishSnapshot();
+#endif
+    return true;
+}
+
+
+
+boolean DS2764::dsIsStandby(void) {
+    return mbStandby;
+}
+#endif
+
+
+
+
+
+
+#if DS_USE_BUS_TUNE
+//------------------------------------------------------------------------------
+// dsSetBusClock
+//
+// Sets the fastest I2C clock to use and the slowest to fall back to, and
+// starts at the fastest.  Every transaction is counted, and when
+// DS_TUNE_DOWN_ERRORS of the last DS_TUNE_WINDOW fail (a NACK, a short read
+// or a frame of 0xFF) the clock is halved.  After DS_TUNE_UP_WINDOWS clean
+// windows it is doubled again.  Each step down doubles how many clean windows
+// that takes, so a marginal bus settles on the speed that works instead of
+// bouncing, and the wait shrinks again once the full speed runs clean.
+// Wire.begin has to have been called, dsInit calls this with the last range
+// set, so setting it before dsInit is fine too.
+//
+// Arguments:
+//     aulMax - fastest clock in Hz, 100000 and 400000 are the usual ones.
+//     aulMin - slowest clock in Hz, DS_TUNE_MIN_CLOCK by default.  Setting it
+//              to aulMax fixes the clock.
+//
+// Return Value:
+//     None.
+//------------------------------------------------------------------------------
+void DS2764::dsSetBusClock(unsigned long aulMax, unsigned long aulMin) {
+    mulClockMax     = aulMax;
+    mulClockMin     = aulMin < aulMax ? aulMin : aulMax;
+    mbyClockLevel   = 0;
+    mbyTuneTxns     = 0;
+    mbyTuneErrors   = 0;
+    mbyTuneClean    = 0;
+    mbyTuneBackoff  = 0;
+    mpWire->setClock(mulClockMax);
+}
+
+
+
+// I2C clock in use, in Hz.
+unsigned long DS2764::dsGetBusClock(void) {
+    return mulClockMax >> mbyClockLevel;
+}
+
+
+
+// Failed transactions since dsInit, stops at 65535.
+unsigned int DS2764::dsGetBusErrors(void) {
+    return muiBusErrors;
+}
+
+
+
+// Counts one transaction for dsSetBusClock and moves the clock when the
+// error rate says so.
+void DS2764::dspBusResult(boolean abOk) {
+    if (!abOk) {
+        if (muiBusErrors < 0xFFFF) {
+            muiBusErrors++;
+        }
+        mbyTuneClean = 0;
+        if (++mbyTuneErrors >= DS_TUNE_DOWN_ERRORS) {
+            if ((mulClockMax >> (mbyClockLevel + 1)) >= mulClockMin) {
+                mbyClockLevel++;
+                if (mbyTuneBackoff < DS_TUNE_MAX_BACKOFF) {
+                    mbyTuneBackoff++;
+                }
+                mpWire->setClock(mulClockMax >> mbyClockLevel);
+            }
+            mbyTuneTxns   = 0;
+            mbyTuneErrors = 0;
+        }
+    }
+    if (++mbyTuneTxns < DS_TUNE_WINDOW) {
+        return;
+    }
+
+    // end of a window
+    if (mbyTuneErrors == 0) {
+        if (++mbyTuneClean >= (DS_TUNE_UP_WINDOWS << mbyTuneBackoff)) {
+            mbyTuneClean = 0;
+            if (mbyClockLevel > 0) {
+                mbyClockLevel--;
+                mpWire->setClock(mulClockMax >> mbyClockLevel);
+            }
+            else if (mbyTuneBackoff > 0) {
+                mbyTuneBackoff--;	// back at full speed and staying clean
+            }
+        }
+    }
+    else {
+        mbyTuneClean = 0;
+    }
+    mbyTuneTxns   = 0;
+    mbyTuneErrors = 0;
+}
+#endif
+
+
+
+
+
+
+#if DS_USE_PROVISION
+// EEPROM Blocks 0 - 2 in DSImage order, internal use
+static const byte DS_BLOCK_START[DS_IMAGE_BLOCKS] = {
+    DS_EEPROM_BLOCK0_START, DS_EEPROM_BLOCK1_START, DS_EEPROM_BLOCK2_START
+};
+static const byte DS_BLOCK_LEN[DS_IMAGE_BLOCKS] = {
+    DS_EEPROM_BLOCK0_LEN, DS_EEPROM_BLOCK1_LEN, DS_EEPROM_BLOCK2_LEN
+};
+static const byte DS_BLOCK_OFFSET[DS_IMAGE_BLOCKS] = {
+    0, DS_EEPROM_BLOCK0_LEN, DS_EEPROM_BLOCK0_LEN + DS_EEPROM_BLOCK1_LEN
+};
+static const byte DS_BLOCK_RECALL[DS_IMAGE_BLOCKS] = {
+    DS_RECALL_EEPROM_BLK_0, DS_RECALL_EEPROM_BLK_1, DS_RECALL_EEPROM_BLK_2
+};
+static const byte DS_BLOCK_SAVE[DS_IMAGE_BLOCKS] = {
+    DS_SAVE_EEPROM_BLK_0, DS_SAVE_EEPROM_BLK_1, DS_SAVE_EEPROM_BLK_2
+};
+
+//------------------------------------------------------------------------------
+// dsProvision
+//
+// Brings EEPROM Blocks 0 - 2 in line with a golden image, for provisioning
+// packs on a production line.  Each block is recalled and read in one
+// request and compared with the image under its mask.  Blocks that already
+// match are left alone; the others get the differing run written to shadow
+// RAM in one request and are saved, waiting on the EEPROM Copy flag rather
+// than a fixed delay.  Once everything is saved, each written block is
+// recalled and read back once to check it.
+//
+// A pack that's already provisioned costs 6 transactions and no EEPROM
+// writes, so running every pack through it is cheap.  The capacity, sleep
+// setting and checkpoint state the driver has cached are reloaded for the
+// blocks that were written.
+//
+// Arguments:
+//     const DSImage &apImage        - blocks 0 - 2 and the bits to provision
+//     DSProvisionReport &apReport   - gets a DS_PROVISION_xxx result and the
+//                                     number of differing bytes per block
+//
+// Return Value:
+//     boolean - true if every block matched or was written and verified.
+//------------------------------------------------------------------------------
+boolean DS2764::dsProvision(const DSImage &apImage, DSProvisionReport &apReport) {
+    byte    abBlock[DS_EEPROM_BLOCK0_LEN];
+    const byte *pData;
+    const byte *pMask;
+    byte    bSaved  = 0;	// bit per block written and saved
+    byte    bFirst;
+    byte    bLast;
+    byte    bWant;
+    byte    b;
+    byte    i;
+    boolean bOk     = true;
+
+    for (b = 0; b < DS_IMAGE_BLOCKS; b++) {
+        apReport.result[b]  = DS_PROVISION_BUS_ERROR;
+        apReport.changed[b] = 0;
+        if (!dspRecallBlock(b, abBlock)) {
+            bOk = false;
+            continue;
+        }
+
+        pData  = apImage.data + DS_BLOCK_OFFSET[b];
+        pMask  = apImage.mask + DS_BLOCK_OFFSET[b];
+        bFirst = DS_BLOCK_LEN[b];
+        bLast  = 0;
+        for (i = 0; i < DS_BLOCK_LEN[b]; i++) {
+            bWant = (abBlock[i] & ~pMask[i]) | (pData[i] & pMask[i]);
+            if (bWant != abBlock[i]) {
+                abBlock[i] = bWant;
+                apReport.changed[b]++;
+                if (bFirst == DS_BLOCK_LEN[b]) {
+                    bFirst = i;
+                }
+                bLast = i;
+            }
+        }
+
+        if (apReport.changed[b] == 0) {
+            apReport.result[b] = DS_PROVISION_MATCHED;
+        }
+        // the bytes between bFirst and bLast that matched go back unchanged
+        else if (dspWriteBytes(DS_BLOCK_START[b] + bFirst, abBlock + bFirst, bLast - bFirst + 1)
+                 && dspSaveBlock(b)) {
+            bSaved |= 1 << b;
+        }
+        else {
+            bOk = false;
+        }
+    }
+
+    // read back what was saved
+    for (b = 0; b < DS_IMAGE_BLOCKS; b++) {
+        if (!(bSaved & (1 << b))) {
+            continue;
+        }
+        if (!dspRecallBlock(b, abBlock)) {
+            bOk = false;
+            continue;
+        }
+        pData = apImage.data + DS_BLOCK_OFFSET[b];
+        pMask = apImage.mask + DS_BLOCK_OFFSET[b];
+        apReport.result[b] = DS_PROVISION_WRITTEN;
+        for (i = 0; i < DS_BLOCK_LEN[b]; i++) {
+            if ((abBlock[i] ^ pData[i]) & pMask[i]) {
+                apReport.result[b] = DS_PROVISION_VERIFY_FAILED;
+                bOk = false;
+                break;
+            }
+        }
+#if DS_USE_SLEEP
+        if (b == 1) {
+            if (abBlock[DS_SLEEP_MODE_ADDR - DS_EEPROM_BLOCK1_START] & DS00SLP) {
+                mbyFlags |= DS_FLAG_SLEEP_ENABLED;
+            }
+            else {
+                mbyFlags &= ~DS_FLAG_SLEEP_ENABLED;
+            }
+        }
+#endif
+    }
+
+#if DS_USE_CAPACITY_EEPROM
+    if (bSaved & 0x01) {
+        mbyFlags &= ~(DS_FLAG_CAPACITY_LOADED | DS_FLAG_CAPACITY_VALID);	// read again when needed
+    }
+#endif
+#if DS_USE_CHECKPOINT
+    if (bSaved & 0x04) {
+        mbyCheckpointSeq = 0;
+    }
+#endif
+    return bOk;
+}
+
+
+
+// Recalls EEPROM Block abBlock into shadow RAM and reads it into abBuf.
+boolean DS2764::dspRecallBlock(byte abBlock, byte *abBuf) {
+    return dspWriteBytes(DS_FUNCTION_REGISTER, &DS_BLOCK_RECALL[abBlock], 1)
+        && dspReadBytes(DS_BLOCK_START[abBlock], abBuf, DS_BLOCK_LEN[abBlock]) == DS_BLOCK_LEN[abBlock];
+}
+
+
+
+// Copies the shadow RAM of EEPROM Block abBlock into EEPROM and waits for
+// the EEPROM Copy flag to clear, up to DS_EEPROM_COPY_WAIT ms.  The wait is
+// on the chip, so it is timed with millis() rather than mpClock, which may be
+// a clock that doesn't move while this runs.
+boolean DS2764::dspSaveBlock(byte abBlock) {
+    byte    bReg;
+    unsigned long ulStart;
+
+    if (!dspWriteBytes(DS_FUNCTION_REGISTER, &DS_BLOCK_SAVE[abBlock], 1)) {
+        return false;
+    }
+    ulStart = millis();
+    DS_TRACE_BEGIN(DS_TRACE_EEPROM_WAIT);
+    do {
+        if (!dspReadBytes(DS_EEPROM_REGISTER, &bReg, 1)) {
+            break;
+        }
+        if (!(bReg & DS07EEC)) {
+            DS_TRACE_END(DS_TRACE_EEPROM_WAIT);
+            return true;
+        }
+    } while (millis() - ulStart <= DS_EEPROM_COPY_WAIT);
+    DS_TRACE_END(DS_TRACE_EEPROM_WAIT);
+    return false;
+}
+#endif
+
+
+
+
+
+
+#if DS_USE_FILTER
+//------------------------------------------------------------------------------
+// dsSetFilter
+//
+// Sets up the glitch filter on one channel.  Each new voltage/current frame
+// goes through the median, the rate clamp and the IIR, whichever are set, in
+// that order, and dsGetBatteryVoltage, dsGetCurrentRaw and everything built
+// on them (watches, snapshots, energy, averages) see what comes out.
+// dsGetBatteryVoltageUnfiltered and dsGetCurrentRawUnfiltered still give
+// the register as read.  All of it is 16 bit math on register units, plus a
+// 32 bit add and shift for the IIR, and the median sorts at most 5 values,
+// so a frame costs the same every time.
+//
+// The median takes out single-sample spikes and the clamp limits how far
+// the output can move per frame, so a real step comes through late rather
+// than a glitch coming through at all.  A median of 5 delays a step by 2
+// frames, 3 by one.  With sync sampling only new conversions are filtered.
+//
+// Call it after dsInit, which turns all the stages off.  The channel starts
+// over from the next frame.
+//
+// Arguments:
+//     byte abChannel  - DS_FILTER_VOLTAGE or DS_FILTER_CURRENT
+//     byte abStages   - DS_FILTER_MEDIAN3 or _MEDIAN5, _CLAMP and _IIR or'd
+//                       together, 0 for none
+//     int aiMaxStep   - largest change per frame for DS_FILTER_CLAMP, in
+//                       4.88mV or .625mA steps
+//     byte abIirShift - DS_FILTER_IIR time constant, 2^shift frames
+//
+// Return Value:
+//     None.
+//------------------------------------------------------------------------------
+void DS2764::dsSetFilter(byte abChannel, byte abStages, int aiMaxStep, byte abIirShift) {
+    DSFilterState *pState;
+
+    if (abChannel >= DS_FILTER_CHANNELS) {
+        return;
+    }
+    pState          = &masFilter[abChannel];
+    pState->stages  = abStages;
+    pState->maxStep = aiMaxStep;
+    pState->shift   = abIirShift;
+    pState->seeded  = false;
+}
+
+
+
+// Battery voltage in mV as read, before the filter.
+int DS2764::dsGetBatteryVoltageUnfiltered(void) {
+    return dspScale((int16_t) word(mabVoltAndCurrent[0], mabVoltAndCurrent[1]) >> DSTraits::VOLT_SHIFT,
+                    DSTraits::VOLT_Q16);
+}
+
+
+
+// Current in .625mA steps as read, before the filter.
+int DS2764::dsGetCurrentRawUnfiltered(void) {
+    return (int16_t) word(mabVoltAndCurrent[2], mabVoltAndCurrent[3]) >> DSTraits::CURRENT_SHIFT;
+}
+
+
+
+// Runs the frame just read through both filters.
+void DS2764::dspFilterFrame(void) {
+#if DS_USE_SYNC_SAMPLING
+    if (!mbyFresh && masFilter[DS_FILTER_VOLTAGE].seeded) {
+        return;		// the same conversion again
+    }
+#endif
+    dspFilter(masFilter[DS_FILTER_VOLTAGE],
+              (int16_t) word(mabVoltAndCurrent[0], mabVoltAndCurrent[1]) >> DSTraits::VOLT_SHIFT);
+    dspFilter(masFilter[DS_FILTER_CURRENT],
+              (int16_t) word(mabVoltAndCurrent[2], mabVoltAndCurrent[3]) >> DSTraits::CURRENT_SHIFT);
+}
+
+
+
+// One sample through the stages of one channel.
+void DS2764::dspFilter(DSFilterState &apState, int aiValue) {
+    int     aiSort[DS_FILTER_HISTORY];
+    byte    bCount;
+    byte    bSlot;
+    byte    i;
+    byte    j;
+
+    if (!apState.seeded) {
+        for (i = 0; i < DS_FILTER_HISTORY; i++) {
+            apState.hist[i] = aiValue;
+        }
+        apState.clamp  = aiValue;
+        apState.iir    = (long) aiValue << 8;
+        apState.seeded = true;
+    }
+    apState.hist[apState.next] = aiValue;
+    if (++apState.next == DS_FILTER_HISTORY) {
+        apState.next = 0;
+    }
+
+    if (apState.stages & (DS_FILTER_MEDIAN3 | DS_FILTER_MEDIAN5)) {
+        // insertion sort the newest 3 or 5 and take the middle one
+        bCount = (apState.stages & DS_FILTER_MEDIAN5) ? 5 : 3;
+        bSlot  = apState.next;
+        for (i = 0; i < bCount; i++) {
+            bSlot = (bSlot ? bSlot : DS_FILTER_HISTORY) - 1;
+            for (j = i; j > 0 && aiSort[j - 1] > apState.hist[bSlot]; j--) {
+                aiSort[j] = aiSort[j - 1];
+            }
+            aiSort[j] = apState.hist[bSlot];
+        }
+        aiValue = aiSort[bCount / 2];
+    }
+
+    if (apState.stages & DS_FILTER_CLAMP) {
+        if ((long) aiValue > (long) apState.clamp + apState.maxStep) {
+            aiValue = apState.clamp + apState.maxStep;
+        }
+        else if ((long) aiValue < (long) apState.clamp - apState.maxStep) {
+            aiValue = apState.clamp - apState.maxStep;
+        }
+        apState.clamp = aiValue;
+    }
+
+    if (apState.stages & DS_FILTER_IIR) {
+        apState.iir += (((long) aiValue << 8) - apState.iir) >> apState.shift;
+        aiValue = (apState.iir + 128) >> 8;
+    }
+    apState.out = aiValue;
+}
+#endif
+
+
+
+
+
+
+#if DS_USE_ARCHIVE
+//------------------------------------------------------------------------------
+// dsSetArchive
+//
+// Starts keeping a history of every frame read: clock time, millivolts,
+// milliamps and the temperature read with them, as dsGetBatteryVoltage and
+// the other getters see them.  Samples are collected DS_ARCHIVE_BLOCK at a time
+// and written to apOut as one block, each column on its own and delta
+// encoded, usually 5 or 6 bytes a sample with the header.  The block layout
+// is next to DS_ARCHIVE_VERSION in DS2764.h.
+//
+// apOut is anything that takes bytes: a File on an SD card, or a serial port
+// that a gateway appends to a file.  The stream is only blocks, one after
+// the other, so it can be appended to forever and cut anywhere between
+// blocks; each block's header has the time range and the min/max of each
+// column, so extras/ds2764_archive skips blocks a query doesn't need without
+// decoding them.  A block is also written early if the samples in it would
+// span more than 65 seconds.
+//
+// Call it after dsInit, which stops the archive.
+//
+// Arguments:
+//     Print *apOut - where the blocks go, 0 to stop
+//
+// Return Value:
+//     None.
+//------------------------------------------------------------------------------
+void DS2764::dsSetArchive(Print *apOut) {
+    dsFlushArchive();
+    mpArchive = apOut;
+}
+
+
+
+// Writes the samples collected so far as a short block, e.g. before the
+// SD card file is closed.
+void DS2764::dsFlushArchive(void) {
+    unsigned int uiLen;
+    int     iMin;
+    int     iMax;
+    byte    c;
+    byte    i;
+
+    if (!mpArchive || !mbyArchiveCount) {
+        return;
+    }
+
+    uiLen = dspArchiveColumns(false);
+    mpArchive->write((uint8_t) 'D');
+    mpArchive->write((uint8_t) 'S');
+    mpArchive->write((uint8_t) DS_ARCHIVE_VERSION);
+    mpArchive->write(mbyAddress);
+    mpArchive->write(mbyArchiveCount);
+    dspArchiveBytes(uiLen, 2);
+    dspArchiveBytes(mulArchiveStart, 4);
+    dspArchiveBytes(mulArchiveStart + mauiArchiveTime[mbyArchiveCount - 1], 4);
+    for (c = 0; c < DS_ARCHIVE_CHANNELS; c++) {
+        iMin = iMax = maiArchive[c][0];
+        for (i = 1; i < mbyArchiveCount; i++) {
+            if (maiArchive[c][i] < iMin) {
+                iMin = maiArchive[c][i];
+            }
+            if (maiArchive[c][i] > iMax) {
+                iMax = maiArchive[c][i];
+            }
+        }
+        dspArchiveBytes(iMin, 2);
+        dspArchiveBytes(iMax, 2);
+    }
+
+    mbyArchiveCheck = 0;
+    dspArchiveColumns(true);
+    mpArchive->write(mbyArchiveCheck);
+    mbyArchiveCount = 0;
+}
+
+
+
+// Adds the frame just read to the block, writing the block once it's full.
+// Called once the temperature has been read too, so the row has the
+// temperature from the same refresh.
+void DS2764::dspArchiveFrame(void) {
+    unsigned long ulNow = mpClock();
+    byte    bSample;
+
+    if (!mpArchive) {
+        return;
+    }
+    if (mbyArchiveCount && ulNow - mulArchiveStart > 0xFFFF) {
+        dsFlushArchive();
+    }
+    if (!mbyArchiveCount) {
+        mulArchiveStart = ulNow;
+    }
+
+    bSample = mbyArchiveCount++;
+    mauiArchiveTime[bSample] = ulNow - mulArchiveStart;
+    maiArchive[0][bSample]   = dsGetBatteryVoltage();
+    maiArchive[1][bSample]   = dspScale(dsGetCurrentRaw(), DSTraits::CURRENT_Q16);
+    maiArchive[2][bSample]   = dsGetTempRaw();
+    if (mbyArchiveCount == DS_ARCHIVE_BLOCK) {
+        dsFlushArchive();
+    }
+}
+
+
+
+// Encodes the columns of the block, writing them if abWrite is set.
+// Returns their length either way, so it's run once to size the block.
+unsigned int DS2764::dspArchiveColumns(boolean abWrite) {
+    unsigned int uiLen  = 0;
+    long    lDelta      = 0;
+    long    lPrev;
+    byte    c;
+    byte    i;
+
+    for (i = 0; i < mbyArchiveCount; i++) {
+        lPrev  = (long) mauiArchiveTime[i] - (i ? mauiArchiveTime[i - 1] : 0);
+        uiLen += dspArchiveVarint(lPrev - lDelta, abWrite);
+        lDelta = lPrev;
+    }
+    for (c = 0; c < DS_ARCHIVE_CHANNELS; c++) {
+        lPrev = 0;
+        for (i = 0; i < mbyArchiveCount; i++) {
+            uiLen += dspArchiveVarint(maiArchive[c][i] - lPrev, abWrite);
+            lPrev  = maiArchive[c][i];
+        }
+    }
+    return uiLen;
+}
+
+
+
+// Zigzag varint, 7 bits a byte, low bits first.  Returns its length.
+byte DS2764::dspArchiveVarint(long alValue, boolean abWrite) {
+    unsigned long ulZig = ((unsigned long) alValue << 1) ^ (alValue < 0 ? ~0UL : 0);
+    byte    bLen        = 0;
+    byte    bOut;
+
+    do {
+        bOut    = ulZig & 0x7F;
+        ulZig >>= 7;
+        if (ulZig) {
+            bOut |= 0x80;
+        }
+        if (abWrite) {
+            mpArchive->write(bOut);
+            mbyArchiveCheck += bOut;
+        }
+        bLen++;
+    } while (ulZig);
+    return bLen;
+}
+
+
+
+// Writes the low abCount bytes of aulValue, low byte first.
+void DS2764::dspArchiveBytes(unsigned long aulValue, byte abCount) {
+    while (abCount--) {
+        mpArchive->write((uint8_t) aulValue);
+        aulValue >>= 8;
+    }
+}
+#endif
@@ -3,6 +3,56 @@
 // DMT 4/8/2012 - Added dsReloadBatteryCapacity so caller can request a refresh of 
 //                battery capacity outside the constructor and without including it in
 //                every dsRefresh call.
+// 10/19/2026   - Added dsPollProtection fast path that reads only the Protection and
+//                Status registers and fires a configurable response on a trip.
+// 10/19/2026   - Packed per-instance state into raw register bytes and flag bits,
+//                readings are now decoded in the getters.
+// 10/19/2026   - Added DS_USE_xxx build switches to leave out unused subsystems.
+// 10/19/2026   - Added dsInitFast, one burst read at start up and the battery capacity
+//                is only read from EEPROM when it's first needed.
+// 10/19/2026   - Added an extended accumulated current count and a checkpoint log in
+//                EEPROM Block 2 (dsCheckpoint, dsRestoreCheckpoint).
+// 10/19/2026   - Scale factors and register addresses come from DSChipTraits, selected
+//                with DS_SENSE_MILLIOHM, integer getters no longer use float math.
+// 10/19/2026   - Added charge/discharge energy and power accounting (DS_USE_ENERGY)
+//                and dsSetClock for the time base.
+// 10/19/2026   - Added dsGetStateOfCharge, open circuit voltage lookup in a PROGMEM
+//                table blended with the coulomb count (DS_USE_OCV_SOC).
+// 10/19/2026   - Added capacity learning from full to empty and voltage anchored
+//                cycles, saved to Block 0 only when it drifts (DS_USE_CAPACITY_LEARNING).
+// 10/19/2026   - Added time to empty/full estimates from an exponentially weighted
+//                current average (DS_USE_RUNTIME).
+// 10/19/2026   - Added threshold watches with hysteresis and dwell time, checked
+//                after each dsRefresh (DS_USE_WATCH).
+// 10/19/2026   - Added a priority job queue serviced by dsService, EEPROM waits become
+//                due times instead of delay() (DS_USE_BUS_QUEUE).
+// 10/19/2026   - Queued jobs take a completion callback, added queued protection reset
+//                and accumulated current writes (dsSubmitResetProtection, dsSubmitAccumCurrent).
+// 10/19/2026   - Each instance has its own TwoWire bus and address, so gauges can be
+//                spread over several buses; added bus time and sample latency
+//                statistics (DS_USE_BUS_STATS).
+// 10/19/2026   - Added dsReadSnapshot, each refresh is published as one versioned
+//                record behind a sequence counter (DS_USE_SNAPSHOT).
+// 10/19/2026   - Reads follow the gauge's conversion period, unchanged frames aren't
+//                decoded again and dsGetFresh tells which readings are new
+//                (DS_USE_SYNC_SAMPLING).
+// 10/19/2026   - Added dsMarkCharge, average current and charge since a mark taken
+//                from accumulated current deltas (DS_USE_CHARGE_MARK).
+// 10/19/2026   - Added dsCalibrateCurrentOffset, measures the zero current reading
+//                and programs the Current Offset Register (DS_USE_OFFSET_CAL).
+// 10/19/2026   - Added begin/end tracing of bus phases, decoding and EEPROM waits
+//                into a ring buffer, dumped with dsDumpTrace (DS_USE_TRACE).
+// 10/19/2026   - Added dsEnterStandby/dsPollStandby, an off state that only polls
+//                the power switch latch (DS_USE_STANDBY).
+// 10/19/2026   - Added bus clock tuning, steps the I2C clock down on NACKs, short
+//                reads and garbage frames and back up after a clean run
+//                (DS_USE_BUS_TUNE).
+// 10/19/2026   - Added dsProvision, writes a golden image of EEPROM Blocks 0 - 2
+//                touching only the blocks that differ (DS_USE_PROVISION).
+// 10/19/2026   - Added dsSetFilter, median, rate clamp and IIR stages on the raw
+//                voltage and current ahead of the getters (DS_USE_FILTER).
+// 10/19/2026   - Added dsSetArchive, streams readings as compressed column blocks
+//                to any Print for extras/ds2764_archive (DS_USE_ARCHIVE).
 
 #if defined(ARDUINO) && ARDUINO >= 100
 #include "Arduino.h"
@@ -11,6 +61,135 @@
 #endif
 
 
+// Build switches
+// Set any of these to 0 to leave that subsystem and its methods out of the
+// build.  The library is compiled separately from the sketch, so the value
+// has to be seen by both: either edit the defaults here or pass them to the
+// whole build, e.g.
+//   arduino-cli compile --build-property "build.extra_flags=-DDS_USE_SLEEP=0" ...
+#ifndef DS_USE_POWER_SWITCH
+#define DS_USE_POWER_SWITCH		1	// power button handling in dsRefresh, dsSetPowerSwitchOn, dsIsPowerOn
+#endif
+#ifndef DS_USE_SLEEP
+#define DS_USE_SLEEP			1	// dsEnableSleep, dsDisableSleep (EEPROM Block 1)
+#endif
+#ifndef DS_USE_CAPACITY_EEPROM
+#define DS_USE_CAPACITY_EEPROM		1	// battery capacity in EEPROM Block 0
+#endif
+#ifndef DS_USE_FLOAT
+#define DS_USE_FLOAT			1	// dsGetCurrent, dsGetTempC/F, dsGetBatteryCapacityPercent
+#endif
+#ifndef DS_USE_PROTECTION_POLL
+#define DS_USE_PROTECTION_POLL		1	// dsPollProtection and its response settings
+#endif
+
+// Opt in subsystems, off unless turned on
+#ifndef DS_USE_CHECKPOINT
+#define DS_USE_CHECKPOINT		0	// cycle count and checkpoint log in EEPROM Block 2
+#endif
+#ifndef DS_USE_ENERGY
+#define DS_USE_ENERGY			0	// charge/discharge energy and average power
+#endif
+#ifndef DS_USE_OCV_SOC
+#define DS_USE_OCV_SOC			0	// state of charge from open circuit voltage
+#endif
+#ifndef DS_USE_CAPACITY_LEARNING
+#define DS_USE_CAPACITY_LEARNING	0	// learn battery capacity as the pack ages
+#endif
+#ifndef DS_USE_RUNTIME
+#define DS_USE_RUNTIME			0	// average current, time to empty and time to full
+#endif
+#ifndef DS_USE_WATCH
+#define DS_USE_WATCH			0	// application thresholds checked on each dsRefresh
+#endif
+#ifndef DS_USE_BUS_QUEUE
+#define DS_USE_BUS_QUEUE		0	// dsService job queue, no delay() in EEPROM updates
+#endif
+#ifndef DS_USE_BUS_STATS
+#define DS_USE_BUS_STATS		0	// bus time, utilization and sample latency
+#endif
+#ifndef DS_USE_SNAPSHOT
+#define DS_USE_SNAPSHOT			0	// dsReadSnapshot, consistent copy of the last refresh
+#endif
+#ifndef DS_USE_SYNC_SAMPLING
+#define DS_USE_SYNC_SAMPLING		0	// only read registers after the gauge has converted
+#endif
+#ifndef DS_USE_CHARGE_MARK
+#define DS_USE_CHARGE_MARK		0	// average current and charge since a mark, from the ACR
+#endif
+#ifndef DS_USE_OFFSET_CAL
+#define DS_USE_OFFSET_CAL		0	// dsCalibrateCurrentOffset, zero current offset in EEPROM Block 1
+#endif
+#ifndef DS_USE_TRACE
+#define DS_USE_TRACE			0	// time stamped begin/end events for each stage, dsDumpTrace
+#endif
+
+#ifndef DS_USE_STANDBY
+#define DS_USE_STANDBY			0	// dsEnterStandby, only the power switch is polled while off
+#endif
+
+#ifndef DS_USE_BUS_TUNE
+#define DS_USE_BUS_TUNE			0	// set the I2C clock and back it off when transactions fail
+#endif
+
+#ifndef DS_USE_PROVISION
+#define DS_USE_PROVISION		0	// dsProvision, EEPROM Blocks 0 - 2 from a golden image
+#endif
+
+#ifndef DS_USE_FILTER
+#define DS_USE_FILTER			0	// dsSetFilter, glitch filters on voltage and current
+#endif
+
+#ifndef DS_USE_ARCHIVE
+#define DS_USE_ARCHIVE			0	// dsSetArchive, history as column blocks to a Print
+#endif
+
+// Samples per DS_USE_ARCHIVE block, 8 bytes of RAM each.
+#ifndef DS_ARCHIVE_BLOCK
+#define DS_ARCHIVE_BLOCK		16
+#endif
+
+// Events kept by DS_USE_TRACE, 5 bytes each.
+#ifndef DS_TRACE_DEPTH
+#define DS_TRACE_DEPTH			32
+#endif
+
+// Sense resistor in milliohms.  25 is the DS2764's internal resistor, change
+// it for packs that use an external one.  Below 4 the scaled readings
+// overflow 32 bits.
+#ifndef DS_SENSE_MILLIOHM
+#define DS_SENSE_MILLIOHM		25
+#endif
+
+#if DS_SENSE_MILLIOHM < 4
+#error "DS_SENSE_MILLIOHM must be at least 4"
+#endif
+
+#if DS_USE_OCV_SOC && !DS_USE_CAPACITY_EEPROM
+#error "DS_USE_OCV_SOC needs DS_USE_CAPACITY_EEPROM"
+#endif
+
+#if DS_USE_CAPACITY_LEARNING && !DS_USE_CAPACITY_EEPROM
+#error "DS_USE_CAPACITY_LEARNING needs DS_USE_CAPACITY_EEPROM"
+#endif
+
+#if DS_USE_CHECKPOINT && !DS_USE_CAPACITY_EEPROM
+#error "DS_USE_CHECKPOINT needs DS_USE_CAPACITY_EEPROM"
+#endif
+
+#if DS_USE_STANDBY && !DS_USE_POWER_SWITCH
+#error "DS_USE_STANDBY needs DS_USE_POWER_SWITCH"
+#endif
+
+#if DS_USE_ARCHIVE && (DS_ARCHIVE_BLOCK < 2 || DS_ARCHIVE_BLOCK > 255)
+#error "DS_ARCHIVE_BLOCK must be 2 - 255"
+#endif
+
+#if DS_USE_BUS_TUNE && !(defined(ARDUINO) && ARDUINO >= 10600)
+#error "DS_USE_BUS_TUNE needs TwoWire::setClock, Arduino 1.6 or later"
+#endif
+
+
 // constants
 //Bit Masks for Gas Gauge Settings
 #define DS00PS        			0x80	// Power Switch bit        in bit 7 of the Special Features Register
@@ -23,11 +202,13 @@
 #define DS00CE        			0x02	// Charging Enabled        in bit 1 of the Protection Reg.
 #define DS00DE        			0x01	// Discharging Enabled     in bit 0 of the Protection Reg.
 #define DS00SLP       			0x20	// Sleep Enable bit        in bit 5 of the Status Register
+#define DS07EEC       			0x80	// EEPROM Copy in progress in bit 7 of the EEPROM Register
 #define DS_ADDRESS			0x34	// Default i2c Address for the chip.
 
 // Registers and Memory Locations for various settings
 #define DS_PROTECTION_REGISTER	        0x00
 #define DS_STATUS_REGISTER		0x01
+#define DS_EEPROM_REGISTER		0x07
 #define DS_SPECIAL_FEATURE_REG	        0x08
 #define DS_VOLT_REG_HIBYTE		0x0C
 #define DS_VOLT_REG_LOBYTE		0x0D
@@ -42,6 +223,9 @@
 #define DS_EEPROM_BLOCK1_START	        0x30
 #define DS_CURRENT_OFFSET_REG	        0x33
 #define DS_EEPROM_BLOCK2_START	        0x40
+#define DS_EEPROM_BLOCK0_LEN		16
+#define DS_EEPROM_BLOCK1_LEN		8
+#define DS_EEPROM_BLOCK2_LEN		16
 #define DS_FUNCTION_REGISTER	        0xFE
 #define DS_SLEEP_MODE_ADDR		0x31	//in 2nd byte of EEPROM Block 1
 
@@ -61,6 +245,16 @@
 #define DS_RESET_ENABLE		        1	// use with dsResetProtection -  enables charge and discharge
 #define DS_RESET_DISABLE	        0	// use with dsResetProtection - disables charge and discharge
 
+// Trip flags watched by dsPollProtection by default
+#define DS_PROTECTION_TRIP_MASK        (DS00OV | DS00UV | DS00COC | DS00DOC)
+
+// Responses for dsSetProtectionResponse - may be OR'ed together
+#define DS_RESPONSE_NONE               0x00	// only report the change
+#define DS_RESPONSE_DISABLE_CHARGE     0x02	// clear the Charge Enable bit (DS00CE) on a trip
+#define DS_RESPONSE_DISABLE_DISCHARGE  0x01	// clear the Discharge Enable bit (DS00DE) on a trip
+#define DS_RESPONSE_DISABLE            0x03	// clear both, same as dsResetProtection(DS_RESET_DISABLE)
+#define DS_RESPONSE_REFRESH            0x04	// run a full dsRefresh when the watched bits change
+
 
 #define DS_VOLTS_LOW			1
 #define DS_VOLTS_OK			2
@@ -88,18 +282,313 @@
 #define DS_SLEEP_ENABLED	1
 #define DS_SLEEP_DISABLED	0
 
+// Bits in mbyFlags - internal use
+#define DS_FLAG_POWER_ON	0x01
+#define DS_FLAG_POWER_SWITCH_ON	0x02
+#define DS_FLAG_SLEEP_ENABLED	0x04
+#define DS_FLAG_TEMP_VALID	0x08
+#define DS_FLAG_CAPACITY_LOADED	0x10
+#define DS_FLAG_CAPACITY_VALID	0x20	// capacity came from a good Block 0 record, not the default
+#define DS_FLAG_AVERAGE_VALID	0x40	// mlAvgCurrent has been seeded
+#define DS_FLAG_FRAME_VALID	0x80	// the last voltage/current read worked
+
+#define DS_BURST_LEN		(DS_TEMP_REG_LOBYTE + 1)	// 0x00 - 0x19 in one read, internal use
+
+// Checkpoint log in EEPROM Block 2 - two 8 byte records, written alternately
+#define DS_CHECKPOINT_RECORD_LEN	8
+#define DS_CHECKPOINT_SLOTS		2
+#define DS_CHECKPOINT_INTERVAL		3600000UL	// default ms between saves, see dsSetCheckpointInterval
+
+#define DS_REST_CURRENT			50	// default mA below which the open circuit voltage is trusted
+
+// Capacity learning defaults, see dsSetLearningVoltages and dsSetCapacityDrift
+#define DS_LEARN_FULL_VOLTS		4150	// mV, full once charge current has tapered off
+#define DS_LEARN_EMPTY_VOLTS		3300	// mV, or when the chip flags under voltage
+#define DS_LEARN_TAPER_CURRENT		100	// mA of charge current still counted as full
+#define DS_LEARN_MIN_SWING		400	// tenths of a percent between two voltage anchors
+#define DS_LEARN_DRIFT_PERCENT		5	// save to Block 0 once learned capacity is this far off
+
+#define DS_AVERAGE_TIME			60	// default seconds for dsGetAverageCurrent to settle, see dsSetAverageTime
+#define DS_TIME_UNKNOWN			0xFFFFFFFFUL	// dsGetTimeToEmpty/Full when there's no estimate
+
+// Watch channels, DSWatch.channel
+#define DS_WATCH_VOLTAGE		0	// mV
+#define DS_WATCH_CURRENT		1	// mA, + when charging
+#define DS_WATCH_TEMP			2	// .125 degrees C, see DS_WATCH_DEGC
+#define DS_WATCH_ACCUM			3	// mAh
+#define DS_WATCH_AVERAGE_CURRENT	4	// mA, needs DS_USE_RUNTIME
+#define DS_WATCH_CHANNELS		5
+
+// DSWatch.mode, the library keeps the state in the top bits
+#define DS_WATCH_ABOVE			0x00	// trips when the value goes above threshold
+#define DS_WATCH_BELOW			0x01	// trips when the value goes below threshold
+#define DS_WATCH_PENDING		0x40	// past threshold, waiting out the dwell time
+#define DS_WATCH_TRIPPED		0x80
+
+#define DS_WATCH_DEGC(c)		((c) * 8)	// degrees C to DS_WATCH_TEMP units
+
+// Conversion synchronized sampling, see dsSetConversionPeriod
+#define DS_CONVERSION_PERIOD		88	// ms, the DS2764's current conversion period
+#define DS_CONVERSION_MARGIN		2	// ms after the expected conversion to read
+#define DS_CONVERSION_MIN		10	// ms, shorter gaps are ignored while learning
+#define DS_CONVERSION_SAMPLES		8	// gaps between changed frames timed while learning
+
+// Current offset calibration, see dsCalibrateCurrentOffset
+#define DS_OFFSET_WINDOW		2000	// ms of idle readings averaged
+#define DS_OFFSET_MAX			127	// the register is one signed byte of 15.625uV steps
+
+// Standby, see dsEnterStandby
+#define DS_STANDBY_SLEEP		2000	// ms between dsPollStandby calls, bounds how late a press is seen
+
+// Bus clock tuning, see dsSetBusClock.  The clock is halved from the top
+// speed for each step down.
+#define DS_TUNE_MAX_CLOCK		400000L	// Hz, where tuning starts
+#define DS_TUNE_MIN_CLOCK		50000L	// Hz, no lower than this
+#define DS_TUNE_WINDOW			32	// transactions per error count
+#define DS_TUNE_DOWN_ERRORS		2	// errors in a window that step the clock down
+#define DS_TUNE_UP_WINDOWS		8	// clean windows before stepping back up
+#define DS_TUNE_MAX_BACKOFF		4	// each step down doubles the clean windows, up to 16x
+
+// Provisioning, see dsProvision
+#define DS_IMAGE_BLOCKS			3
+#define DS_IMAGE_LEN			(DS_EEPROM_BLOCK0_LEN + DS_EEPROM_BLOCK1_LEN + DS_EEPROM_BLOCK2_LEN)
+#define DS_EEPROM_COPY_WAIT		10	// ms, longest a block save takes
+#define DS_PROVISION_MATCHED		0	// already the same as the image, not written
+#define DS_PROVISION_WRITTEN		1	// written, saved and read back the same
+#define DS_PROVISION_BUS_ERROR		2	// a transaction failed or the save never finished
+#define DS_PROVISION_VERIFY_FAILED	3	// saved but read back different, e.g. a locked block
+
+// Filter channels and stages, see dsSetFilter.  The stages run in this
+// order, whichever of them are set.
+#define DS_FILTER_VOLTAGE		0
+#define DS_FILTER_CURRENT		1
+#define DS_FILTER_CHANNELS		2
+#define DS_FILTER_MEDIAN3		0x01	// median of the last 3 samples
+#define DS_FILTER_MEDIAN5		0x02	// median of the last 5, wins over MEDIAN3
+#define DS_FILTER_CLAMP			0x04	// at most maxStep register units from the last output
+#define DS_FILTER_IIR			0x08	// y += (x - y) / 2^shift
+#define DS_FILTER_HISTORY		5
+
+// Archive blocks, see dsSetArchive.  A block is
+//     'D' 'S' version address count length(2) first(4) last(4)
+//     min(2) max(2) for millivolts, milliamps and temperature
+//     time column, then the three value columns, as varints
+//     check, the low byte of the sum of the column bytes
+// little endian, length being the bytes of the columns.  Times are ms from
+// the driver clock, stored as the delta of the delta from the sample before,
+// values as the delta from the sample before, both zigzag encoded so small
+// negative numbers stay small.
+#define DS_ARCHIVE_VERSION		1
+#define DS_ARCHIVE_HEADER_LEN		27
+#define DS_ARCHIVE_CHANNELS		3	// millivolts, milliamps, .125 degrees C
+
+// Traced stages, see dsDumpTrace
+#define DS_TRACE_REFRESH		0	// all of dsRefresh
+#define DS_TRACE_ADDRESS		1	// setting the register address before a read
+#define DS_TRACE_REQUEST		2	// requestFrom
+#define DS_TRACE_WRITE			3	// register writes through dspWriteBytes
+#define DS_TRACE_DELAY			4	// the wait after reading voltage and current
+#define DS_TRACE_DECODE			5	// everything worked out from a new frame
+#define DS_TRACE_DISPATCH		6	// watches and job callbacks
+#define DS_TRACE_SLEEP_MODE		7	// dsEnableSleep/dsDisableSleep
+#define DS_TRACE_CAPACITY		8	// dsSetBatteryCapacity
+#define DS_TRACE_EEPROM_WAIT		9	// delays for EEPROM recall and save
+#define DS_TRACE_SERVICE		10	// one dsService step
+#define DS_TRACE_STAGES			11
+#define DS_TRACE_END_BIT		0x80	// set in DSTraceEvent.stage for an end
+
+// dsGetFresh bits, set for readings that changed in the last refresh
+#define DS_FRESH_VOLTAGE		0x01
+#define DS_FRESH_CURRENT		0x02
+#define DS_FRESH_ACCUM			0x04
+#define DS_FRESH_TEMP			0x08
+
+// Jobs for dsService, highest priority first
+#define DS_JOB_POLL			0	// dsPollProtection
+#define DS_JOB_RESET			1	// dsResetProtection
+#define DS_JOB_REFRESH			2	// dsRefresh, one register group per step
+#define DS_JOB_ACCUM			3	// dsSetAccumCurrent
+#define DS_JOB_SLEEP			4	// dsEnableSleep/dsDisableSleep, EEPROM Block 1
+#define DS_JOB_CAPACITY			5	// dsSetBatteryCapacity, EEPROM Block 0
+#define DS_JOBS				6
+
+#define DS_LEARN_IDLE			0	// internal use
+#define DS_LEARN_FROM_FULL		1	// internal use
+
+
+//------------------------------------------------------------------------------
+// DSChipTraits
+//
+// Register layout and scale factors for a gauge with the DS2764 register
+// style.  Each scale is a Q16 fixed point multiplier, so a reading is
+// (raw * XXX_Q16) >> 16 and everything folds into an integer multiply and
+// shift at compile time.  The current and accumulated current LSBs are
+// 15.625uV and 6.25uVh across the sense resistor.
+//
+// The DS2760/DS2762 use the same register map and LSB sizes, but talk 1-Wire
+// rather than I2C, so only the traits carry over to them.
+//------------------------------------------------------------------------------
+template <unsigned int SENSE_MILLIOHM>
+struct DSChipTraits {
+    static const byte VOLT_REG      = DS_VOLT_REG_HIBYTE;
+    static const byte CURRENT_REG   = DS_CURRENT_REG_HIBYTE;
+    static const byte ACR_REG       = DS_ACC_CURRENT_REG_HI;
+    static const byte TEMP_REG      = DS_TEMP_REG_HIBYTE;
+
+    static const byte VOLT_SHIFT    = 5;	// unused low bits in each register
+    static const byte CURRENT_SHIFT = 3;
+    static const byte TEMP_SHIFT    = 5;
+
+    static const long VOLT_Q16      = 319816L;				// 4.88mV
+    static const long CURRENT_Q16   = 1024000L / SENSE_MILLIOHM;	// 15.625uV / R in mA
+    static const long ACR_Q16       = 409600L / SENSE_MILLIOHM;		// 6.25uVh / R in mAh
+    static const long ACR_PER_MAH_Q16 = 262144L * SENSE_MILLIOHM / 25;	// 1 / ACR_Q16, for writing the ACR
+    static const long ACR_MA_MS     = 22500000L / SENSE_MILLIOHM;	// one ACR count as mA over 1ms
+    static const long TEMP_Q16      = 8192L;				// .125 degrees C
+};
+
+typedef DSChipTraits<DS_SENSE_MILLIOHM> DSTraits;
+
+
+// One point of an open circuit voltage table for dsSetOcvTable.  Tables are
+// kept in PROGMEM, sorted by voltage, and neighbouring points should be
+// less than 256mV apart to keep the lookup on 16 bit math.
+struct DSOcvPoint {
+    int     millivolts;
+    int     permille;	// state of charge, 0 - 1000
+};
+
+#if DS_USE_OCV_SOC
+#include <avr/pgmspace.h>
+extern const DSOcvPoint DS_OCV_LIION[] PROGMEM;	// generic Li-ion/LiPo cell at rest
+#define DS_OCV_LIION_COUNT	12
+#endif
+
+
+// One application threshold for dsSetWatches.  The table belongs to the
+// sketch, fill in the first five fields and leave the rest 0, e.g.
+//     DSWatch watches[] = {
+//         { DS_WATCH_TEMP, DS_WATCH_ABOVE, DS_WATCH_DEGC(55), DS_WATCH_DEGC(2), 5000 },
+//         { DS_WATCH_VOLTAGE, DS_WATCH_BELOW, 3400, 50, 0 },
+//     };
+// The watch trips once the value has been past threshold for dwell ms, and
+// clears when it comes back more than hysteresis the other side of it.
+struct DSWatch {
+    byte    channel;	// DS_WATCH_VOLTAGE etc.
+    byte    mode;	// DS_WATCH_ABOVE or DS_WATCH_BELOW
+    int     threshold;
+    int     hysteresis;
+    unsigned long dwell;	// ms
+    unsigned long since;	// internal use, when it went past threshold
+};
+
+// Called from dsRefresh when a watch trips or clears, with its index in the
+// table.
+typedef void (*DSWatchCallback)(byte, boolean);
+
+
+// Called by dsService when a submitted job finishes, with its DS_JOB_xxx
+// number and false if any of its transactions failed.
+typedef void (*DSDoneCallback)(byte, boolean);
+
+
+// One refresh worth of decoded readings, published by the driver after
+// each refresh and copied out with dsReadSnapshot.  The layout only ever
+// changes along with DS_SNAPSHOT_VERSION.
+#define DS_SNAPSHOT_VERSION	1
+
+struct DSSnapshot {
+    byte    version;	// DS_SNAPSHOT_VERSION
+    byte    protect;	// Protection Register, 0xFF if the read failed
+    byte    status;	// Status Register, 0xFF if the read failed
+    byte    valid;	// DS_SNAPSHOT_FRAME_VALID | DS_SNAPSHOT_TEMP_VALID
+    int     millivolts;
+    int     milliamps;	// + when charging
+    int     temp;	// .125 degrees C
+    long    accumulated;	// mAh, extended accumulated current
+    unsigned long millis;	// clock time of the refresh
+};
+
+
+// One entry of the DS_USE_TRACE ring buffer.
+struct DSTraceEvent {
+    unsigned long micros;	// trace clock time
+    byte    stage;	// DS_TRACE_xxx, with DS_TRACE_END_BIT at the end of it
+};
+
+
+// A point on the accumulated current count, taken with dsMarkCharge and
+// kept by the sketch, so there can be as many marks as there are users.
+struct DSChargeMark {
+    long    acr;	// extended accumulated current, raw counts
+    unsigned long millis;	// clock time of the read it came from
+    byte    epoch;	// internal use, changes whenever the ACR is written
+};
+
+#define DS_SNAPSHOT_FRAME_VALID	0x01	// voltage, current and accumulated current were read
+#define DS_SNAPSHOT_TEMP_VALID	0x02
+
+
+// Golden image for dsProvision: EEPROM Blocks 0, 1 and 2 back to back
+// (16 + 8 + 16 bytes).  Only the bits set in mask are provisioned, the rest
+// keep whatever the pack already has, so a 0 mask byte skips a byte
+// altogether, and a mask of 0x20 at offset 17 (address 0x31) provisions just
+// the sleep enable bit.
+struct DSImage {
+    byte    data[DS_IMAGE_LEN];
+    byte    mask[DS_IMAGE_LEN];
+};
+
+// What dsProvision did, per block.
+struct DSProvisionReport {
+    byte    result[DS_IMAGE_BLOCKS];	// DS_PROVISION_xxx
+    byte    changed[DS_IMAGE_BLOCKS];	// bytes that differed from the image
+};
+
+
+// State of one dsSetFilter channel, internal use.  Values are in register
+// units, 4.88mV for voltage and .625mA for current.
+struct DSFilterState {
+    int     hist[DS_FILTER_HISTORY];	// last inputs, hist[next] is the oldest
+    int     clamp;	// output of the clamp stage
+    long    iir;	// output of the IIR stage, x 256
+    int     out;	// what the getters return
+    int     maxStep;
+    byte    stages;	// DS_FILTER_xxx
+    byte    shift;
+    byte    next;
+    boolean seeded;	// false until the first sample
+};
+
+
+class TwoWire;
+class Print;
+
+
+// Time base for anything the driver integrates or rate limits, returns ms.
+// millis() unless dsSetClock says otherwise.
+typedef unsigned long (*DSClock)(void);
+
 
 class DS2764 {
 
     public:
+	DS2764(void);
+	DS2764(TwoWire&, byte = DS_ADDRESS);
+
         void	dsInit(void);
+	void	dsInitFast(void);
 	void	dsRefresh(void);
+#if DS_USE_PROTECTION_POLL
+	boolean	dsPollProtection(void);
+	void	dsSetProtectionResponse(int, int);
+	unsigned long dsGetPollMicrosMax(void);
+#endif
 	void    dsResetProtection(int);
-	float	dsGetCurrent(void);
+	int	dsGetCurrentRaw(void);
 	int	dsGetAccumulatedCurrent();
+	long	dsGetAccumulatedCurrentExt(void);
 	int	dsGetBatteryVoltage(void);
-	int	dsGetBatteryCapacity(void);
-	float	dsGetBatteryCapacityPercent(void);
 	int	dsGetVoltageStatus(void);
 	int	dsGetChargeStatus(void);
 	int	dsGetDischargeStatus(void);
@@ -107,44 +596,381 @@ class DS2764 {
 	boolean	dsIsChargeEnabled(void);
 	boolean	dsIsDischargeOn(void);
 	boolean	dsIsDischargeEnabled();
-	float	dsGetTempF(void);
-	float	dsGetTempC(void);
+	int	dsGetTempRaw(void);
 	boolean	dsIsSleepEnabled(void);
-        boolean dsIsPowerOn(void);
 		
 	void	dsSetAccumCurrent(int);
+	void	dsSetClock(DSClock);
+
+#if DS_USE_FLOAT
+	float	dsGetCurrent(void);
+	float	dsGetTempF(void);
+	float	dsGetTempC(void);
+#endif
+
+#if DS_USE_CAPACITY_EEPROM
+	int	dsGetBatteryCapacity(void);
+#if DS_USE_FLOAT
+	float	dsGetBatteryCapacityPercent(void);
+#endif
 	void	dsSetBatteryCapacity(int);
+	void    dsReloadBatteryCapacity(void);
+#endif
+
+#if DS_USE_POWER_SWITCH
+        boolean dsIsPowerOn(void);
 	void    dsSetPowerSwitchOn(void);
+#endif
+
+#if DS_USE_SLEEP
 	void	dsEnableSleep(void);
 	void	dsDisableSleep(void);
-	void    dsReloadBatteryCapacity(void);
+#endif
+
+#if DS_USE_ENERGY
+	long	dsGetPower(void);
+	long	dsGetAveragePower(void);
+	long	dsGetChargeEnergy(void);
+	long	dsGetDischargeEnergy(void);
+	void	dsResetEnergy(void);
+#endif
+
+#if DS_USE_OCV_SOC
+	int	dsGetStateOfCharge(void);
+	int	dsGetOcvStateOfCharge(void);
+	void	dsSetOcvTable(const DSOcvPoint*, byte);
+	void	dsSetRestCurrent(int);
+#endif
+
+#if DS_USE_CAPACITY_LEARNING
+	void	dsSetLearningVoltages(int, int);
+	void	dsSetCapacityDrift(byte);
+#endif
+
+#if DS_USE_RUNTIME
+	int	dsGetAverageCurrent(void);
+	unsigned long dsGetTimeToEmpty(void);
+#if DS_USE_CAPACITY_EEPROM
+	unsigned long dsGetTimeToFull(void);
+#endif
+	void	dsSetAverageTime(unsigned int);
+#endif
+
+#if DS_USE_WATCH
+	void	dsSetWatches(DSWatch*, byte, DSWatchCallback);
+	boolean	dsIsWatchTripped(byte);
+#endif
+
+#if DS_USE_BUS_QUEUE
+	boolean	dsService(void);
+	boolean	dsIsPending(byte);
+	boolean	dsSubmitRefresh(DSDoneCallback = NULL);
+	boolean	dsSubmitResetProtection(int, DSDoneCallback = NULL);
+	boolean	dsSubmitAccumCurrent(int, DSDoneCallback = NULL);
+#if DS_USE_PROTECTION_POLL
+	boolean	dsSubmitPoll(DSDoneCallback = NULL);
+#endif
+#if DS_USE_SLEEP
+	boolean	dsSubmitSleep(int, DSDoneCallback = NULL);
+#endif
+#if DS_USE_CAPACITY_EEPROM
+	boolean	dsSubmitBatteryCapacity(int, DSDoneCallback = NULL);
+#endif
+#endif
+
+#if DS_USE_BUS_STATS
+	unsigned long dsGetBusMicros(void);
+	int	dsGetBusUtilization(void);
+	unsigned long dsGetSampleMicros(void);
+	unsigned long dsGetSampleMicrosMax(void);
+	void	dsResetBusStats(void);
+#endif
+
+#if DS_USE_SNAPSHOT
+	boolean	dsReadSnapshot(DSSnapshot&);
+	byte	dsGetSnapshotSequence(void);
+#endif
+
+#if DS_USE_SYNC_SAMPLING
+	byte	dsGetFresh(void);
+	void	dsSetConversionPeriod(unsigned int);
+	unsigned int dsGetConversionPeriod(void);
+#endif
+
+#if DS_USE_OFFSET_CAL
+	boolean	dsCalibrateCurrentOffset(unsigned int = DS_OFFSET_WINDOW);
+	int	dsGetCurrentOffset(void);
+#endif
+
+#if DS_USE_STANDBY
+	void	dsEnterStandby(void);
+	boolean	dsPollStandby(void);
+	boolean	dsIsStandby(void);
+#endif
+
+#if DS_USE_BUS_TUNE
+	void	dsSetBusClock(unsigned long, unsigned long = DS_TUNE_MIN_CLOCK);
+	unsigned long dsGetBusClock(void);
+	unsigned int dsGetBusErrors(void);
+#endif
+
+#if DS_USE_PROVISION
+	boolean	dsProvision(const DSImage&, DSProvisionReport&);
+#endif
+
+#if DS_USE_FILTER
+	void	dsSetFilter(byte, byte, int = 0, byte = 2);
+	int	dsGetBatteryVoltageUnfiltered(void);
+	int	dsGetCurrentRawUnfiltered(void);
+#endif
+
+#if DS_USE_ARCHIVE
+	void	dsSetArchive(Print*);
+	void	dsFlushArchive(void);
+#endif
+
+#if DS_USE_TRACE
+	void	dsSetTraceClock(DSClock);
+	void	dsDumpTrace(Print&);
+	void	dsClearTrace(void);
+#endif
+
+#if DS_USE_CHARGE_MARK
+	void	dsMarkCharge(DSChargeMark&);
+	boolean	dsGetAverageCurrentSince(const DSChargeMark&, int&);
+	boolean	dsGetChargeSince(const DSChargeMark&, long&);
+#endif
+
+#if DS_USE_CHECKPOINT
+	unsigned int dsGetCycleCount(void);
+	boolean	dsCheckpoint(void);
+	boolean	dsRestoreCheckpoint(void);
+	void	dsSetCheckpointInterval(unsigned long);
+#endif
 		
 		
 	private:
 
-	int	miProtect;
-    	int	miStatus;
-    	int	miVolts;
-    	int     miBatteryCapacity;
-    	boolean	mbPowerOn;
-    	boolean mbPowerSwitchOn;
-    	boolean	mbSleepEnabled;
-    	float	mfCurrent;
-    	int 	miAccCurrent;
-    	float	mfTempC;
-    	float   mfTempF;
+	// Raw register contents as read from the chip, decoded by the getters.
+	// On AVR the default build is 29 bytes per instance, see README.txt; a
+	// member added here goes in extras/sim/sim_size.cpp too.
+	byte	mbyProtect;		// 0x00, 0xFF if the read failed
+	byte	mbyStatus;		// 0x01, 0xFF if the read failed
+	byte	mabVoltAndCurrent[6];	// 0x0C - 0x11: voltage, current, accumulated current
+	byte	mabTemp[2];		// 0x18 - 0x19
+	byte	mbyFlags;		// DS_FLAG_xxx
+	long	mlAccCurrentExt;	// ACR extended to 32 bits, .25mAh units
+	DSClock	mpClock;		// set by the constructor, kept by dsInit
+	TwoWire	*mpWire;		// set by the constructor, not dsInit
+	byte	mbyAddress;
+#if DS_USE_CAPACITY_EEPROM
+	int     miBatteryCapacity;
+#endif
+#if DS_USE_PROTECTION_POLL
+	byte	mbyProtectMask;
+	byte	mbyProtectResponse;
+	byte	mbyProtectPolled;	// 0x00 as of the last good dsPollProtection read
+	unsigned long mulPollMicrosMax;
+#endif
+#if DS_USE_ENERGY
+	int64_t	mllChargeEnergy;	// uW x ms
+	int64_t	mllDischargeEnergy;	// uW x ms
+	long	mlPower;		// uW, + when charging
+	unsigned long mulEnergyStart;
+	unsigned long mulEnergyLast;
+#endif
+#if DS_USE_OCV_SOC
+	const DSOcvPoint *mpOcvTable;	// in PROGMEM
+	byte	mbyOcvCount;
+	int	miRestCurrent;		// mA
+	unsigned long mulRestRecip;	// 2^24 / miRestCurrent
+#endif
+#if DS_USE_CAPACITY_LEARNING
+	int	miStoredCapacity;	// what's in Block 0, 0 if unknown
+	int	miLearnFullVolts;
+	int	miLearnEmptyVolts;
+	long	mlLearnFullAcc;		// mlAccCurrentExt when last full
+	byte	mbyLearnState;		// DS_LEARN_xxx
+	byte	mbyDriftPercent;
+#if DS_USE_OCV_SOC
+	long	mlLearnAnchorAcc;	// mlAccCurrentExt at the last voltage anchor
+	int	miLearnAnchorSoc;	// -1 if there isn't one yet
+#endif
+#endif
+#if DS_USE_RUNTIME
+	long	mlAvgCurrent;		// mA x 256, + when charging
+	unsigned long mulAvgLast;
+	unsigned long mulAvgMillis;	// time constant
+	unsigned long mulAvgRecip;	// 2^32 / mulAvgMillis
+#endif
+#if DS_USE_WATCH
+	DSWatch	*mpWatches;
+	byte	mbyWatchCount;
+	DSWatchCallback mpWatchCallback;
+#endif
+#if DS_USE_BUS_QUEUE
+	byte	mabJobStep[DS_JOBS];	// 0 if the job isn't pending
+	unsigned long maulJobDue[DS_JOBS];	// clock time the next step may run
+	DSDoneCallback mapJobDone[DS_JOBS];
+	byte	mbyJobFailed;		// bit per job, a transaction failed
+	byte	mbyJobReset;		// DS_RESET_xxx for DS_JOB_RESET
+	byte	mbyJobSleep;		// sleep setting for DS_JOB_SLEEP
+	int	miJobAccum;		// ACR register value for DS_JOB_ACCUM
+	int	miJobCapacity;		// for DS_JOB_CAPACITY
+#endif
+#if DS_USE_BUS_STATS
+	unsigned long mulBusMicros;	// time spent in the driver's bus calls
+	unsigned long mulBusSince;	// micros() when the stats were reset
+	unsigned long mulSampleStart;	// micros() when the pending refresh started
+	unsigned long mulSampleMicros;
+	unsigned long mulSampleMicrosMax;
+	byte	mbyBusDepth;		// nesting of dspBusBegin/dspBusEnd
+#endif
+#if DS_USE_SNAPSHOT
+	DSSnapshot msSnapshot;
+	volatile byte mbySnapshotSeq;	// odd while msSnapshot is being written, a byte so reads are atomic
+#endif
+#if DS_USE_SYNC_SAMPLING
+	unsigned long mulFrameSeen;	// when the last changed frame was converted, as far as is known
+	unsigned long mulFrameRead;	// when the frame was last read
+	unsigned long mulFrameDue;	// no reads before this
+	unsigned int muiConvPeriod;	// ms, 0 while it's still being learned
+	byte	mbyConvLearn;		// changed frames still to time, 0 once learned
+	byte	mabConvGap[DS_CONVERSION_SAMPLES];	// ms, the gaps timed while learning
+	byte	mbyFresh;		// DS_FRESH_xxx
+#endif
+#if DS_USE_STANDBY
+	boolean	mbStandby;
+#endif
+#if DS_USE_BUS_TUNE
+	unsigned long mulClockMax;	// Hz, set by the constructor or dsSetBusClock
+	unsigned long mulClockMin;
+	byte	mbyClockLevel;		// times the clock has been halved
+	byte	mbyTuneTxns;		// transactions so far in this window
+	byte	mbyTuneErrors;
+	byte	mbyTuneClean;		// clean windows in a row
+	byte	mbyTuneBackoff;
+	unsigned int muiBusErrors;
+#endif
+#if DS_USE_FILTER
+	DSFilterState masFilter[DS_FILTER_CHANNELS];
+#endif
+#if DS_USE_ARCHIVE
+	Print	*mpArchive;		// 0 when not archiving
+	unsigned long mulArchiveStart;	// clock time of the block's first sample
+	unsigned int mauiArchiveTime[DS_ARCHIVE_BLOCK];	// ms after mulArchiveStart
+	int	maiArchive[DS_ARCHIVE_CHANNELS][DS_ARCHIVE_BLOCK];
+	byte	mbyArchiveCount;
+	byte	mbyArchiveCheck;
+#endif
+#if DS_USE_TRACE
+	DSTraceEvent masTrace[DS_TRACE_DEPTH];
+	byte	mbyTraceNext;		// slot the next event goes in
+	byte	mbyTraceCount;
+	DSClock	mpTraceClock;		// micros() unless dsSetTraceClock says otherwise
+#endif
+#if DS_USE_CHARGE_MARK
+	unsigned long mulAccMillis;	// when mlAccCurrentExt was last read
+	byte	mbyAccEpoch;		// bumped each time the ACR is written
+#endif
+#if DS_USE_CHECKPOINT
+	unsigned int muiCycleCount;
+	long	mlCycleDischarge;	// discharge since the last cycle, .25mAh units
+	unsigned long mulCheckpointMillis;
+	unsigned long mulCheckpointInterval;
+	byte	mbyCheckpointSeq;	// bit 7 is the slot of the newest record
+#endif
     	
     	
     	
-    	void    dspGetProtection(void);
-        void    dspGetBatteryCapacity(void);
+    	void    dspInitMembers(void);
+    	byte    dspReadBytes(byte, byte*, byte);
+    	boolean dspWriteBytes(byte, const byte*, byte);
+    	boolean dspGetProtection(void);
     	void    dspGetVoltageAndCurrent(void);  
     	void    dspGetTemp(void);
+    	void    dspProcessFrame(void);
+    	void    dspUpdateAccumExt(void);
+    	void    dspMoveClock(unsigned long);
+    	static long dspScale(long, long);
+    	static long dspAcrToMah(long);
+#if DS_USE_TRACE
+        void    dspTrace(byte);
+#endif
+#if DS_USE_BUS_TUNE
+        void    dspBusResult(boolean);
+#endif
+#if DS_USE_FILTER
+        void    dspFilterFrame(void);
+        static void dspFilter(DSFilterState&, int);
+#endif
+#if DS_USE_ARCHIVE
+        void    dspArchiveFrame(void);
+        unsigned int dspArchiveColumns(boolean);
+        byte    dspArchiveVarint(long, boolean);
+        void    dspArchiveBytes(unsigned long, byte);
+#endif
+#if DS_USE_PROVISION
+        boolean dspRecallBlock(byte, byte*);
+        boolean dspSaveBlock(byte);
+#endif
+        void    dspWriteProtection(int);
+#if DS_USE_CAPACITY_EEPROM
+        void    dspGetBatteryCapacity(void);
+#endif
     	
+#if DS_USE_POWER_SWITCH
         void    dspGetPowerSwitch(void);
         void    dspHandlePower(void);
+        void    dspSetPowerSwitchOn(void);    // so we can detect when it's pushed again.
+#endif
         
+#if DS_USE_SLEEP
         void    dspSetSleepMode(int);
-        void    dspSetPowerSwitchOn(void);    // so we can detect when it's pushed again.
+#endif
+
+#if DS_USE_ENERGY
+        void    dspUpdateEnergy(void);
+#endif
+
+#if DS_USE_CAPACITY_LEARNING
+        void    dspLearnCapacity(void);
+        void    dspUpdateCapacity(long, byte);
+#endif
+
+#if DS_USE_RUNTIME
+        void    dspUpdateAverage(void);
+#endif
+
+#if DS_USE_WATCH
+        void    dspCheckWatches(void);
+#endif
+
+#if DS_USE_BUS_QUEUE
+        boolean dspSubmitJob(byte, DSDoneCallback);
+        void    dspRunJob(byte);
+        void    dspJobWait(byte, unsigned long);
+        void    dspJobCheck(byte, boolean);
+#endif
+
+#if DS_USE_BUS_STATS
+        void    dspBusBegin(void);
+        void    dspBusEnd(void);
+        void    dspSampleDone(void);
+#endif
+
+#if DS_USE_SNAPSHOT
+        void    dspPublishSnapshot(void);
+#endif
+
+#if DS_USE_SYNC_SAMPLING
+        boolean dspSyncFrame(void);
+        void    dspLearnConversionPeriod(void);
+#endif
+
+#if DS_USE_CHECKPOINT
+        byte    dspCrc8(const byte*, byte);
+        void    dspEncodeCheckpoint(byte*, byte);
+#endif
 
 }; // end class DS2764
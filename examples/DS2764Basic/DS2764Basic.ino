@@ -0,0 +1,44 @@
+// DS2764Basic
+// Reads the gas gauge once a second and prints the readings.  Also used by
+// extras/size_profiles.sh to measure each DS_USE_xxx build profile, so it
+// only calls methods that the current profile includes.
+#include <Wire.h>
+#include <DS2764.h>
+
+DS2764 gauge;
+
+void setup() {
+    Serial.begin(9600);
+    Wire.begin();
+    gauge.dsInit();
+}
+
+void loop() {
+    gauge.dsRefresh();
+
+    Serial.print("Volts (mV): ");
+    Serial.println(gauge.dsGetBatteryVoltage());
+#if DS_USE_FLOAT
+    Serial.print("Current (mA): ");
+    Serial.println(gauge.dsGetCurrent());
+    Serial.print("Temp (F): ");
+    Serial.println(gauge.dsGetTempF());
+#else
+    Serial.print("Current (.625mA): ");
+    Serial.println(gauge.dsGetCurrentRaw());
+    Serial.print("Temp (.125C): ");
+    Serial.println(gauge.dsGetTempRaw());
+#endif
+    Serial.print("Acc. Current (mAh): ");
+    Serial.println(gauge.dsGetAccumulatedCurrent());
+#if DS_USE_CAPACITY_EEPROM && DS_USE_FLOAT
+    Serial.print("Capacity (%): ");
+    Serial.println(gauge.dsGetBatteryCapacityPercent());
+#endif
+#if DS_USE_POWER_SWITCH
+    Serial.print("Power: ");
+    Serial.println(gauge.dsIsPowerOn() ? "On" : "Off");
+#endif
+
+    delay(1000);
+}
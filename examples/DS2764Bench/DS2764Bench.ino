@@ -0,0 +1,169 @@
+// DS2764Bench
+// Times each public call on the AVR itself: CPU cycles from Timer1 running at
+// the CPU clock, and stack used, by painting the free RAM below the stack
+// and looking for the lowest byte that was overwritten.  Interrupts stay on,
+// so the Wire and timer interrupts are counted in, as they would be in a
+// real sketch.
+//
+// Runs on a board with a gauge attached, or under simavr without one, in
+// which case the calls that go to the bus time the no answer path.  Prints
+// one "bench" line per call and "bench done" at the end, then sleeps with
+// interrupts off so simavr exits.  extras/bench_avr.sh builds it, runs it
+// and adds the flash each call costs.
+//
+// BENCH_ONLY builds just one of the calls, for the flash figures.
+#include <Wire.h>
+#include <DS2764.h>
+#include <avr/sleep.h>
+
+#ifndef BENCH_ONLY
+#define BENCH_ONLY	0	// 0 runs them all, an id runs just that one
+#endif
+
+#define STACK_PAINT	0xA5
+
+DS2764 gauge;
+
+volatile unsigned int guiOverflows = 0;
+
+ISR(TIMER1_OVF_vect) {
+    guiOverflows++;
+}
+
+// Timer1 as a 32 bit cycle counter, the overflow count on top.
+unsigned long cycles(void) {
+    unsigned int    uiLow;
+    unsigned int    uiHigh;
+    byte    bSreg   = SREG;
+
+    cli();
+    uiLow  = TCNT1;
+    uiHigh = guiOverflows;
+    if ((TIFR1 & _BV(TOV1)) && uiLow < 0x8000) {
+        uiHigh++;	// overflowed before TCNT1 was read, ISR still pending
+    }
+    SREG = bSreg;
+    return ((unsigned long) uiHigh << 16) | uiLow;
+}
+
+extern char __heap_start;
+extern char *__brkval;
+
+byte    *gpPaintLow;
+
+// Fills the free RAM between the heap and the stack.
+void paintStack(void) {
+    byte    *pTop = (byte *) SP - 8;	// below this call's own frame
+
+    gpPaintLow = (byte *) (__brkval ? __brkval : &__heap_start) + 16;
+    for (byte *p = gpPaintLow; p < pTop; p++) {
+        *p = STACK_PAINT;
+    }
+}
+
+// Bytes of stack used below auiTop, the caller's stack pointer, since
+// paintStack.
+unsigned int stackUsed(unsigned int auiTop) {
+    byte    *p = gpPaintLow;
+
+    while (*p == STACK_PAINT) {
+        p++;
+    }
+    return auiTop - (unsigned int) (uintptr_t) p;
+}
+
+unsigned long gulOverhead = 0;
+volatile long gulSink;
+
+void report(const char *apName, unsigned long aulCycles, unsigned int auiStack) {
+    Serial.print(F("bench "));
+    Serial.print(apName);
+    Serial.print(' ');
+    Serial.print(aulCycles > gulOverhead ? aulCycles - gulOverhead : 0);
+    Serial.print(' ');
+    Serial.println(auiStack);
+    Serial.flush();
+}
+
+// Runs one call with the stack painted and reports it.  The result goes to a
+// volatile so the call can't be optimized away.
+#define BENCH(id, name, call)						\
+    if (BENCH_ONLY == 0 || BENCH_ONLY == (id)) {			\
+        unsigned long ulStart;						\
+        unsigned long ulEnd;						\
+        unsigned int uiTop = SP;					\
+        paintStack();							\
+        ulStart = cycles();						\
+        gulSink = (long) (call);					\
+        ulEnd = cycles();						\
+        report(name, ulEnd - ulStart, stackUsed(uiTop));		\
+    }
+
+void setup() {
+    unsigned long ulStart;
+
+    Serial.begin(115200);
+    Wire.begin();
+#if defined(WIRE_HAS_TIMEOUT)
+    Wire.setWireTimeout(2000, true);	// no gauge under simavr
+#endif
+
+    TCCR1A = 0;
+    TCCR1B = _BV(CS10);		// CPU clock, no prescaler
+    TIMSK1 = _BV(TOIE1);
+
+    // cost of the measurement itself
+    ulStart = cycles();
+    gulSink = 0;
+    gulOverhead = cycles() - ulStart;
+
+    Serial.print(F("bench cpu "));
+    Serial.println(F_CPU);
+
+    BENCH(1, "dsInit", (gauge.dsInit(), 0));
+#if DS_USE_FILTER
+    // every stage on, so dsRefresh on a board with a gauge counts the
+    // filters at their worst
+    gauge.dsSetFilter(DS_FILTER_VOLTAGE, DS_FILTER_MEDIAN5 | DS_FILTER_CLAMP | DS_FILTER_IIR, 20, 4);
+    gauge.dsSetFilter(DS_FILTER_CURRENT, DS_FILTER_MEDIAN5 | DS_FILTER_CLAMP | DS_FILTER_IIR, 80, 4);
+#endif
+    BENCH(2, "dsRefresh", (gauge.dsRefresh(), 0));
+    BENCH(3, "dsGetBatteryVoltage", gauge.dsGetBatteryVoltage());
+    BENCH(4, "dsGetCurrentRaw", gauge.dsGetCurrentRaw());
+    BENCH(5, "dsGetAccumulatedCurrent", gauge.dsGetAccumulatedCurrent());
+    BENCH(6, "dsGetAccumulatedCurrentExt", gauge.dsGetAccumulatedCurrentExt());
+    BENCH(7, "dsGetTempRaw", gauge.dsGetTempRaw());
+#if DS_USE_FLOAT
+    BENCH(8, "dsGetCurrent", gauge.dsGetCurrent());
+    BENCH(9, "dsGetTempC", gauge.dsGetTempC());
+    BENCH(10, "dsGetTempF", gauge.dsGetTempF());
+#endif
+#if DS_USE_CAPACITY_EEPROM
+    BENCH(11, "dsGetBatteryCapacity", gauge.dsGetBatteryCapacity());
+#if DS_USE_FLOAT
+    BENCH(12, "dsGetBatteryCapacityPercent", gauge.dsGetBatteryCapacityPercent());
+#endif
+#endif
+#if DS_USE_PROTECTION_POLL
+    BENCH(13, "dsPollProtection", gauge.dsPollProtection());
+#endif
+    BENCH(14, "dsResetProtection", (gauge.dsResetProtection(DS_RESET_ENABLE), 0));
+#if DS_USE_OCV_SOC
+    BENCH(15, "dsGetStateOfCharge", gauge.dsGetStateOfCharge());
+#endif
+#if DS_USE_RUNTIME
+    BENCH(16, "dsGetTimeToEmpty", gauge.dsGetTimeToEmpty());
+#endif
+
+    Serial.println(F("bench done"));
+    Serial.flush();
+
+    // simavr quits when the CPU sleeps with interrupts off
+    cli();
+    set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+    sleep_enable();
+    sleep_cpu();
+}
+
+void loop() {
+}
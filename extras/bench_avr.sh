@@ -0,0 +1,76 @@
+#!/bin/sh
+# bench_avr.sh
+# Builds examples/DS2764Bench for an AVR board and prints one row per public
+# call: CPU cycles, stack bytes and the flash the call adds to a sketch that
+# makes no calls.  Cycles and stack come from running the sketch under
+# simavr, or from a serial log of a real board given with -l.  Needs
+# arduino-cli with the arduino:avr core; simavr is only needed without -l.
+#
+# Usage: extras/bench_avr.sh [-l serial_log.txt] [fqbn] [mcu]
+#        default fqbn is arduino:avr:uno, mcu atmega328p
+#
+# Extra DS_USE_xxx flags go in DS_FLAGS, e.g.
+#     DS_FLAGS="-DDS_USE_FLOAT=0" extras/bench_avr.sh
+# The first line of the table says which commit it was built from, so
+# tables from two commits can be diffed.
+
+LOG=
+if [ "$1" = "-l" ]; then
+    LOG=$2
+    shift 2
+fi
+FQBN=${1:-arduino:avr:uno}
+MCU=${2:-atmega328p}
+LIBDIR=$(cd "$(dirname "$0")/.." && pwd)
+SKETCH=$LIBDIR/examples/DS2764Bench
+OUT=${TMPDIR:-/tmp}/ds2764_bench
+
+AVR_SIZE=$(command -v avr-size || find "$HOME/.arduino15" -name avr-size -type f 2>/dev/null | head -n 1)
+if [ -z "$AVR_SIZE" ]; then
+    echo "avr-size not found, install the arduino:avr core" >&2
+    exit 1
+fi
+
+# build with BENCH_ONLY=$1 and print text + data
+flash() {
+    rm -rf "$OUT"
+    arduino-cli compile -b "$FQBN" --library "$LIBDIR" --output-dir "$OUT" \
+        --build-property "build.extra_flags=$DS_FLAGS -DBENCH_ONLY=$1" "$SKETCH" >/dev/null || exit 1
+    "$AVR_SIZE" "$OUT/DS2764Bench.ino.elf" | awk 'NR == 2 { print $1 + $2 }'
+}
+
+# flash for each call, against a build that makes none of them (id 255)
+BASE=$(flash 255)
+SIZES=$(grep -o 'BENCH([0-9]*, "[A-Za-z]*"' "$SKETCH/DS2764Bench.ino" | tr '(,"' '   ' |
+    while read -r _ ID NAME; do
+        echo "$NAME $(( $(flash "$ID") - BASE ))"
+    done)
+
+# the full build, run it for cycles and stack
+flash 0 >/dev/null
+if [ -z "$LOG" ]; then
+    if ! command -v simavr >/dev/null; then
+        echo "simavr not found, install it or pass a serial log with -l" >&2
+        exit 1
+    fi
+    LOG=$OUT/bench.log
+    F_CPU=$(arduino-cli board details -b "$FQBN" 2>/dev/null | awk '/build.f_cpu/ { sub(/L$/, "", $2); print $2 }')
+    timeout 60 simavr -m "$MCU" -f "${F_CPU:-16000000}" "$OUT/DS2764Bench.ino.elf" > "$LOG" 2>&1
+fi
+
+echo "# DS2764 bench $(git -C "$LIBDIR" describe --always --dirty 2>/dev/null) $FQBN $DS_FLAGS"
+printf "%-30s %10s %6s %6s\n" "Call" "Cycles" "Stack" "Flash"
+# simavr may prefix the UART output, so only look from "bench " on
+grep -o 'bench .*' "$LOG" | tr -d '\r' | awk -v sizes="$SIZES" '
+BEGIN {
+    n = split(sizes, line, "\n")
+    for (i = 1; i <= n; i++) {
+        split(line[i], f, " ")
+        flash[f[1]] = f[2]
+    }
+}
+$2 == "cpu" { printf "%-30s %10s\n", "(cpu clock)", $3; next }
+$2 == "done" { done = 1; next }
+NF == 4 { printf "%-30s %10d %6d %6s\n", $2, $3, $4, ($2 in flash) ? flash[$2] : "-" }
+END { if (!done) print "bench did not finish" > "/dev/stderr" }
+'
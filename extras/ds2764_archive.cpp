@@ -0,0 +1,773 @@
+// ds2764_archive.cpp
+// Reads the archive blocks written by dsSetArchive (DS_USE_ARCHIVE) on the
+// PC or gateway the gauge logs to.  The file is mmap'ed and walked block by
+// block through the headers, so a time range or limit query only decodes
+// the blocks it has to.  With an index (below) it doesn't even look at the
+// headers of most of the others.  Blocks from
+// several gauges can be in one file, and anything that isn't a block (a
+// serial line that also carried text, a cut off block) is skipped until
+// the next good one.
+//
+// Times are the writer's ms clock, unwrapped per gauge address: a wrap or a
+// reboot moves the rest of that gauge's history on by 2^32 so it stays in
+// order.
+//
+// Build: c++ -O2 -o ds2764_archive extras/ds2764_archive.cpp
+//
+// Usage: ds2764_archive info FILE
+//        ds2764_archive index FILE                     writes FILE.idx
+//        ds2764_archive dump FILE [FROM TO]            CSV, times in ms
+//        ds2764_archive query FILE FROM TO [ADDRESS]   count, min/max/mean
+//        ds2764_archive outside FILE CHANNEL LOW HIGH  samples out of limits
+//        ds2764_archive synth FILE SAMPLES [GAUGES]    synthetic archive
+//
+// synth writes a test archive the way the library does, a refresh every
+// second with slowly moving readings and some noise, and prints the ingest
+// rate.  query and outside print how long they took, so the two give the
+// figures for a file of any size.
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ARCHIVE_VERSION		1	// DS_ARCHIVE_VERSION
+#define HEADER_LEN		27	// DS_ARCHIVE_HEADER_LEN
+#define CHANNELS		3	// DS_ARCHIVE_CHANNELS
+#define BLOCK			16	// DS_ARCHIVE_BLOCK
+#define MAX_SAMPLES		255
+
+static const char *gasChannel[CHANNELS] = { "mV", "mA", "temp" };
+
+struct Block {
+    uint8_t     address;
+    uint8_t     count;
+    uint64_t    first;		// unwrapped
+    uint64_t    last;
+    int16_t     min[CHANNELS];
+    int16_t     max[CHANNELS];
+    const uint8_t *pColumns;
+    uint16_t    len;
+};
+
+struct Walk {
+    const uint8_t *p;
+    const uint8_t *pEnd;
+    uint64_t    aulBase[256];	// unwrap offset per address
+    uint32_t    aulLast[256];
+    bool        abSeen[256];
+    uint64_t    ulSkipped;	// bytes that weren't a block
+};
+
+static uint32_t le(const uint8_t *p, int n) {
+    uint32_t    ul = 0;
+
+    while (n--) {
+        ul = (ul << 8) | p[n];
+    }
+    return ul;
+}
+
+static bool checkOk(const uint8_t *p, uint16_t auiLen) {
+    uint8_t     bCheck = 0;
+
+    for (int i = 0; i < auiLen; i++) {
+        bCheck += p[HEADER_LEN + i];
+    }
+    return bCheck == p[HEADER_LEN + auiLen];
+}
+
+// Next good block, false at the end of the file.  A block followed by the
+// start of another, or the end of the file, is taken on its header; the
+// check byte is only summed when that doesn't line up, and by decode.
+static bool nextBlock(Walk &w, Block &b) {
+    while (w.pEnd - w.p >= HEADER_LEN + 1) {
+        const uint8_t *p = w.p;
+        uint16_t    uiLen = le(p + 5, 2);
+        const uint8_t *pNext = p + HEADER_LEN + uiLen + 1;
+
+        if (p[0] != 'D' || p[1] != 'S' || p[2] != ARCHIVE_VERSION || p[4] == 0
+                || w.pEnd - p < HEADER_LEN + uiLen + 1
+                || (!(pNext == w.pEnd || (w.pEnd - pNext >= 2 && pNext[0] == 'D' && pNext[1] == 'S'))
+                    && !checkOk(p, uiLen))) {
+            w.p++;
+            w.ulSkipped++;
+            continue;
+        }
+
+        uint32_t    ulFirst = le(p + 7, 4);
+        uint32_t    ulLast  = le(p + 11, 4);
+
+        b.address = p[3];
+        b.count   = p[4];
+        if (w.abSeen[b.address] && ulFirst < w.aulLast[b.address]) {
+            w.aulBase[b.address] += 1ULL << 32;
+        }
+        w.abSeen[b.address] = true;
+        w.aulLast[b.address] = ulLast;
+        b.first = w.aulBase[b.address] + ulFirst;
+        b.last  = b.first + (uint32_t) (ulLast - ulFirst);
+        for (int c = 0; c < CHANNELS; c++) {
+            b.min[c] = le(p + 15 + 4 * c, 2);
+            b.max[c] = le(p + 17 + 4 * c, 2);
+        }
+        b.pColumns = p + HEADER_LEN;
+        b.len      = uiLen;
+        w.p        = pNext;
+        return true;
+    }
+    w.ulSkipped += w.pEnd - w.p;
+    w.p = w.pEnd;
+    return false;
+}
+
+static int64_t varint(const uint8_t *&p) {
+    uint32_t    ulZig = 0;
+    int         iShift = 0;
+
+    do {
+        ulZig |= (uint32_t) (*p & 0x7F) << iShift;
+        iShift += 7;
+    } while (*p++ & 0x80);
+    return (int32_t) (ulZig >> 1) ^ -(int32_t) (ulZig & 1);
+}
+
+// Samples of one block, times unwrapped like the block's.  False if the
+// check byte is wrong.
+static bool decode(const Block &b, uint64_t *pTime, int aaiValue[CHANNELS][MAX_SAMPLES]) {
+    const uint8_t *p = b.pColumns;
+    int64_t     lDelta = 0;
+    int64_t     lTime  = b.first;
+
+    if (!checkOk(p - HEADER_LEN, b.len)) {
+        return false;
+    }
+    for (int i = 0; i < b.count; i++) {
+        lDelta += varint(p);
+        lTime  += lDelta;
+        pTime[i] = lTime;
+    }
+    for (int c = 0; c < CHANNELS; c++) {
+        int64_t lValue = 0;
+
+        for (int i = 0; i < b.count; i++) {
+            lValue += varint(p);
+            aaiValue[c][i] = lValue;
+        }
+    }
+    return true;
+}
+
+static double seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool openWalk(const char *apPath, Walk &w) {
+    struct stat st;
+    int         fd = open(apPath, O_RDONLY);
+
+    memset(&w, 0, sizeof(w));
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(apPath);
+        return false;
+    }
+    if (st.st_size) {
+        w.p = (const uint8_t *) mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (w.p == MAP_FAILED) {
+            perror(apPath);
+            return false;
+        }
+    }
+    w.pEnd = w.p + st.st_size;
+    close(fd);
+    return true;
+}
+
+static int info(const char *apPath) {
+    Walk        w;
+    Block       b;
+    uint64_t    ulBlocks = 0;
+    uint64_t    ulSamples = 0;
+    uint64_t    aulSamples[256] = { 0 };
+    const uint8_t *pStart;
+
+    if (!openWalk(apPath, w)) {
+        return 1;
+    }
+    pStart = w.p;
+    while (nextBlock(w, b)) {
+        ulBlocks++;
+        ulSamples += b.count;
+        aulSamples[b.address] += b.count;
+    }
+    printf("%llu bytes, %llu blocks, %llu samples, %.2f bytes a sample, %llu bytes skipped\n",
+           (unsigned long long) (w.pEnd - pStart), (unsigned long long) ulBlocks,
+           (unsigned long long) ulSamples,
+           ulSamples ? (double) (w.pEnd - pStart) / ulSamples : 0.0,
+           (unsigned long long) w.ulSkipped);
+    for (int a = 0; a < 256; a++) {
+        if (w.abSeen[a]) {
+            printf("gauge 0x%02X: %llu samples, last at %llu ms\n", a,
+                   (unsigned long long) aulSamples[a],
+                   (unsigned long long) (w.aulBase[a] + w.aulLast[a]));
+        }
+    }
+    return 0;
+}
+
+// What a query wants: a time range, a gauge (-1 for all) and, for outside,
+// a channel (-1 for none) and the limits it's looking past.
+struct Filter {
+    uint64_t    from;
+    uint64_t    to;
+    int         address;
+    int         channel;
+    int         low;
+    int         high;
+};
+
+static bool wanted(const Filter &f, uint64_t aulFirst, uint64_t aulLast,
+                   const int16_t *apMin, const int16_t *apMax) {
+    if (aulLast < f.from || aulFirst > f.to) {
+        return false;
+    }
+    return f.channel < 0 || apMin[f.channel] < f.low || apMax[f.channel] > f.high;
+}
+
+// Sidecar index, FILE.idx, written by "index".  One entry per INDEX_BLOCKS
+// blocks with their offset, time range, min/max and the unwrap state of
+// each gauge where the entry starts, so a query reads the entries and only
+// the parts of the archive they point at.  The archive can go on growing;
+// what comes after the indexed part is walked block by block.
+#define INDEX_BLOCKS		1024
+#define INDEX_VERSION		1
+
+struct GaugeState {
+    uint64_t    base;
+    uint32_t    last;
+    uint8_t     address;
+    uint8_t     seen;
+};
+
+struct IndexHeader {
+    char        magic[4];	// "DSIX"
+    uint32_t    version;
+    uint64_t    indexedTo;	// archive bytes covered by the entries
+    uint32_t    entries;
+    uint32_t    gauges;		// GaugeStates after the header and each entry
+};
+
+struct IndexEntry {
+    uint64_t    offset;
+    uint64_t    end;
+    uint64_t    first;
+    uint64_t    last;
+    int16_t     min[CHANNELS];
+    int16_t     max[CHANNELS];
+};
+
+static void saveState(const Walk &w, const uint8_t *apAddress, uint32_t auiGauges, GaugeState *pState) {
+    for (uint32_t g = 0; g < auiGauges; g++) {
+        pState[g].address = apAddress[g];
+        pState[g].base    = w.aulBase[apAddress[g]];
+        pState[g].last    = w.aulLast[apAddress[g]];
+        pState[g].seen    = w.abSeen[apAddress[g]];
+    }
+}
+
+static void loadState(Walk &w, const GaugeState *apState, uint32_t auiGauges) {
+    for (uint32_t g = 0; g < auiGauges; g++) {
+        w.aulBase[apState[g].address] = apState[g].base;
+        w.aulLast[apState[g].address] = apState[g].last;
+        w.abSeen[apState[g].address]  = apState[g].seen;
+    }
+}
+
+static int buildIndex(const char *apPath) {
+    Walk        w;
+    Block       b;
+    const uint8_t *pStart;
+    const uint8_t *pEntry;
+    uint8_t     abAddress[256];
+    GaugeState  asState[256];
+    uint32_t    uiGauges = 0;
+    uint32_t    uiCount;
+    uint64_t    ulBlocks = 0;
+    IndexHeader h = { { 'D', 'S', 'I', 'X' }, INDEX_VERSION, 0, 0, 0 };
+    IndexEntry  e;
+    char        sIdx[4096];
+    FILE        *pOut;
+    double      dStart = seconds();
+
+    // find the gauges first, every entry has a state for each of them
+    if (!openWalk(apPath, w)) {
+        return 1;
+    }
+    pStart = w.p;
+    while (nextBlock(w, b)) {
+    }
+    for (int a = 0; a < 256; a++) {
+        if (w.abSeen[a]) {
+            abAddress[uiGauges++] = a;
+        }
+    }
+    memset(w.aulBase, 0, sizeof(w.aulBase));
+    memset(w.aulLast, 0, sizeof(w.aulLast));
+    memset(w.abSeen, 0, sizeof(w.abSeen));
+    w.p = pStart;
+    h.gauges = uiGauges;
+
+    snprintf(sIdx, sizeof(sIdx), "%s.idx", apPath);
+    pOut = fopen(sIdx, "wb");
+    if (!pOut) {
+        perror(sIdx);
+        return 1;
+    }
+    fwrite(&h, sizeof(h), 1, pOut);
+    fwrite(asState, sizeof(GaugeState), uiGauges, pOut);	// end state, written last
+
+    for (;;) {
+        pEntry  = w.p;
+        uiCount = 0;
+        saveState(w, abAddress, uiGauges, asState);
+        while (uiCount < INDEX_BLOCKS && nextBlock(w, b)) {
+            if (!uiCount++) {
+                e.offset = b.pColumns - HEADER_LEN - pStart;
+                e.first  = b.first;
+                e.last   = b.last;
+                memcpy(e.min, b.min, sizeof(e.min));
+                memcpy(e.max, b.max, sizeof(e.max));
+                continue;
+            }
+            if (b.first < e.first) {
+                e.first = b.first;
+            }
+            if (b.last > e.last) {
+                e.last = b.last;
+            }
+            for (int c = 0; c < CHANNELS; c++) {
+                if (b.min[c] < e.min[c]) {
+                    e.min[c] = b.min[c];
+                }
+                if (b.max[c] > e.max[c]) {
+                    e.max[c] = b.max[c];
+                }
+            }
+        }
+        if (uiCount < INDEX_BLOCKS) {
+            break;		// the rest is left to be walked
+        }
+        e.end = w.p - pStart;
+        fwrite(&e, sizeof(e), 1, pOut);
+        fwrite(asState, sizeof(GaugeState), uiGauges, pOut);
+        h.entries++;
+        ulBlocks += uiCount;
+    }
+
+    h.indexedTo = pEntry - pStart;
+    fseek(pOut, 0, SEEK_SET);
+    fwrite(&h, sizeof(h), 1, pOut);
+    fwrite(asState, sizeof(GaugeState), uiGauges, pOut);
+    fclose(pOut);
+    printf("%u entries, %llu blocks, %llu bytes indexed, %.0f ms\n", h.entries,
+           (unsigned long long) ulBlocks, (unsigned long long) h.indexedTo,
+           (seconds() - dStart) * 1000);
+    return 0;
+}
+
+// Calls apVisit for every block the filter wants, through FILE.idx when
+// there is one.  Counts the block headers looked at and the blocks passed on.
+static bool scan(const char *apPath, const Filter &f, void (*apVisit)(const Block&, void*),
+                 void *apContext, uint64_t &aulSeen, uint64_t &aulWanted) {
+    Walk        w;
+    Block       b;
+    const uint8_t *pStart;
+    const uint8_t *pEnd;
+    IndexHeader h;
+    IndexEntry  e;
+    GaugeState  asState[256];
+    char        sIdx[4096];
+    FILE        *pIdx;
+
+    if (!openWalk(apPath, w)) {
+        return false;
+    }
+    pStart = w.p;
+    pEnd   = w.pEnd;
+    aulSeen = aulWanted = 0;
+
+    snprintf(sIdx, sizeof(sIdx), "%s.idx", apPath);
+    pIdx = fopen(sIdx, "rb");
+    if (pIdx && (fread(&h, sizeof(h), 1, pIdx) != 1 || memcmp(h.magic, "DSIX", 4)
+                 || h.version != INDEX_VERSION || h.indexedTo > (uint64_t) (pEnd - pStart)
+                 || h.gauges > 256)) {
+        fprintf(stderr, "%s doesn't go with %s, not used\n", sIdx, apPath);
+        fclose(pIdx);
+        pIdx = 0;
+    }
+    if (pIdx) {
+        GaugeState asEnd[256];
+
+        if (fread(asEnd, sizeof(GaugeState), h.gauges, pIdx) != h.gauges) {
+            h.entries = 0;
+        }
+        for (uint32_t i = 0; i < h.entries; i++) {
+            if (fread(&e, sizeof(e), 1, pIdx) != 1
+                    || fread(asState, sizeof(GaugeState), h.gauges, pIdx) != h.gauges) {
+                break;
+            }
+            if (!wanted(f, e.first, e.last, e.min, e.max)) {
+                continue;
+            }
+            loadState(w, asState, h.gauges);
+            w.p    = pStart + e.offset;
+            w.pEnd = pStart + e.end;
+            while (nextBlock(w, b)) {
+                aulSeen++;
+                if ((f.address < 0 || b.address == f.address) && wanted(f, b.first, b.last, b.min, b.max)) {
+                    aulWanted++;
+                    apVisit(b, apContext);
+                }
+            }
+        }
+        fclose(pIdx);
+        loadState(w, asEnd, h.gauges);
+        w.p    = pStart + h.indexedTo;
+        w.pEnd = pEnd;
+    }
+
+    while (nextBlock(w, b)) {
+        aulSeen++;
+        if ((f.address < 0 || b.address == f.address) && wanted(f, b.first, b.last, b.min, b.max)) {
+            aulWanted++;
+            apVisit(b, apContext);
+        }
+    }
+    return true;
+}
+
+static void dumpBlock(const Block &b, void *apContext) {
+    const Filter *pFilter = (const Filter *) apContext;
+    uint64_t    aulTime[MAX_SAMPLES];
+    int         aaiValue[CHANNELS][MAX_SAMPLES];
+
+    if (!decode(b, aulTime, aaiValue)) {
+        return;
+    }
+    for (int i = 0; i < b.count; i++) {
+        if (aulTime[i] >= pFilter->from && aulTime[i] <= pFilter->to) {
+            printf("0x%02X,%llu,%d,%d,%d\n", b.address, (unsigned long long) aulTime[i],
+                   aaiValue[0][i], aaiValue[1][i], aaiValue[2][i]);
+        }
+    }
+}
+
+static int dump(const char *apPath, uint64_t aulFrom, uint64_t aulTo) {
+    Filter      f = { aulFrom, aulTo, -1, -1, 0, 0 };
+    uint64_t    ulSeen;
+    uint64_t    ulWanted;
+
+    printf("address,ms,mV,mA,temp\n");
+    return scan(apPath, f, dumpBlock, &f, ulSeen, ulWanted) ? 0 : 1;
+}
+
+struct Totals {
+    Filter      f;
+    uint64_t    count;
+    int64_t     sum[CHANNELS];
+    int         min[CHANNELS];
+    int         max[CHANNELS];
+};
+
+static void queryBlock(const Block &b, void *apContext) {
+    Totals      *pTotals = (Totals *) apContext;
+    uint64_t    aulTime[MAX_SAMPLES];
+    int         aaiValue[CHANNELS][MAX_SAMPLES];
+
+    if (!decode(b, aulTime, aaiValue)) {
+        return;
+    }
+    for (int i = 0; i < b.count; i++) {
+        if (aulTime[i] < pTotals->f.from || aulTime[i] > pTotals->f.to) {
+            continue;
+        }
+        pTotals->count++;
+        for (int c = 0; c < CHANNELS; c++) {
+            pTotals->sum[c] += aaiValue[c][i];
+            if (aaiValue[c][i] < pTotals->min[c]) {
+                pTotals->min[c] = aaiValue[c][i];
+            }
+            if (aaiValue[c][i] > pTotals->max[c]) {
+                pTotals->max[c] = aaiValue[c][i];
+            }
+        }
+    }
+}
+
+// Count, min, max and mean over a time range.
+static int query(const char *apPath, uint64_t aulFrom, uint64_t aulTo, int aiAddress) {
+    Totals      t;
+    uint64_t    ulSeen;
+    uint64_t    ulWanted;
+    double      dStart = seconds();
+
+    memset(&t, 0, sizeof(t));
+    t.f.from    = aulFrom;
+    t.f.to      = aulTo;
+    t.f.address = aiAddress;
+    t.f.channel = -1;
+    for (int c = 0; c < CHANNELS; c++) {
+        t.min[c] = 32767;
+        t.max[c] = -32768;
+    }
+    if (!scan(apPath, t.f, queryBlock, &t, ulSeen, ulWanted)) {
+        return 1;
+    }
+
+    printf("%llu samples in range\n", (unsigned long long) t.count);
+    for (int c = 0; c < CHANNELS && t.count; c++) {
+        printf("%-5s min %6d  max %6d  mean %9.2f\n", gasChannel[c], t.min[c], t.max[c],
+               (double) t.sum[c] / t.count);
+    }
+    printf("%llu blocks decoded of %llu looked at, %.3f ms\n", (unsigned long long) ulWanted,
+           (unsigned long long) ulSeen, (seconds() - dStart) * 1000);
+    return 0;
+}
+
+static void outsideBlock(const Block &b, void *apContext) {
+    Totals      *pTotals = (Totals *) apContext;
+    const Filter &f = pTotals->f;
+    uint64_t    aulTime[MAX_SAMPLES];
+    int         aaiValue[CHANNELS][MAX_SAMPLES];
+
+    if (!decode(b, aulTime, aaiValue)) {
+        return;
+    }
+    for (int i = 0; i < b.count; i++) {
+        if (aaiValue[f.channel][i] < f.low || aaiValue[f.channel][i] > f.high) {
+            pTotals->count++;
+            printf("0x%02X,%llu,%d\n", b.address, (unsigned long long) aulTime[i],
+                   aaiValue[f.channel][i]);
+        }
+    }
+}
+
+// Samples of one channel outside LOW - HIGH, e.g. every undervoltage.  Only
+// blocks whose min/max goes past a limit are decoded.
+static int outside(const char *apPath, int aiChannel, int aiLow, int aiHigh) {
+    Totals      t;
+    uint64_t    ulSeen;
+    uint64_t    ulWanted;
+    double      dStart = seconds();
+
+    memset(&t, 0, sizeof(t));
+    t.f.to      = UINT64_MAX;
+    t.f.address = -1;
+    t.f.channel = aiChannel;
+    t.f.low     = aiLow;
+    t.f.high    = aiHigh;
+    printf("address,ms,%s\n", gasChannel[aiChannel]);
+    if (!scan(apPath, t.f, outsideBlock, &t, ulSeen, ulWanted)) {
+        return 1;
+    }
+    fprintf(stderr, "%llu samples, %llu blocks decoded of %llu looked at, %.3f ms\n",
+            (unsigned long long) t.count, (unsigned long long) ulWanted,
+            (unsigned long long) ulSeen, (seconds() - dStart) * 1000);
+    return 0;
+}
+
+// The encoder of dsFlushArchive, for test files.
+struct Writer {
+    FILE        *pOut;
+    uint8_t     address;
+    uint8_t     count;
+    uint32_t    ulStart;
+    uint16_t    auiTime[BLOCK];
+    int16_t     aaiValue[CHANNELS][BLOCK];
+    uint8_t     abBuf[HEADER_LEN + BLOCK * 20 + 1];
+};
+
+static int putVarint(uint8_t *p, int32_t alValue) {
+    uint32_t    ulZig = ((uint32_t) alValue << 1) ^ (alValue < 0 ? ~0U : 0);
+    int         iLen = 0;
+
+    do {
+        p[iLen++] = (ulZig & 0x7F) | (ulZig > 0x7F ? 0x80 : 0);
+        ulZig >>= 7;
+    } while (ulZig);
+    return iLen;
+}
+
+static void putLe(uint8_t *p, uint32_t aulValue, int n) {
+    while (n--) {
+        *p++ = aulValue;
+        aulValue >>= 8;
+    }
+}
+
+static void flush(Writer &wr) {
+    uint8_t     *p = wr.abBuf + HEADER_LEN;
+    int32_t     lDelta = 0;
+    uint8_t     bCheck = 0;
+
+    if (!wr.count) {
+        return;
+    }
+    for (int i = 0; i < wr.count; i++) {
+        int32_t lNext = wr.auiTime[i] - (i ? wr.auiTime[i - 1] : 0);
+
+        p += putVarint(p, lNext - lDelta);
+        lDelta = lNext;
+    }
+    for (int c = 0; c < CHANNELS; c++) {
+        int32_t lPrev = 0;
+
+        for (int i = 0; i < wr.count; i++) {
+            p += putVarint(p, wr.aaiValue[c][i] - lPrev);
+            lPrev = wr.aaiValue[c][i];
+        }
+    }
+
+    uint16_t    uiLen = p - wr.abBuf - HEADER_LEN;
+
+    wr.abBuf[0] = 'D';
+    wr.abBuf[1] = 'S';
+    wr.abBuf[2] = ARCHIVE_VERSION;
+    wr.abBuf[3] = wr.address;
+    wr.abBuf[4] = wr.count;
+    putLe(wr.abBuf + 5, uiLen, 2);
+    putLe(wr.abBuf + 7, wr.ulStart, 4);
+    putLe(wr.abBuf + 11, wr.ulStart + wr.auiTime[wr.count - 1], 4);
+    for (int c = 0; c < CHANNELS; c++) {
+        int16_t iMin = wr.aaiValue[c][0];
+        int16_t iMax = iMin;
+
+        for (int i = 1; i < wr.count; i++) {
+            if (wr.aaiValue[c][i] < iMin) {
+                iMin = wr.aaiValue[c][i];
+            }
+            if (wr.aaiValue[c][i] > iMax) {
+                iMax = wr.aaiValue[c][i];
+            }
+        }
+        putLe(wr.abBuf + 15 + 4 * c, (uint16_t) iMin, 2);
+        putLe(wr.abBuf + 17 + 4 * c, (uint16_t) iMax, 2);
+    }
+    for (int i = 0; i < uiLen; i++) {
+        bCheck += wr.abBuf[HEADER_LEN + i];
+    }
+    *p++ = bCheck;
+    fwrite(wr.abBuf, 1, p - wr.abBuf, wr.pOut);
+    wr.count = 0;
+}
+
+static void add(Writer &wr, uint32_t aulNow, int aiMv, int aiMa, int aiTemp) {
+    if (wr.count && aulNow - wr.ulStart > 0xFFFF) {
+        flush(wr);
+    }
+    if (!wr.count) {
+        wr.ulStart = aulNow;
+    }
+    wr.auiTime[wr.count]     = aulNow - wr.ulStart;
+    wr.aaiValue[0][wr.count] = aiMv;
+    wr.aaiValue[1][wr.count] = aiMa;
+    wr.aaiValue[2][wr.count] = aiTemp;
+    if (++wr.count == BLOCK) {
+        flush(wr);
+    }
+}
+
+static int synth(const char *apPath, uint64_t aulSamples, int aiGauges) {
+    static Writer awr[8];
+    FILE        *pOut = fopen(apPath, "wb");
+    uint32_t    ulSeed = 1;
+    uint32_t    ulNow = 0;
+    double      dStart = seconds();
+    long        lSize;
+
+    if (!pOut) {
+        perror(apPath);
+        return 1;
+    }
+    setvbuf(pOut, 0, _IOFBF, 1 << 20);
+    for (int g = 0; g < aiGauges; g++) {
+        awr[g].pOut    = pOut;
+        awr[g].address = 0x34 + g;
+    }
+    for (uint64_t s = 0; s < aulSamples; s++) {
+        int     g = s % aiGauges;
+        int     iPhase;
+
+        if (g == 0) {
+            ulSeed = ulSeed * 1103515245 + 12345;
+            ulNow += 1000 + ((ulSeed >> 16) & 3);	// a refresh a second, some jitter
+        }
+        ulSeed = ulSeed * 1103515245 + 12345;
+        iPhase = (ulNow / 1000 + g * 1800) % 7200;	// 2 hour charge/discharge cycle
+        add(awr[g], ulNow,
+            3500 + (iPhase < 3600 ? iPhase : 7200 - iPhase) / 6 + ((ulSeed >> 16) & 7),
+            (iPhase < 3600 ? 800 : -1200) + ((ulSeed >> 19) & 15) - 8,
+            200 + ((ulSeed >> 24) & 3));
+    }
+    for (int g = 0; g < aiGauges; g++) {
+        flush(awr[g]);
+    }
+    lSize = ftell(pOut);
+    fclose(pOut);
+
+    double      dSecs = seconds() - dStart;
+
+    printf("%llu samples, %ld bytes, %.2f bytes a sample, %.1f M samples/s, last time %lu ms\n",
+           (unsigned long long) aulSamples, lSize, (double) lSize / aulSamples,
+           aulSamples / dSecs / 1e6, (unsigned long) ulNow);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 3 && !strcmp(argv[1], "info")) {
+        return info(argv[2]);
+    }
+    if (argc >= 3 && !strcmp(argv[1], "index")) {
+        return buildIndex(argv[2]);
+    }
+    if (argc >= 3 && !strcmp(argv[1], "dump")) {
+        return dump(argv[2], argc >= 5 ? strtoull(argv[3], 0, 0) : 0,
+                    argc >= 5 ? strtoull(argv[4], 0, 0) : UINT64_MAX);
+    }
+    if (argc >= 5 && !strcmp(argv[1], "query")) {
+        return query(argv[2], strtoull(argv[3], 0, 0), strtoull(argv[4], 0, 0),
+                     argc >= 6 ? (int) strtol(argv[5], 0, 0) : -1);
+    }
+    if (argc >= 6 && !strcmp(argv[1], "outside")) {
+        for (int c = 0; c < CHANNELS; c++) {
+            if (!strcmp(argv[3], gasChannel[c])) {
+                return outside(argv[2], c, atoi(argv[4]), atoi(argv[5]));
+            }
+        }
+        fprintf(stderr, "CHANNEL is mV, mA or temp\n");
+        return 1;
+    }
+    if (argc >= 4 && !strcmp(argv[1], "synth")) {
+        int iGauges = argc >= 5 ? atoi(argv[4]) : 1;
+
+        if (iGauges < 1 || iGauges > 8) {
+            fprintf(stderr, "GAUGES is 1 - 8\n");
+            return 1;
+        }
+        return synth(argv[2], strtoull(argv[3], 0, 0), iGauges);
+    }
+    fprintf(stderr, "usage: ds2764_archive info FILE\n"
+                    "       ds2764_archive index FILE\n"
+                    "       ds2764_archive dump FILE [FROM TO]\n"
+                    "       ds2764_archive query FILE FROM TO [ADDRESS]\n"
+                    "       ds2764_archive outside FILE CHANNEL LOW HIGH\n"
+                    "       ds2764_archive synth FILE SAMPLES [GAUGES]\n");
+    return 1;
+}
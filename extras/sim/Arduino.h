@@ -0,0 +1,64 @@
+// Arduino.h
+// Host stand-in for the parts of the Arduino core DS2764.cpp uses, so the
+// library builds with the PC's c++ for the simulations in this directory.
+// Time only moves when the simulated gauge or a test moves it, see
+// ds2764_sim.h.
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HEX 16
+#define DEC 10
+
+#define highByte(w)	((uint8_t)((w) >> 8))
+#define lowByte(w)	((uint8_t)((w) & 0xFF))
+#define constrain(x, lo, hi) ((x) < (lo) ? (lo) : ((x) > (hi) ? (hi) : (x)))
+
+inline unsigned int word(uint8_t h, uint8_t l) { return (h << 8) | l; }
+inline unsigned int word(unsigned int w) { return w; }
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t) = 0;
+
+    size_t write(const char *s) {
+        size_t n = 0;
+        while (*s) {
+            n += write((uint8_t)*s++);
+        }
+        return n;
+    }
+    size_t print(const char *s)             { return write(s); }
+    size_t print(char c)                    { return write((uint8_t)c); }
+    size_t print(long v, int base = DEC)    { return number(v < 0 && base == DEC, v < 0 ? 0UL - (unsigned long)v : (unsigned long)v, base); }
+    size_t print(unsigned long v, int base = DEC) { return number(false, v, base); }
+    size_t print(int v, int base = DEC)     { return print((long)v, base); }
+    size_t print(unsigned int v, int base = DEC) { return print((unsigned long)v, base); }
+    size_t print(unsigned char v, int base = DEC) { return print((unsigned long)v, base); }
+    size_t println(void)                    { return write("\r\n"); }
+    template <typename T> size_t println(T v) { return print(v) + println(); }
+    template <typename T> size_t println(T v, int base) { return print(v, base) + println(); }
+
+private:
+    size_t number(bool bNeg, unsigned long v, int base) {
+        char    ac[40];
+
+        snprintf(ac, sizeof(ac), base == HEX ? "%s%lX" : "%s%lu", bNeg ? "-" : "", v);
+        return write(ac);
+    }
+};
+
+#endif
@@ -0,0 +1,29 @@
+// Wire.h
+// Host stand-in for TwoWire.  Every instance talks to the one simulated
+// gauge in ds2764_sim.cpp, whatever its address, but counts its own
+// transactions so a test can see which bus was used.
+#ifndef WIRE_H
+#define WIRE_H
+
+#include "Arduino.h"
+
+class TwoWire {
+public:
+    unsigned long transactions;	// this bus's share of simTransactions
+
+    TwoWire() : transactions(0) {}
+    void    begin(void);
+    void    setClock(uint32_t ulClock);
+    void    beginTransmission(uint8_t aAddress);
+    uint8_t endTransmission(void);
+    uint8_t endTransmission(uint8_t aStop);
+    size_t  write(uint8_t aData);
+    uint8_t requestFrom(uint8_t aAddress, uint8_t aCount);
+    uint8_t requestFrom(int aAddress, int aCount);
+    int     available(void);
+    int     read(void);
+};
+
+extern TwoWire Wire;
+
+#endif
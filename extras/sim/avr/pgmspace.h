@@ -0,0 +1,12 @@
+// avr/pgmspace.h
+// Host stand-in, PROGMEM data is ordinary memory on the PC.
+#ifndef PGMSPACE_H
+#define PGMSPACE_H
+
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(p)	(*(const uint8_t *)(p))
+#define pgm_read_word(p)	(*(const uint16_t *)(p))
+
+#endif
@@ -0,0 +1,12 @@
+// avr/sleep.h
+// Host stand-in, sleeping does nothing on the PC.
+#ifndef SLEEP_H
+#define SLEEP_H
+
+#define SLEEP_MODE_PWR_DOWN	0
+
+#define set_sleep_mode(m)	((void) (m))
+#define sleep_enable()
+#define sleep_cpu()
+
+#endif
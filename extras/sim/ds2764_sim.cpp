@@ -0,0 +1,204 @@
+// ds2764_sim.cpp
+// The simulated gauge behind the host TwoWire, see ds2764_sim.h.
+#include "ds2764_sim.h"
+#include "Wire.h"
+
+#define SIM_PROTECTION_REG	0x00
+#define SIM_EEPROM_REG		0x07
+#define SIM_EEC			0x80
+#define SIM_FUNCTION_REG	0xFE
+#define SIM_READ_MAX		32
+
+TwoWire Wire;
+
+uint8_t simReg[256];
+uint8_t simEeprom[256];
+unsigned long simMicros;
+unsigned long simTransactions;
+unsigned long simSaves;
+unsigned long simClock = 100000;
+unsigned long simFaultClock;
+int     simFailReads;
+byte    simLocked;
+void    (*simHook)(void);
+
+static uint8_t	sbyPointer;
+static bool	sbFirst;
+static uint8_t	sabRead[SIM_READ_MAX];
+static int	siReadLen;
+static int	siReadPos;
+static unsigned long sulEecUntil;
+static unsigned long sulAddressPhases;
+
+void simReset(void) {
+    memset(simReg, 0, sizeof(simReg));
+    memset(simEeprom, 0, sizeof(simEeprom));
+    simMicros       = 0;
+    simTransactions = 0;
+    simSaves        = 0;
+    simClock        = 100000;
+    simFaultClock   = 0;
+    simFailReads    = 0;
+    simLocked       = 0;
+    simHook         = 0;
+    sulEecUntil     = 0;
+    sulAddressPhases = 0;
+}
+
+void simSetVoltage(int aiMilliVolts) {
+    int     iCounts = (aiMilliVolts * 1000L + 2440) / 4880;
+    unsigned int uiReg = iCounts << 5;
+
+    simReg[0x0C] = uiReg >> 8;
+    simReg[0x0D] = uiReg & 0xFF;
+}
+
+void simSetCurrentRaw(int aiCounts) {
+    unsigned int uiReg = (unsigned int)(aiCounts << 3);
+
+    simReg[0x0E] = (uiReg >> 8) & 0xFF;
+    simReg[0x0F] = uiReg & 0xFF;
+}
+
+void simSetCurrent(int aiMilliAmps) {
+    simSetCurrentRaw((int)(aiMilliAmps * 1000L / 625));
+}
+
+void simSetAccum(unsigned int auiCounts) {
+    simReg[0x10] = (auiCounts >> 8) & 0xFF;
+    simReg[0x11] = auiCounts & 0xFF;
+}
+
+void simSetTemp(int aiEighths) {
+    unsigned int uiReg = (unsigned int)(aiEighths << 5);
+
+    simReg[0x18] = (uiReg >> 8) & 0xFF;
+    simReg[0x19] = uiReg & 0xFF;
+}
+
+unsigned long millis(void) {
+    return simMicros / 1000;
+}
+
+unsigned long micros(void) {
+    return simMicros;
+}
+
+void delay(unsigned long ms) {
+    simMicros += ms * 1000;
+}
+
+// Recall (0xB2/B4/B8) and Copy Data (0x42/44/48) for Blocks 0 - 2.
+static void simFunction(uint8_t abyCommand) {
+    int     iBlock = -1;
+    bool    bSave  = false;
+
+    switch (abyCommand) {
+    case 0xB2: iBlock = 0; break;
+    case 0xB4: iBlock = 1; break;
+    case 0xB8: iBlock = 2; break;
+    case 0x42: iBlock = 0; bSave = true; break;
+    case 0x44: iBlock = 1; bSave = true; break;
+    case 0x48: iBlock = 2; bSave = true; break;
+    }
+    if (iBlock < 0) {
+        return;
+    }
+
+    int     iStart = SIM_BLOCK_0 + iBlock * 16;
+    if (bSave) {
+        simSaves++;
+        simReg[SIM_EEPROM_REG] |= SIM_EEC;
+        sulEecUntil = simMicros + SIM_EEPROM_COPY_US;
+        if (!(simLocked & (1 << iBlock))) {
+            memcpy(&simEeprom[iStart], &simReg[iStart], 16);
+        }
+    }
+    else {
+        memcpy(&simReg[iStart], &simEeprom[iStart], 16);
+    }
+}
+
+void TwoWire::begin(void) {
+}
+
+void TwoWire::setClock(uint32_t ulClock) {
+    simClock = ulClock;
+}
+
+void TwoWire::beginTransmission(uint8_t) {
+    sbFirst = true;
+    simTransactions++;
+    transactions++;
+}
+
+size_t TwoWire::write(uint8_t aData) {
+    if (sbFirst) {
+        sbyPointer = aData;
+        sbFirst    = false;
+    }
+    else if (sbyPointer == SIM_FUNCTION_REG) {
+        simFunction(aData);
+    }
+    else if (sbyPointer == SIM_PROTECTION_REG) {
+        // CE/DE are written, OV/UV are only cleared by writing 0, the rest
+        // are read only.
+        simReg[SIM_PROTECTION_REG] = (simReg[SIM_PROTECTION_REG] & (0x3C | (aData & 0xC0))) | (aData & 0x03);
+        sbyPointer++;
+    }
+    else {
+        simReg[sbyPointer++] = aData;
+    }
+    return 1;
+}
+
+uint8_t TwoWire::endTransmission(void) {
+    simMicros += 100;
+    if (simFaultClock && simClock > simFaultClock && (++sulAddressPhases % 5) == 0) {
+        // NACK, and the read that follows gets nothing either
+        simFailReads = 1;
+        return 2;
+    }
+    return 0;
+}
+
+uint8_t TwoWire::endTransmission(uint8_t) {
+    return endTransmission();
+}
+
+uint8_t TwoWire::requestFrom(uint8_t, uint8_t aCount) {
+    simTransactions++;
+    transactions++;
+    if (simHook) {
+        simHook();
+    }
+    siReadLen = 0;
+    siReadPos = 0;
+    if (simFailReads > 0) {
+        simFailReads--;
+        return 0;
+    }
+    if (simMicros >= sulEecUntil) {
+        simReg[SIM_EEPROM_REG] &= ~SIM_EEC;
+    }
+    if (aCount > SIM_READ_MAX) {
+        aCount = SIM_READ_MAX;
+    }
+    for (int i = 0; i < aCount; i++) {
+        sabRead[siReadLen++] = simReg[sbyPointer++];
+    }
+    simMicros += 100UL * aCount;
+    return aCount;
+}
+
+uint8_t TwoWire::requestFrom(int aAddress, int aCount) {
+    return requestFrom((uint8_t)aAddress, (uint8_t)aCount);
+}
+
+int TwoWire::available(void) {
+    return siReadLen - siReadPos;
+}
+
+int TwoWire::read(void) {
+    return siReadPos < siReadLen ? sabRead[siReadPos++] : -1;
+}
@@ -0,0 +1,39 @@
+// ds2764_sim.h
+// A DS2764 on a simulated I2C bus, for checking the library on the PC.
+// The register file, EEPROM Blocks and Function Commands behave like the
+// chip's; bus time is charged at roughly 100kHz (100us per address phase
+// and per byte read) and delay() just moves the clock, so the times the
+// tests print are what the calls would spend on a real bus.
+//
+// Faults are injected through the variables below: failed reads, NACKs
+// above a bus clock, locked EEPROM blocks and a hook that runs before every
+// read so a test can move the readings the way a converting gauge would.
+#ifndef DS2764_SIM_H
+#define DS2764_SIM_H
+
+#include "Arduino.h"
+
+#define SIM_BLOCK_0		0x20
+#define SIM_BLOCK_1		0x30
+#define SIM_BLOCK_2		0x40
+#define SIM_EEPROM_COPY_US	2000	// EEC stays set this long after a Copy Data
+
+extern uint8_t simReg[256];		// register file, Blocks 0 - 2 are shadow RAM
+extern uint8_t simEeprom[256];		// what Copy Data last saved, same addresses
+extern unsigned long simMicros;		// the clock millis(), micros() and delay() use
+extern unsigned long simTransactions;	// address phases plus reads
+extern unsigned long simSaves;		// Copy Data commands
+extern unsigned long simClock;		// last TwoWire::setClock
+extern unsigned long simFaultClock;	// above this clock every 5th address phase NACKs, 0 never
+extern int	simFailReads;		// this many reads return nothing
+extern byte	simLocked;		// bit n set, Block n ignores Copy Data
+extern void	(*simHook)(void);	// run before each read
+
+void simReset(void);
+void simSetVoltage(int aiMilliVolts);
+void simSetCurrentRaw(int aiCounts);	// .625mA a count with the internal resistor
+void simSetCurrent(int aiMilliAmps);
+void simSetAccum(unsigned int auiCounts);	// .25mAh a count
+void simSetTemp(int aiEighths);		// .125C a count
+
+#endif
@@ -0,0 +1,34 @@
+#!/bin/sh
+# run.sh
+# Builds the library against the simulated gauge in this directory with the
+# PC's c++ and runs the simulations.  Each sim_xxx.cpp names the DS_USE_xxx
+# switches it needs on a "// flags:" line and prints what it measured; one
+# with several flags lines is built and run once for each.
+#
+# Usage: extras/sim/run.sh [sim_xxx ...]        default is all of them
+
+SIM=$(cd "$(dirname "$0")" && pwd)
+LIB=$(cd "$SIM/../.." && pwd)
+OUT=${TMPDIR:-/tmp}/ds2764_sim
+CXX=${CXX:-c++}
+
+mkdir -p "$OUT"
+if [ $# -eq 0 ]; then
+    set -- $(cd "$SIM" && ls sim_*.cpp | sed 's/\.cpp$//')
+fi
+
+STATUS=0
+for NAME in "$@"; do
+    NAME=${NAME%.cpp}
+    sed -n 's|^// flags:||p' "$SIM/$NAME.cpp" > "$OUT/$NAME.flags"
+    while read -r FLAGS; do
+        echo "== $NAME $FLAGS"
+        if $CXX -O1 -DARDUINO=10600 $FLAGS -I"$SIM" -I"$LIB" -o "$OUT/$NAME" \
+                "$SIM/$NAME.cpp" "$SIM/ds2764_sim.cpp" "$LIB/DS2764.cpp"; then
+            "$OUT/$NAME" || STATUS=1
+        else
+            STATUS=1
+        fi
+    done < "$OUT/$NAME.flags"
+done
+exit $STATUS
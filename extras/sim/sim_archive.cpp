@@ -0,0 +1,76 @@
+// sim_archive.cpp
+// A refresh every 100ms with the voltage and temperature both moving each
+// conversion: the temperature column of every archive block has to span
+// the same refreshes as the voltage column, so the min and max in each
+// block header are checked against what was set.
+// flags: -DDS_USE_ARCHIVE=1
+// flags: -DDS_USE_ARCHIVE=1 -DDS_USE_SYNC_SAMPLING=1
+#include <Wire.h>
+#include "DS2764.h"
+#include "ds2764_sim.h"
+
+#define BLOCKS		4
+#define VOLTAGE		3600	// mV, +5 a refresh
+#define TEMP		200	// .125C, +1 a refresh
+
+class Capture : public Print {
+public:
+    byte    mabBuf[BLOCKS * 256];
+    unsigned int muiLen;
+
+    Capture() : muiLen(0) {}
+    size_t write(uint8_t abByte) {
+        if (muiLen < sizeof(mabBuf)) {
+            mabBuf[muiLen++] = abByte;
+        }
+        return 1;
+    }
+};
+
+static int field(const byte *abBlock, byte abAt) {
+    return (int16_t) (abBlock[abAt] | (abBlock[abAt + 1] << 8));
+}
+
+int main() {
+    DS2764  gauge;
+    Capture out;
+    unsigned int uiAt   = 0;
+    int     iFirst      = 0;
+    int     iFailed     = 0;
+
+    simReset();
+    simReg[0x00] = DS00CE | DS00DE;
+    simReg[0x08] = DS00PS;
+    simSetVoltage(VOLTAGE - 5);	// what dsInit reads, so the first refresh is new
+    simSetTemp(TEMP - 1);
+    gauge.dsInit();
+    gauge.dsSetArchive(&out);
+
+    for (int i = 0; i < BLOCKS * DS_ARCHIVE_BLOCK; i++) {
+        simSetVoltage(VOLTAGE + i * 5);
+        simSetTemp(TEMP + i);
+        simMicros += 100000;
+        gauge.dsRefresh();
+    }
+    gauge.dsFlushArchive();
+
+    while (uiAt + DS_ARCHIVE_HEADER_LEN <= out.muiLen) {
+        const byte *abBlock = &out.mabBuf[uiAt];
+        int     iCount  = abBlock[4];
+        int     iMinMv  = field(abBlock, 15);
+        int     iMaxMv  = field(abBlock, 17);
+        int     iMinT   = field(abBlock, 23);
+        int     iMaxT   = field(abBlock, 25);
+        bool    bOk     = iMinT == TEMP + iFirst && iMaxT == TEMP + iFirst + iCount - 1;
+
+        printf("block of %2d: %4d - %4d mV, temperature %3d - %3d  %s\n",
+               iCount, iMinMv, iMaxMv, iMinT, iMaxT, bOk ? "ok" : "FAILED");
+        iFailed += !bOk;
+        iFirst  += iCount;
+        uiAt    += DS_ARCHIVE_HEADER_LEN + field(abBlock, 5) + 1;
+    }
+    iFailed += iFirst != BLOCKS * DS_ARCHIVE_BLOCK;
+
+    printf(iFailed ? "FAILED\n" : "passed\n");
+    return iFailed != 0;
+}
@@ -0,0 +1,109 @@
+// sim_bench.cpp
+// Builds examples/DS2764Bench with the PC's c++ against the simulated gauge
+// and runs it.  Timer1 counts the simulated time at F_CPU, which on the PC
+// is only the bus time, and the painted stack is an array nothing runs on,
+// so the figures are no stand-in for an AVR run.  What's checked is that
+// the sketch builds against the library and prints a bench line for every
+// call it makes, then "bench done", in the form extras/bench_avr.sh reads.
+// flags:
+// flags: -DDS_USE_OCV_SOC=1 -DDS_USE_RUNTIME=1 -DDS_USE_FILTER=1
+#include <stdint.h>
+#include <Wire.h>
+#include "ds2764_sim.h"
+
+// The parts of avr-libc and the Arduino core the sketch uses.
+#define F_CPU		16000000UL
+#define F(s)		(s)
+#define ISR(v)		void v(void)
+#define _BV(b)		(1 << (b))
+#define cli()
+#define CS10		0
+#define TOIE1		0
+#define TOV1		0
+#define TCNT1		simTcnt1()
+#define SP		((uintptr_t) (gabStack + sizeof(gabStack)))
+
+class SimSerial : public Print {
+public:
+    char    macOut[4096];
+    unsigned int muiLen;
+
+    SimSerial() : muiLen(0) {}
+    void    begin(unsigned long) {}
+    void    flush(void) {}
+    size_t  write(uint8_t abByte) {
+        if (muiLen < sizeof(macOut) - 1) {
+            macOut[muiLen++] = abByte;
+            macOut[muiLen] = 0;
+        }
+        return 1;
+    }
+    using Print::write;
+};
+
+static SimSerial Serial;
+static byte     TCCR1A;
+static byte     TCCR1B;
+static byte     TIMSK1;
+static byte     TIFR1;
+static byte     SREG;
+static byte     gabStack[256];
+char            __heap_start;
+char           *__brkval;
+
+void TIMER1_OVF_vect(void);
+
+// Timer1 at F_CPU off the simulated clock, calling the overflow interrupt
+// as it wraps.
+static unsigned int simTcnt1(void) {
+    static unsigned long sulWraps = 0;
+    unsigned long long ullCycles = (unsigned long long) simMicros * (F_CPU / 1000000);
+
+    while (sulWraps < (ullCycles >> 16)) {
+        sulWraps++;
+        TIMER1_OVF_vect();
+    }
+    return (unsigned int) (ullCycles & 0xFFFF);
+}
+
+#include "../../examples/DS2764Bench/DS2764Bench.ino"
+
+int main() {
+    char    acName[40];
+    unsigned long ulCycles;
+    unsigned int uiStack;
+    int     iLines  = 0;
+    int     iFailed = 0;
+    bool    bDone   = false;
+
+    simReset();
+    simReg[0x00] = DS00CE | DS00DE;
+    simReg[0x08] = DS00PS;
+    simSetVoltage(3700);
+    simSetCurrent(-500);
+    __brkval = (char *) gabStack;
+
+    setup();
+    printf("%s", Serial.macOut);
+
+    for (char *pLine = strtok(Serial.macOut, "\r\n"); pLine; pLine = strtok(NULL, "\r\n")) {
+        if (strcmp(pLine, "bench done") == 0) {
+            bDone = true;
+        }
+        else if (strncmp(pLine, "bench cpu ", 10) == 0) {
+            iFailed += strtoul(pLine + 10, NULL, 10) != F_CPU;
+        }
+        else if (bDone || sscanf(pLine, "bench %39s %lu %u", acName, &ulCycles, &uiStack) != 3) {
+            printf("unexpected line: %s\n", pLine);
+            iFailed++;
+        }
+        else {
+            iLines++;
+        }
+    }
+    // dsInit to dsResetProtection at least, with the default switches
+    iFailed += !bDone || iLines < 11;
+
+    printf(iFailed ? "FAILED\n" : "passed\n");
+    return iFailed != 0;
+}
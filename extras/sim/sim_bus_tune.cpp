@@ -0,0 +1,64 @@
+// sim_bus_tune.cpp
+// dsRefresh every 100ms on a bus where every 5th address phase NACKs above
+// 150kHz, starting at 400kHz: where the clock settles, how often the faster
+// clock is retried, and how long it takes to get back to 400kHz once the
+// fault clears.  Then a capacity read that comes back empty, which has to
+// be counted as an error like any other.
+// flags: -DDS_USE_BUS_TUNE=1
+#include <Wire.h>
+#include "DS2764.h"
+#include "ds2764_sim.h"
+
+#define FAULT_REFRESHES	20000
+#define REFRESHES	200000
+
+int main() {
+    DS2764  gauge;
+    unsigned long ulLast    = 0;
+    unsigned long ulCleared = 0;
+    unsigned int uiErrors;
+    int     iChanges        = 0;
+
+    simReset();
+    simReg[0x00] = DS00CE | DS00DE;
+    simReg[0x08] = DS00PS;
+    simSetVoltage(3900);
+    gauge.dsSetBusClock(400000);
+    gauge.dsInit();
+    printf("start at %lu Hz\n", simClock);
+
+    simFaultClock = 150000;
+    for (long i = 0; i < REFRESHES; i++) {
+        if (i == FAULT_REFRESHES) {
+            simFaultClock = 0;
+            ulCleared     = simTransactions;
+            printf("fault cleared after %lu transactions, %u errors, %d clock changes\n",
+                   simTransactions, gauge.dsGetBusErrors(), iChanges);
+        }
+        gauge.dsRefresh();
+        simMicros += 100000;
+        if (gauge.dsGetBusClock() != ulLast) {
+            if (i < 10 || (ulCleared && ulLast < 400000)) {
+                printf("refresh %ld, %lu transactions: %lu Hz, %u errors\n",
+                       i, simTransactions, gauge.dsGetBusClock(), gauge.dsGetBusErrors());
+            }
+            ulLast = gauge.dsGetBusClock();
+            iChanges++;
+        }
+    }
+    printf("end at %lu Hz, %u errors\n", gauge.dsGetBusClock(), gauge.dsGetBusErrors());
+    if (gauge.dsGetBusClock() != 400000) {
+        printf("FAILED, not back at 400kHz\n");
+        return 1;
+    }
+
+    uiErrors     = gauge.dsGetBusErrors();
+    simFailReads = 1;
+    gauge.dsReloadBatteryCapacity();
+    printf("empty capacity read: %u errors\n", gauge.dsGetBusErrors());
+    if (gauge.dsGetBusErrors() != uiErrors + 1) {
+        printf("FAILED, the capacity read wasn't counted\n");
+        return 1;
+    }
+    return 0;
+}
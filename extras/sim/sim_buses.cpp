@@ -0,0 +1,145 @@
+// sim_buses.cpp
+// One gauge polled 100 times at 20ms, first with dsRefresh and
+// dsPollProtection, then with dsSubmitRefresh and dsService called every
+// 1ms: bus utilization and sample latency for each.  Then 1 to 64 gauges,
+// each on its own TwoWire, refreshed through the queue from one loop every
+// 20ms: the worst latency, and whether every gauge still gets its refresh
+// in each period.  The buses are served one after another, as on an AVR.
+// flags: -DDS_USE_BUS_STATS=1 -DDS_USE_BUS_QUEUE=1
+#include <stdlib.h>
+#include <Wire.h>
+#include "DS2764.h"
+#include "ds2764_sim.h"
+
+#define POLLS		100
+#define PERIOD		20000	// us
+#define LOOP		1000	// us of other work in each pass of loop()
+#define MAX_GAUGES	64
+
+static TwoWire  gaBus[MAX_GAUGES];
+static DS2764  *gapGauge[MAX_GAUGES];
+
+static void start(void) {
+    simReset();
+    simReg[0x00] = DS00CE | DS00DE;
+    simReg[0x08] = DS00PS;
+    simSetVoltage(3700);
+    simSetCurrent(-500);
+}
+
+static int check(const char *asName, long alGot, long alWant, long alTolerance) {
+    bool    bOk = labs(alGot - alWant) <= alTolerance;
+
+    printf("  %-22s %5ld, want %5ld +-%ld  %s\n", asName, alGot, alWant, alTolerance,
+           bOk ? "ok" : "FAILED");
+    return !bOk;
+}
+
+// Refreshes aiGauges gauges every PERIOD for POLLS periods.  Returns the
+// number of periods that some refresh did not finish inside, or -1 if a
+// gauge did not keep to its own bus.
+static int scale(int aiGauges) {
+    unsigned long ulWorst   = 0;
+    unsigned long ulBusy    = 0;
+    unsigned long ulBegin;
+    int     iLate   = 0;
+    int     iFailed = 0;
+
+    start();
+    for (int g = 0; g < aiGauges; g++) {
+        gaBus[g].transactions = 0;
+        gapGauge[g] = new DS2764(gaBus[g], DS_ADDRESS);
+        gapGauge[g]->dsInit();
+        gapGauge[g]->dsResetBusStats();
+        gaBus[g].transactions = 0;
+    }
+    simTransactions = 0;
+    ulBegin = simMicros;
+
+    for (int i = 0; i < POLLS; i++) {
+        unsigned long ulStart = simMicros;
+        bool    bPending = true;
+
+        for (int g = 0; g < aiGauges; g++) {
+            gapGauge[g]->dsSubmitRefresh();
+        }
+        while (bPending && simMicros - ulStart < PERIOD) {
+            bPending = false;
+            for (int g = 0; g < aiGauges; g++) {
+                gapGauge[g]->dsService();
+                bPending |= gapGauge[g]->dsIsPending(DS_JOB_REFRESH);
+            }
+            simMicros += LOOP;
+        }
+        if (bPending || simMicros - ulStart > PERIOD) {
+            iLate++;
+        }
+        if (simMicros - ulStart < PERIOD) {
+            simMicros = ulStart + PERIOD;
+        }
+    }
+
+    for (int g = 0; g < aiGauges; g++) {
+        if (gapGauge[g]->dsGetSampleMicrosMax() > ulWorst) {
+            ulWorst = gapGauge[g]->dsGetSampleMicrosMax();
+        }
+        ulBusy += gapGauge[g]->dsGetBusMicros();
+        // every gauge did its own work on its own bus
+        iFailed += gaBus[g].transactions != gaBus[0].transactions;
+        iFailed += gapGauge[g]->dsGetBatteryVoltage() < 3690;
+    }
+    iFailed += simTransactions != aiGauges * gaBus[0].transactions;
+    printf("  %2d gauges: %3lu transactions a bus, each bus %4.1f%% busy, CPU on the buses %5.1f%%, "
+           "worst latency %5.1f ms, %3d of %d periods late  %s\n",
+           aiGauges, gaBus[0].transactions, gapGauge[0]->dsGetBusUtilization() / 10.0,
+           ulBusy * 100.0 / (simMicros - ulBegin), ulWorst / 1000.0, iLate, POLLS, iFailed ? "FAILED" : "ok");
+
+    for (int g = 0; g < aiGauges; g++) {
+        delete gapGauge[g];
+    }
+    return iFailed ? -1 : iLate;
+}
+
+int main() {
+    int     iFailed = 0;
+
+    {
+        DS2764  gauge;
+
+        start();
+        gauge.dsInit();
+        gauge.dsResetBusStats();
+        for (int i = 0; i < POLLS; i++) {
+            gauge.dsRefresh();
+            gauge.dsPollProtection();
+            simMicros += PERIOD;
+        }
+        printf("refresh and poll every 20ms:\n");
+        iFailed += check("bus use, permille", gauge.dsGetBusUtilization(), 224, 5);
+        iFailed += check("sample latency, us", gauge.dsGetSampleMicrosMax(), 5500, 300);
+
+        gauge.dsResetBusStats();
+        for (int i = 0; i < POLLS; i++) {
+            gauge.dsSubmitRefresh();
+            for (int k = 0; k < 4; k++) {
+                gauge.dsService();
+                simMicros += LOOP;
+            }
+            simMicros += PERIOD - 4 * LOOP;
+        }
+        printf("queued refresh every 20ms, dsService every 1ms:\n");
+        iFailed += check("bus use, permille", gauge.dsGetBusUtilization(), 69, 5);
+        iFailed += check("sample latency, us", gauge.dsGetSampleMicrosMax(), 3500, 300);
+    }
+
+    printf("one gauge a bus, queued refresh every 20ms:\n");
+    for (int n = 1; n <= MAX_GAUGES; n *= 2) {
+        int     iLate = scale(n);
+
+        // eight buses served in turn still fit in the period, 64 do not
+        iFailed += iLate < 0 || (n <= 8 && iLate != 0) || (n == MAX_GAUGES && iLate == 0);
+    }
+
+    printf(iFailed ? "FAILED\n" : "passed\n");
+    return iFailed != 0;
+}
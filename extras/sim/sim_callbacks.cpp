@@ -0,0 +1,62 @@
+// sim_callbacks.cpp
+// Every queued operation submitted at once with a completion callback: the
+// order they finish in, the longest dsService call, a refresh callback that
+// resubmits itself and a poll whose read is dropped.
+// flags: -DDS_USE_BUS_QUEUE=1
+#include <Wire.h>
+#include "DS2764.h"
+#include "ds2764_sim.h"
+
+static const char *gasJob[] = { "poll", "reset", "refresh", "accum", "sleep", "capacity" };
+static DS2764 gauge;
+static int giDone;
+
+static void done(byte abJob, boolean abOk) {
+    printf("  %6lu ms  %-8s ok=%d\n", simMicros / 1000, gasJob[abJob], abOk);
+    giDone++;
+}
+
+static void refreshAgain(byte abJob, boolean abOk) {
+    static int siRuns;
+
+    done(abJob, abOk);
+    if (++siRuns < 3) {
+        gauge.dsSubmitRefresh(refreshAgain);
+    }
+}
+
+int main() {
+    unsigned long ulStepMax = 0;
+
+    simReset();
+    simReg[0x00] = DS00CE | DS00DE;
+    simReg[0x08] = DS00PS;
+    simSetVoltage(3700);
+    gauge.dsInit();
+    simReg[0x00] = 0;
+
+    gauge.dsSubmitSleep(DS_SLEEP_ENABLED, done);
+    gauge.dsSubmitBatteryCapacity(1500, done);
+    gauge.dsSubmitAccumCurrent(750, done);
+    gauge.dsSubmitResetProtection(DS_RESET_ENABLE, done);
+    gauge.dsSubmitRefresh(refreshAgain);
+    gauge.dsSubmitPoll(done);
+    printf("second sleep submit refused: %d\n", !gauge.dsSubmitSleep(0));
+
+    for (int i = 0; i < 5000 && giDone < 9; i++) {
+        unsigned long ulBefore = simMicros;
+
+        gauge.dsService();
+        if (simMicros - ulBefore > ulStepMax) {
+            ulStepMax = simMicros - ulBefore;
+        }
+        simMicros += 1000;
+        if (i == 100) {
+            simFailReads = 1;	// the next poll's read gets nothing
+            gauge.dsSubmitPoll(done);
+        }
+    }
+    printf("longest dsService %lu us, ACR %d mAh, protection %02x, capacity %d\n", ulStepMax,
+           gauge.dsGetAccumulatedCurrent(), simReg[0x00], gauge.dsGetBatteryCapacity());
+    return 0;
+}
@@ -0,0 +1,95 @@
+// sim_energy.cpp
+// An hour of 4.0V at 2A charge, refreshed every second, against the energy
+// worked out by hand; 3.7V at 1A discharge for 20 seconds with the clock
+// switched to one 3e9 ms ahead half way, and the same clock set before
+// dsInit; and what dspUpdateEnergy costs per frame on this PC.
+// flags: -DDS_USE_ENERGY=1
+#include <stdlib.h>
+#include <chrono>
+#include <Wire.h>
+#define private public
+#include "DS2764.h"
+#undef private
+#include "ds2764_sim.h"
+
+#define CALLS		1000000L
+
+static unsigned long rtc(void) {
+    return millis() + 3000000000UL;
+}
+
+static void start(DS2764 &aGauge, int aiMilliVolts, int aiMilliAmps) {
+    simReset();
+    simReg[0x00] = DS00CE | DS00DE;
+    simReg[0x08] = DS00PS;
+    simSetVoltage(aiMilliVolts);
+    simSetCurrent(aiMilliAmps);
+    aGauge.dsInit();
+}
+
+static int check(const char *asName, long alGot, long alWant, long alTolerance) {
+    bool    bOk = labs(alGot - alWant) <= alTolerance;
+
+    printf("  %-34s %6ld mWh, want %6ld +-%ld  %s\n", asName, alGot, alWant, alTolerance,
+           bOk ? "ok" : "FAILED");
+    return !bOk;
+}
+
+int main() {
+    int     iFailed = 0;
+
+    {
+        DS2764  gauge;
+        double  dWant;
+
+        start(gauge, 4000, 2000);
+        for (int i = 0; i < 3600; i++) {
+            simMicros += 1000000;
+            gauge.dsRefresh();
+        }
+        // the registers hold 820 x 4.88mV and 3200 x .625mA
+        dWant = 820 * 4.88 * 2.0 * (gauge.mulEnergyLast - gauge.mulEnergyStart) / 3600000.0;
+        printf("4.0V 2A for an hour: power %ld mW, average %ld mW\n",
+               gauge.dsGetPower(), gauge.dsGetAveragePower());
+        iFailed += check("charged", gauge.dsGetChargeEnergy(), (long) dWant, 1);
+        iFailed += check("discharged", gauge.dsGetDischargeEnergy(), 0, 0);
+    }
+
+    for (int iBefore = 0; iBefore < 2; iBefore++) {
+        DS2764  gauge;
+
+        if (iBefore) {
+            gauge.dsSetClock(rtc);
+        }
+        start(gauge, 3700, -1000);
+        for (int i = 0; i < 20; i++) {
+            if (i == 10 && !iBefore) {
+                gauge.dsSetClock(rtc);
+            }
+            simMicros += 1000000;
+            gauge.dsRefresh();
+        }
+        printf("3.7V 1A for 20s, clock set %s:\n", iBefore ? "before dsInit" : "after 10s");
+        iFailed += check("discharged", gauge.dsGetDischargeEnergy(), 20, 0);
+        iFailed += check("charged", gauge.dsGetChargeEnergy(), 0, 0);
+    }
+
+    {
+        DS2764  gauge;
+        std::chrono::steady_clock::time_point tStart;
+        double  dNanos;
+
+        start(gauge, 3700, -1000);
+        tStart = std::chrono::steady_clock::now();
+        for (long i = 0; i < CALLS; i++) {
+            simMicros += 1000;
+            gauge.dspUpdateEnergy();
+        }
+        dNanos = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - tStart).count();
+        printf("dspUpdateEnergy on this PC: %.1f ns a frame, %ld mWh\n",
+               dNanos / CALLS, gauge.dsGetDischargeEnergy());
+    }
+
+    printf(iFailed ? "FAILED\n" : "passed\n");
+    return iFailed != 0;
+}
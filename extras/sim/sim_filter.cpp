@@ -0,0 +1,122 @@
+// sim_filter.cpp
+// 3700mV and -500mA, stepping to 3600mV and -1500mA half way, with a
+// 0V/+2000mA glitch every 17 frames and a +500mV/-1000mA one every 23
+// (the current register tops out at 2.56A):
+// the worst error outside the step, how many frames read as undervoltage,
+// how many frames the current step takes to show and the largest change in
+// current from one frame to the next, for each filter.  The glitches have
+// to trip the undervoltage check unfiltered and never with a median, a
+// median of 3 or 5 has to hold the readings to a count and delay the step
+// by 1 or 2 frames, and the clamp has to keep every change to its step.
+// flags: -DDS_USE_FILTER=1
+#include <stdlib.h>
+#include <Wire.h>
+#include "DS2764.h"
+#include "ds2764_sim.h"
+
+#define FRAMES		400
+#define STEP		200
+#define UNDERVOLT	3300
+#define CLAMP		80	// .625mA counts a frame, 50mA
+
+struct Result {
+    int     worstMv;
+    int     worstMa;
+    int     alarms;
+    int     settle;	// frames after the step
+    int     maxStep;	// mA, largest change between frames
+};
+
+static Result run(const char *asName, byte abStages) {
+    DS2764  gauge;
+    Result  r       = { 0, 0, 0, -1, 0 };
+    int     iPrevMa = -500;
+
+    simReset();
+    simReg[0x00] = DS00CE | DS00DE;
+    simReg[0x08] = DS00PS;
+    simSetVoltage(3700);
+    simSetCurrent(-500);
+    gauge.dsInit();
+    gauge.dsSetFilter(DS_FILTER_VOLTAGE, abStages, 20, 4);
+    gauge.dsSetFilter(DS_FILTER_CURRENT, abStages, CLAMP, 4);
+
+    for (int i = 0; i < FRAMES; i++) {
+        int     iMv = i < STEP ? 3700 : 3600;
+        int     iMa = i < STEP ? -500 : -1500;
+        int     iGotMv;
+        int     iGotMa;
+
+        if (i % 17 == 5) {
+            simSetVoltage(0);
+            simSetCurrent(2000);
+        }
+        else if (i % 23 == 7) {
+            simSetVoltage(iMv + 500);
+            simSetCurrent(iMa - 1000);
+        }
+        else {
+            simSetVoltage(iMv);
+            simSetCurrent(iMa);
+        }
+        gauge.dsRefresh();
+        simMicros += 100000;
+
+        iGotMv = gauge.dsGetBatteryVoltage();
+        iGotMa = (int)(gauge.dsGetCurrentRaw() * 625L / 1000);
+        if (i < STEP - 5 || i > STEP + 15) {
+            if (abs(iGotMv - iMv) > r.worstMv) {
+                r.worstMv = abs(iGotMv - iMv);
+            }
+            if (abs(iGotMa - iMa) > r.worstMa) {
+                r.worstMa = abs(iGotMa - iMa);
+            }
+        }
+        if (iGotMv < UNDERVOLT) {
+            r.alarms++;
+        }
+        if (i >= STEP && r.settle < 0 && abs(iGotMa - iMa) < 20) {
+            r.settle = i - STEP;
+        }
+        if (abs(iGotMa - iPrevMa) > r.maxStep) {
+            r.maxStep = abs(iGotMa - iPrevMa);
+        }
+        iPrevMa = iGotMa;
+    }
+    printf("%-16s worst %4d mV %5d mA, %2d undervoltage frames, step shows after %2d frames, "
+           "largest change %4d mA\n", asName, r.worstMv, r.worstMa, r.alarms, r.settle, r.maxStep);
+    return r;
+}
+
+static int check(const char *asWhat, bool abOk) {
+    printf("  %-46s %s\n", asWhat, abOk ? "ok" : "FAILED");
+    return !abOk;
+}
+
+int main() {
+    Result  r;
+    int     iFailed = 0;
+
+    r = run("none", 0);
+    iFailed += check("glitches trip the undervoltage check", r.alarms > 0);
+
+    r = run("median3", DS_FILTER_MEDIAN3);
+    iFailed += check("no undervoltage, within a count", r.alarms == 0 && r.worstMv <= 5 && r.worstMa <= 1);
+    iFailed += check("step one frame late", r.settle == 1);
+
+    r = run("median5", DS_FILTER_MEDIAN5);
+    iFailed += check("no undervoltage, within a count", r.alarms == 0 && r.worstMv <= 5 && r.worstMa <= 1);
+    iFailed += check("step two frames late", r.settle == 2);
+
+    r = run("median5 + clamp", DS_FILTER_MEDIAN5 | DS_FILTER_CLAMP);
+    iFailed += check("no undervoltage", r.alarms == 0);
+    iFailed += check("no change bigger than the clamp", r.maxStep <= CLAMP * 625 / 1000 + 1);
+    // 1000mA at 50mA a frame, after the median's 2
+    iFailed += check("step through in 2 + 1000 / 50 frames", r.settle > 0 && r.settle <= 2 + 1000 / (CLAMP * 625 / 1000));
+
+    r = run("median3 + iir", DS_FILTER_MEDIAN3 | DS_FILTER_IIR);
+    iFailed += check("no undervoltage", r.alarms == 0);
+
+    printf(iFailed ? "FAILED\n" : "passed\n");
+    return iFailed != 0;
+}
@@ -0,0 +1,141 @@
+// sim_learning.cpp
+// Capacity learning over many charge/discharge cycles of a cell that loses
+// 1.5% of its capacity a cycle, starting from a capacity record 10% too high.
+// Prints one trace line per cycle: the true capacity, what the driver has
+// learned, what Block 0 holds and how many EEPROM saves it has cost.  Fails
+// if the learned capacity is ever more than MAX_ERROR off, if Block 0 is
+// left further than the drift setting from it, or if it costs more than
+// MAX_SAVES saves.
+// flags: -DDS_USE_CAPACITY_LEARNING=1 -DDS_USE_OCV_SOC=1
+#include <stdlib.h>
+#include <Wire.h>
+#include "DS2764.h"
+#include "ds2764_sim.h"
+
+#define FRAME_MS	36000UL		// 10mAh a frame at 1A
+#define RESISTANCE	100		// milliohms inside the cell
+#define MAX_ERROR	0.025		// of the true capacity, once a cycle has run
+#define MAX_SAVES	6		// 25% lost, saved about every 5%
+
+static const int sawOcv[][2] = {	// mV, tenths of a percent, as DS_OCV_LIION
+    { 3000, 0 }, { 3250, 20 }, { 3450, 50 }, { 3680, 100 }, { 3740, 200 },
+    { 3770, 300 }, { 3790, 400 }, { 3820, 500 }, { 3870, 600 }, { 3920, 700 },
+    { 3980, 800 }, { 4200, 1000 }
+};
+
+static double   sdCapacity = 2000;	// true mAh
+static double   sdCharge;		// mAh in the cell
+static double   sdAcr;			// what the gauge has counted, mAh
+static unsigned long sulLongest;	// longest dsRefresh, us
+
+static int ocv(void) {
+    double  dSoc = sdCharge * 1000 / sdCapacity;
+    int     i = 1;
+
+    while (i < 11 && sawOcv[i][1] < dSoc) {
+        i++;
+    }
+    return sawOcv[i - 1][0] + (int)((dSoc - sawOcv[i - 1][1]) * (sawOcv[i][0] - sawOcv[i - 1][0])
+                                    / (sawOcv[i][1] - sawOcv[i - 1][1]));
+}
+
+// One frame at aiMilliAmps, + charging.
+static void frame(DS2764 &gauge, int aiMilliAmps) {
+    double  dMoved = aiMilliAmps * (FRAME_MS / 3600000.0);
+
+    if (sdCharge + dMoved > sdCapacity) {
+        dMoved = sdCapacity - sdCharge;
+    }
+    sdCharge += dMoved;
+    sdAcr    += dMoved;
+    simSetAccum((unsigned int)(long)(sdAcr * 4));
+    simSetCurrent(aiMilliAmps);
+    simSetVoltage(ocv() + aiMilliAmps * RESISTANCE / 1000);
+    simMicros += FRAME_MS * 1000;
+    unsigned long ulStart = simMicros;
+    gauge.dsRefresh();
+    if (simMicros - ulStart > sulLongest) {
+        sulLongest = simMicros - ulStart;
+    }
+}
+
+static int check(DS2764 &gauge) {
+    int     iLearned    = gauge.dsGetBatteryCapacity();
+    int     iBlock0     = (simEeprom[0x20] << 8) | simEeprom[0x21];
+    int     iFailed     = 0;
+
+    if (iLearned < sdCapacity * (1 - MAX_ERROR) || iLearned > sdCapacity * (1 + MAX_ERROR)) {
+        printf("       learned %d is more than %.1f%% off\n", iLearned, MAX_ERROR * 100);
+        iFailed++;
+    }
+    if (abs(iBlock0 - iLearned) * 100 > iBlock0 * DS_LEARN_DRIFT_PERCENT) {
+        printf("       Block 0 %d has drifted from %d without a save\n", iBlock0, iLearned);
+        iFailed++;
+    }
+    return iFailed;
+}
+
+static void charge(DS2764 &gauge, double adUpTo) {
+    while (sdCharge < sdCapacity * 0.9 && sdCharge < adUpTo) {
+        frame(gauge, 1000);
+    }
+    for (int iTaper = 500; iTaper >= 50 && sdCharge < adUpTo; iTaper /= 2) {
+        frame(gauge, iTaper);	// constant voltage, current tapering off
+    }
+    frame(gauge, 0);
+}
+
+static void discharge(DS2764 &gauge, int aiEmpty) {
+    while (ocv() - 100 > aiEmpty) {
+        frame(gauge, -1000);
+    }
+    frame(gauge, 0);
+}
+
+int main() {
+    DS2764  gauge;
+    int     iFailed = 0;
+
+    simReset();
+    simReg[0x00] = DS00CE | DS00DE;
+    simReg[0x08] = DS00PS;
+    simEeprom[0x20] = 2200 >> 8;	// capacity record, 10% high
+    simEeprom[0x21] = 2200 & 0xFF;
+    simEeprom[0x22] = simEeprom[0x20] ^ simEeprom[0x21];
+    simEeprom[0x23] = 0x0A;
+    sdCharge = sdCapacity * 0.05;
+    sdAcr    = sdCharge;
+    frame(gauge, 0);
+    gauge.dsInit();
+
+    printf("cycle  true mAh  learned  Block 0  saves\n");
+    for (int iCycle = 1; iCycle <= 20; iCycle++) {
+        charge(gauge, sdCapacity);
+        discharge(gauge, 3300);
+        printf("%5d  %8.0f  %7d  %7d  %5lu\n", iCycle, sdCapacity, gauge.dsGetBatteryCapacity(),
+               (simEeprom[0x20] << 8) | simEeprom[0x21], simSaves);
+        iFailed += check(gauge);
+        sdCapacity *= 0.985;
+        if (sdCharge > sdCapacity) {
+            sdCharge = sdCapacity;
+        }
+    }
+
+    // charged part way in the middle, only the resting voltages count
+    int     iBefore = gauge.dsGetBatteryCapacity();
+    charge(gauge, sdCapacity);
+    discharge(gauge, 3700);
+    charge(gauge, sdCharge + 300);
+    discharge(gauge, 3300);
+    printf("interrupted cycle: true %.0f, learned %d -> %d, saves %lu\n", sdCapacity, iBefore,
+           gauge.dsGetBatteryCapacity(), simSaves);
+    iFailed += check(gauge);
+    if (simSaves > MAX_SAVES) {
+        printf("%lu saves, more than %d\n", simSaves, MAX_SAVES);
+        iFailed++;
+    }
+    printf("longest dsRefresh %lu ms\n", sulLongest / 1000);
+
+    printf(iFailed ? "FAILED\n" : "passed\n");
+    return iFailed != 0;
+}
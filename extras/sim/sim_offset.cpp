@@ -0,0 +1,81 @@
+// sim_offset.cpp
+// dsCalibrateCurrentOffset against a gauge whose current reading is an
+// injected offset, plus the Current Offset Register, plus +-3 counts of
+// noise: what gets programmed, what the readings average afterwards and how
+// many EEPROM saves it costs as the offset drifts.  The offset programmed
+// has to cancel the injected one to a count, a second calibration must not
+// save again, the rest of Block 1 must survive, and a calibration under
+// load must be refused.
+// flags: -DDS_USE_OFFSET_CAL=1
+#include <stdlib.h>
+#include <Wire.h>
+#include "DS2764.h"
+#include "ds2764_sim.h"
+
+static int	giOffset = 23;		// counts the sense input is off by
+static unsigned	guiSeed = 1;
+static int	giFailed = 0;
+
+static void check(const char *asWhat, bool abOk) {
+    printf("  %-40s %s\n", asWhat, abOk ? "ok" : "FAILED");
+    giFailed += !abOk;
+}
+
+static void reading(void) {
+    int     iNoise;
+
+    guiSeed = guiSeed * 1103515245 + 12345;
+    iNoise  = (int)((guiSeed >> 16) % 7) - 3;
+    simSetCurrentRaw(giOffset + (int8_t) simReg[0x33] + iNoise);
+}
+
+int main() {
+    DS2764  gauge;
+    unsigned long ulStart;
+    unsigned long ulSaves;
+    int     iKept;
+    boolean bOk;
+    long    lSum = 0;
+
+    simReset();
+    simReg[0x00] = DS00CE | DS00DE;
+    simReg[0x08] = DS00PS;
+    simEeprom[0x31] = 0x5A;		// another Block 1 byte that must survive
+    simHook = reading;
+    gauge.dsInit();
+
+    ulStart = simMicros;
+    bOk = gauge.dsCalibrateCurrentOffset();
+    printf("offset %+d: programmed %d, ok %d, %lu saves, %lu ms, other Block 1 byte %02x\n", giOffset,
+           gauge.dsGetCurrentOffset(), bOk, simSaves, (simMicros - ulStart) / 1000, simEeprom[0x31]);
+    for (int i = 0; i < 100; i++) {
+        gauge.dsRefresh();
+        lSum += gauge.dsGetCurrentRaw();
+    }
+    printf("mean reading afterwards %.2f counts\n", lSum / 100.0);
+    check("programmed within a count", bOk && abs(gauge.dsGetCurrentOffset() + giOffset) <= 1);
+    check("one save", simSaves == 1);
+    check("other Block 1 byte kept", simEeprom[0x31] == 0x5A);
+
+    ulSaves = simSaves;
+    bOk = gauge.dsCalibrateCurrentOffset();
+    printf("again: ok %d, %lu saves\n", bOk, simSaves);
+    check("no save when unchanged", bOk && simSaves == ulSaves);
+
+    giOffset = -40;
+    bOk = gauge.dsCalibrateCurrentOffset(1000);
+    printf("offset %+d: programmed %d, ok %d, %lu saves\n", giOffset, gauge.dsGetCurrentOffset(), bOk, simSaves);
+    check("programmed within a count", bOk && abs(gauge.dsGetCurrentOffset() + giOffset) <= 1);
+    check("other Block 1 byte kept", simEeprom[0x31] == 0x5A);
+
+    ulSaves = simSaves;
+    iKept   = gauge.dsGetCurrentOffset();
+    giOffset = 400;
+    bOk = gauge.dsCalibrateCurrentOffset(500);
+    printf("under a 400 count load: ok %d, offset kept at %d, %lu saves\n", bOk,
+           gauge.dsGetCurrentOffset(), simSaves);
+    check("refused, nothing saved", !bOk && simSaves == ulSaves && gauge.dsGetCurrentOffset() == iKept);
+
+    printf(giFailed ? "FAILED\n" : "passed\n");
+    return giFailed != 0;
+}
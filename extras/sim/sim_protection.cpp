@@ -0,0 +1,60 @@
+// sim_protection.cpp
+// dsPollProtection against trips that dsRefresh, a failed read or another
+// protection write got to first.
+// flags:
+#include <Wire.h>
+#include "DS2764.h"
+#include "ds2764_sim.h"
+
+static int siFailed;
+
+static void check(const char *asWhat, bool abOk) {
+    printf("  %-52s %s\n", asWhat, abOk ? "ok" : "FAILED");
+    if (!abOk) {
+        siFailed++;
+    }
+}
+
+int main() {
+    DS2764  gauge;
+
+    // refresh sees the OV trip before the poll does
+    simReset();
+    simReg[0x00] = DS00CE | DS00DE;
+    simReg[0x08] = DS00PS;
+    gauge.dsInit();
+    gauge.dsSetProtectionResponse(DS_PROTECTION_TRIP_MASK, DS_RESPONSE_DISABLE);
+    gauge.dsPollProtection();
+    simReg[0x00] |= DS00OV;
+    gauge.dsRefresh();
+    check("trip seen by dsRefresh first is still reported", gauge.dsPollProtection());
+    check("charge and discharge disabled", (simReg[0x00] & (DS00CE | DS00DE)) == 0);
+    check("OV left latched by the response write", (simReg[0x00] & DS00OV) != 0);
+    check("not reported twice", !gauge.dsPollProtection());
+
+    // the read before the trip failed
+    simReset();
+    simReg[0x00] = DS00CE | DS00DE;
+    simReg[0x08] = DS00PS;
+    gauge.dsInit();
+    gauge.dsSetProtectionResponse(DS_PROTECTION_TRIP_MASK, DS_RESPONSE_DISABLE_CHARGE);
+    gauge.dsPollProtection();
+    simFailReads = 1;
+    check("failed read reports nothing", !gauge.dsPollProtection());
+    simReg[0x00] |= DS00OV;
+    check("trip after a failed read is reported", gauge.dsPollProtection());
+    check("charge disabled, discharge left on", (simReg[0x00] & (DS00CE | DS00DE)) == DS00DE);
+
+    // a reset in between doesn't hide the clear from the poll
+    simReset();
+    simReg[0x00] = DS00CE | DS00DE;
+    simReg[0x08] = DS00PS;
+    gauge.dsInit();
+    simReg[0x00] |= DS00UV;
+    gauge.dsPollProtection();
+    gauge.dsResetProtection(DS_RESET_ENABLE);
+    check("UV cleared by dsResetProtection is reported", gauge.dsPollProtection());
+
+    printf("%s\n", siFailed ? "FAILED" : "passed");
+    return siFailed != 0;
+}
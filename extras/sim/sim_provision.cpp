@@ -0,0 +1,105 @@
+// sim_provision.cpp
+// Capacity 2200mAh, sleep enabled and the ACR set on a blank pack, first
+// through dsSetBatteryCapacity, dsEnableSleep and dsSetAccumCurrent, then
+// through dsProvision with an image taken from what those left in EEPROM.
+// Also a pack that is already provisioned and one with Block 0 locked.
+// flags: -DDS_USE_PROVISION=1
+#include <string.h>
+#include <Wire.h>
+#include "DS2764.h"
+#include "ds2764_sim.h"
+
+#define CAPACITY	2200
+#define OFFSET		0xFC	// factory current offset at 0x33, must survive
+
+static unsigned long gulStart;
+static unsigned long gulTransactions;
+static unsigned long gulSaves;
+
+static void blank(void) {
+    simReset();
+    simReg[0x00] = DS00CE | DS00DE;
+    simReg[0x08] = DS00PS;
+    simReg[SIM_BLOCK_1 + 3] = simEeprom[SIM_BLOCK_1 + 3] = OFFSET;
+}
+
+static void mark(void) {
+    gulStart        = simMicros;
+    gulTransactions = simTransactions;
+    gulSaves        = simSaves;
+}
+
+static void report(const char *asName) {
+    unsigned long ulMicros = simMicros - gulStart;
+
+    printf("%-20s %8.1f ms, %4lu transactions, %lu saves, %5.0f packs an hour\n",
+           asName, ulMicros / 1000.0, simTransactions - gulTransactions,
+           simSaves - gulSaves, 3600e6 / ulMicros);
+}
+
+int main() {
+    DSImage image;
+    DSProvisionReport result;
+    boolean bOk;
+    int     iFailed = 0;
+
+    blank();
+    {
+        DS2764  gauge;
+
+        gauge.dsInit();
+        mark();
+        gauge.dsSetBatteryCapacity(CAPACITY);
+        gauge.dsEnableSleep();
+        gauge.dsSetAccumCurrent(CAPACITY);
+        report("single calls");
+    }
+
+    // the capacity record in Block 0 and the sleep bit at 0x31
+    memset(&image, 0, sizeof(image));
+    for (int i = 0; i < 4; i++) {
+        image.data[i] = simEeprom[SIM_BLOCK_0 + i];
+        image.mask[i] = 0xFF;
+    }
+    image.data[17] = simEeprom[SIM_BLOCK_1 + 1];
+    image.mask[17] = DS00SLP;
+
+    blank();
+    {
+        DS2764  gauge;
+
+        gauge.dsInit();
+        mark();
+        bOk = gauge.dsProvision(image, result);
+        gauge.dsSetAccumCurrent(CAPACITY);
+        report("dsProvision");
+        printf("    ok %d, results %d %d %d, capacity %d, offset %02x\n", bOk,
+               result.result[0], result.result[1], result.result[2],
+               gauge.dsGetBatteryCapacity(), simEeprom[SIM_BLOCK_1 + 3]);
+        iFailed += !bOk || memcmp(&simEeprom[SIM_BLOCK_0], image.data, 4) != 0
+                || !(simEeprom[SIM_BLOCK_1 + 1] & DS00SLP)
+                || simEeprom[SIM_BLOCK_1 + 3] != OFFSET;
+
+        mark();
+        bOk = gauge.dsProvision(image, result);
+        report("already provisioned");
+        printf("    ok %d, results %d %d %d\n", bOk,
+               result.result[0], result.result[1], result.result[2]);
+        iFailed += !bOk || simSaves != gulSaves;
+    }
+
+    blank();
+    simLocked = 1;
+    {
+        DS2764  gauge;
+
+        gauge.dsInit();
+        bOk = gauge.dsProvision(image, result);
+        printf("Block 0 locked: ok %d, results %d %d %d\n", bOk,
+               result.result[0], result.result[1], result.result[2]);
+        iFailed += bOk || result.result[0] != DS_PROVISION_VERIFY_FAILED;
+    }
+
+    printf(iFailed ? "FAILED\n" : "passed\n");
+    return iFailed != 0;
+}
@@ -0,0 +1,84 @@
+// sim_queue.cpp
+// A sleep setting and a capacity save through the dsService job queue,
+// with a protection poll submitted every 10ms and a refresh every 100ms of
+// loop() time meanwhile, against the same change made with the blocking call.
+// Fails if a poll isn't done by the dsService call after it was submitted,
+// within MAX_POLL_US, if any step takes longer than MAX_STEP_US, or if the
+// sleep bit and capacity don't end up in EEPROM.
+// flags: -DDS_USE_BUS_QUEUE=1
+#include <Wire.h>
+#include "DS2764.h"
+#include "ds2764_sim.h"
+
+#define MAX_POLL_US	1000	// submit to done, the poll runs ahead of everything else
+#define MAX_STEP_US	1000	// one dsService call
+#define CAPACITY	1234
+
+int main() {
+    DS2764  gauge;
+    unsigned long ulStart;
+
+    simReset();
+    simReg[0x00] = DS00CE | DS00DE;
+    simReg[0x08] = DS00PS;
+    gauge.dsInit();
+
+    ulStart = simMicros;
+    gauge.dsEnableSleep();
+    printf("blocking dsEnableSleep: %lu ms\n", (simMicros - ulStart) / 1000);
+    gauge.dsDisableSleep();
+
+    unsigned long ulSteps = 0, ulStepMax = 0, ulPolls = 0, ulPollMax = 0, ulSubmitted = 0;
+    bool    bPolling = false;
+
+    gauge.dsSubmitSleep(DS_SLEEP_ENABLED);
+    gauge.dsSubmitBatteryCapacity(CAPACITY);
+    ulStart = simMicros;
+    while (gauge.dsIsPending(DS_JOB_SLEEP) || gauge.dsIsPending(DS_JOB_CAPACITY) || bPolling) {
+        if (!bPolling && (simMicros / 1000) % 10 == 0) {
+            gauge.dsSubmitPoll();
+            ulSubmitted = simMicros;
+            bPolling    = true;
+        }
+        if ((simMicros / 1000) % 100 == 0) {
+            gauge.dsSubmitRefresh();
+        }
+        unsigned long ulBefore = simMicros;
+        if (gauge.dsService()) {
+            ulSteps++;
+            if (simMicros - ulBefore > ulStepMax) {
+                ulStepMax = simMicros - ulBefore;
+            }
+        }
+        if (bPolling && !gauge.dsIsPending(DS_JOB_POLL)) {
+            if (simMicros - ulSubmitted > ulPollMax) {
+                ulPollMax = simMicros - ulSubmitted;
+            }
+            ulPolls++;
+            bPolling = false;
+        }
+        simMicros += 1000;	// the rest of loop()
+    }
+    printf("queued: done in %lu ms of loop(), %lu steps, longest step %lu us\n",
+           (simMicros - ulStart) / 1000, ulSteps, ulStepMax);
+    printf("        %lu polls meanwhile, longest from submit to done %lu us\n", ulPolls, ulPollMax);
+    printf("sleep bit saved %d, capacity %d\n", (simEeprom[0x31] & DS00SLP) != 0,
+           (simEeprom[0x20] << 8) | simEeprom[0x21]);
+
+    int     iFailed = 0;
+
+    if (ulPolls == 0 || ulPollMax > MAX_POLL_US) {
+        printf("polls took up to %lu us, limit %d\n", ulPollMax, MAX_POLL_US);
+        iFailed++;
+    }
+    if (ulStepMax > MAX_STEP_US) {
+        printf("a step took %lu us, limit %d\n", ulStepMax, MAX_STEP_US);
+        iFailed++;
+    }
+    if (!(simEeprom[0x31] & DS00SLP) || ((simEeprom[0x20] << 8) | simEeprom[0x21]) != CAPACITY) {
+        printf("sleep bit or capacity not saved\n");
+        iFailed++;
+    }
+    printf(iFailed ? "FAILED\n" : "passed\n");
+    return iFailed != 0;
+}
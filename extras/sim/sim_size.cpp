@@ -0,0 +1,305 @@
+// sim_size.cpp
+// Checks the RAM figures in README.txt.  Every member of DS2764 (and of the
+// structs it holds) is listed below with its size on AVR, 2 byte int and
+// pointers and no padding.  The PC can't give the AVR sizes, but with the
+// class packed it can check the list is complete: the listed members have
+// to add up to sizeof(DS2764), so a member added or widened without
+// updating this file fails here.  The AVR sums are then checked against the
+// memory table and the +bytes for each switch.
+// flags:
+// flags: -DDS_USE_CHECKPOINT=1 -DDS_USE_ENERGY=1 -DDS_USE_OCV_SOC=1 -DDS_USE_CAPACITY_LEARNING=1 -DDS_USE_RUNTIME=1 -DDS_USE_WATCH=1 -DDS_USE_BUS_QUEUE=1 -DDS_USE_BUS_STATS=1 -DDS_USE_SNAPSHOT=1 -DDS_USE_SYNC_SAMPLING=1 -DDS_USE_CHARGE_MARK=1 -DDS_USE_OFFSET_CAL=1 -DDS_USE_TRACE=1 -DDS_USE_STANDBY=1 -DDS_USE_BUS_TUNE=1 -DDS_USE_PROVISION=1 -DDS_USE_FILTER=1 -DDS_USE_ARCHIVE=1
+#include <Arduino.h>
+#include <Wire.h>
+#include <avr/pgmspace.h>
+
+#pragma pack(push, 1)
+#define private public
+#include "DS2764.h"
+#undef private
+#pragma pack(pop)
+
+#include "ds2764_sim.h"
+
+// What the README says, one group per line of the table or switch.
+enum {
+    G_REGS, G_FRAME, G_ACC_EXT, G_TEMP, G_CAPACITY, G_CLOCK, G_BUS, G_FLAGS,
+    G_POLL, G_CHECKPOINT, G_ENERGY, G_OCV, G_LEARN, G_LEARN_OCV, G_RUNTIME,
+    G_WATCH, G_QUEUE, G_STATS, G_SNAPSHOT, G_SYNC, G_MARK, G_TRACE,
+    G_STANDBY, G_TUNE, G_FILTER, G_ARCHIVE, G_STRUCT, G_COUNT
+};
+
+struct Group {
+    const char *name;
+    int     readme;		// bytes on AVR as README.txt gives them
+};
+
+static const Group gaGroups[G_COUNT] = {
+    { "Protection, Status registers", 2 },
+    { "Voltage/Current/Acc. Current", 6 },
+    { "Extended Acc. Current", 4 },
+    { "Temperature", 2 },
+    { "Battery Capacity", 2 },
+    { "Clock function", 2 },
+    { "Bus and address", 3 },
+    { "Flags", 1 },
+    { "dsPollProtection settings", 7 },
+    { "DS_USE_CHECKPOINT", 15 },
+    { "DS_USE_ENERGY", 28 },
+    { "DS_USE_OCV_SOC", 9 },
+    { "DS_USE_CAPACITY_LEARNING", 12 },
+    { "  with DS_USE_OCV_SOC", 18 - 12 },
+    { "DS_USE_RUNTIME", 16 },
+    { "DS_USE_WATCH", 5 },
+    { "DS_USE_BUS_QUEUE", 49 },
+    { "DS_USE_BUS_STATS", 21 },
+    { "DS_USE_SNAPSHOT", 19 },
+    { "DS_USE_SYNC_SAMPLING", 24 },
+    { "DS_USE_CHARGE_MARK", 5 },
+    { "DS_USE_TRACE", 4 + 5 * DS_TRACE_DEPTH },
+    { "DS_USE_STANDBY", 1 },
+    { "DS_USE_BUS_TUNE", 15 },
+    { "DS_USE_FILTER", 48 },
+    { "DS_USE_ARCHIVE", 8 + 8 * DS_ARCHIVE_BLOCK },
+    { "", 0 },
+};
+
+struct Member {
+    const char *name;
+    unsigned int host;		// bytes on the PC, packed
+    unsigned int avr;		// bytes on AVR
+    byte    group;
+};
+
+// a member of type T, or an array of them, avr bytes each on AVR
+#define M(s, m, T, avr, g)	{ #m, sizeof(s::m), (avr) * (unsigned int) (sizeof(s::m) / sizeof(T)), g }
+
+// AVR sizes of the structs, worked out from their own lists below
+static unsigned int guiSnapshot;
+static unsigned int guiFilter;
+static unsigned int guiTrace;
+static int giFailed;
+
+// Adds up a list, fails if it doesn't cover all of a struct of auiSize bytes.
+static unsigned int sum(const char *asName, const Member *apList, int aiCount,
+                        unsigned int auiSize, int *apGroups) {
+    unsigned int uiHost = 0;
+    unsigned int uiAvr  = 0;
+
+    for (int i = 0; i < aiCount; i++) {
+        uiHost += apList[i].host;
+        uiAvr  += apList[i].avr;
+        if (apGroups) {
+            apGroups[apList[i].group] += apList[i].avr;
+        }
+    }
+    if (uiHost != auiSize) {
+        printf("%s: listed members are %u bytes on the PC, sizeof is %u, update sim_size.cpp\n",
+               asName, uiHost, auiSize);
+        giFailed++;
+    }
+    return uiAvr;
+}
+
+static void structs(void) {
+    static const Member aWatch[] = {
+        M(DSWatch, channel, byte, 1, G_STRUCT),
+        M(DSWatch, mode, byte, 1, G_STRUCT),
+        M(DSWatch, threshold, int, 2, G_STRUCT),
+        M(DSWatch, hysteresis, int, 2, G_STRUCT),
+        M(DSWatch, dwell, unsigned long, 4, G_STRUCT),
+        M(DSWatch, since, unsigned long, 4, G_STRUCT),
+    };
+    static const Member aSnapshot[] = {
+        M(DSSnapshot, version, byte, 1, G_STRUCT),
+        M(DSSnapshot, protect, byte, 1, G_STRUCT),
+        M(DSSnapshot, status, byte, 1, G_STRUCT),
+        M(DSSnapshot, valid, byte, 1, G_STRUCT),
+        M(DSSnapshot, millivolts, int, 2, G_STRUCT),
+        M(DSSnapshot, milliamps, int, 2, G_STRUCT),
+        M(DSSnapshot, temp, int, 2, G_STRUCT),
+        M(DSSnapshot, accumulated, long, 4, G_STRUCT),
+        M(DSSnapshot, millis, unsigned long, 4, G_STRUCT),
+    };
+    static const Member aFilter[] = {
+        M(DSFilterState, hist, int, 2, G_STRUCT),
+        M(DSFilterState, clamp, int, 2, G_STRUCT),
+        M(DSFilterState, iir, long, 4, G_STRUCT),
+        M(DSFilterState, out, int, 2, G_STRUCT),
+        M(DSFilterState, maxStep, int, 2, G_STRUCT),
+        M(DSFilterState, stages, byte, 1, G_STRUCT),
+        M(DSFilterState, shift, byte, 1, G_STRUCT),
+        M(DSFilterState, next, byte, 1, G_STRUCT),
+        M(DSFilterState, seeded, boolean, 1, G_STRUCT),
+    };
+    static const Member aTrace[] = {
+        M(DSTraceEvent, micros, unsigned long, 4, G_STRUCT),
+        M(DSTraceEvent, stage, byte, 1, G_STRUCT),
+    };
+    unsigned int uiWatch;
+
+    uiWatch     = sum("DSWatch", aWatch, sizeof(aWatch) / sizeof(aWatch[0]), sizeof(DSWatch), 0);
+    guiSnapshot = sum("DSSnapshot", aSnapshot, sizeof(aSnapshot) / sizeof(aSnapshot[0]), sizeof(DSSnapshot), 0);
+    guiFilter   = sum("DSFilterState", aFilter, sizeof(aFilter) / sizeof(aFilter[0]), sizeof(DSFilterState), 0);
+    guiTrace    = sum("DSTraceEvent", aTrace, sizeof(aTrace) / sizeof(aTrace[0]), sizeof(DSTraceEvent), 0);
+
+    // the watch table is the sketch's, README gives it per watch
+    printf("  %-30s %4u  README %4d  %s\n", "DSWatch (in the sketch)", uiWatch, 14,
+           uiWatch == 14 ? "ok" : "FAILED");
+    giFailed += uiWatch != 14;
+}
+
+int main() {
+    int     aiGroups[G_COUNT] = { 0 };
+    int     iTotal  = 0;
+
+    structs();
+
+    const Member aMembers[] = {
+        M(DS2764, mbyProtect, byte, 1, G_REGS),
+        M(DS2764, mbyStatus, byte, 1, G_REGS),
+        M(DS2764, mabVoltAndCurrent, byte, 1, G_FRAME),
+        M(DS2764, mabTemp, byte, 1, G_TEMP),
+        M(DS2764, mbyFlags, byte, 1, G_FLAGS),
+        M(DS2764, mlAccCurrentExt, long, 4, G_ACC_EXT),
+        M(DS2764, mpClock, DSClock, 2, G_CLOCK),
+        M(DS2764, mpWire, TwoWire *, 2, G_BUS),
+        M(DS2764, mbyAddress, byte, 1, G_BUS),
+#if DS_USE_CAPACITY_EEPROM
+        M(DS2764, miBatteryCapacity, int, 2, G_CAPACITY),
+#endif
+#if DS_USE_PROTECTION_POLL
+        M(DS2764, mbyProtectMask, byte, 1, G_POLL),
+        M(DS2764, mbyProtectResponse, byte, 1, G_POLL),
+        M(DS2764, mbyProtectPolled, byte, 1, G_POLL),
+        M(DS2764, mulPollMicrosMax, unsigned long, 4, G_POLL),
+#endif
+#if DS_USE_ENERGY
+        M(DS2764, mllChargeEnergy, int64_t, 8, G_ENERGY),
+        M(DS2764, mllDischargeEnergy, int64_t, 8, G_ENERGY),
+        M(DS2764, mlPower, long, 4, G_ENERGY),
+        M(DS2764, mulEnergyStart, unsigned long, 4, G_ENERGY),
+        M(DS2764, mulEnergyLast, unsigned long, 4, G_ENERGY),
+#endif
+#if DS_USE_OCV_SOC
+        M(DS2764, mpOcvTable, DSOcvPoint *, 2, G_OCV),
+        M(DS2764, mbyOcvCount, byte, 1, G_OCV),
+        M(DS2764, miRestCurrent, int, 2, G_OCV),
+        M(DS2764, mulRestRecip, unsigned long, 4, G_OCV),
+#endif
+#if DS_USE_CAPACITY_LEARNING
+        M(DS2764, miStoredCapacity, int, 2, G_LEARN),
+        M(DS2764, miLearnFullVolts, int, 2, G_LEARN),
+        M(DS2764, miLearnEmptyVolts, int, 2, G_LEARN),
+        M(DS2764, mlLearnFullAcc, long, 4, G_LEARN),
+        M(DS2764, mbyLearnState, byte, 1, G_LEARN),
+        M(DS2764, mbyDriftPercent, byte, 1, G_LEARN),
+#if DS_USE_OCV_SOC
+        M(DS2764, mlLearnAnchorAcc, long, 4, G_LEARN_OCV),
+        M(DS2764, miLearnAnchorSoc, int, 2, G_LEARN_OCV),
+#endif
+#endif
+#if DS_USE_RUNTIME
+        M(DS2764, mlAvgCurrent, long, 4, G_RUNTIME),
+        M(DS2764, mulAvgLast, unsigned long, 4, G_RUNTIME),
+        M(DS2764, mulAvgMillis, unsigned long, 4, G_RUNTIME),
+        M(DS2764, mulAvgRecip, unsigned long, 4, G_RUNTIME),
+#endif
+#if DS_USE_WATCH
+        M(DS2764, mpWatches, DSWatch *, 2, G_WATCH),
+        M(DS2764, mbyWatchCount, byte, 1, G_WATCH),
+        M(DS2764, mpWatchCallback, DSWatchCallback, 2, G_WATCH),
+#endif
+#if DS_USE_BUS_QUEUE
+        M(DS2764, mabJobStep, byte, 1, G_QUEUE),
+        M(DS2764, maulJobDue, unsigned long, 4, G_QUEUE),
+        M(DS2764, mapJobDone, DSDoneCallback, 2, G_QUEUE),
+        M(DS2764, mbyJobFailed, byte, 1, G_QUEUE),
+        M(DS2764, mbyJobReset, byte, 1, G_QUEUE),
+        M(DS2764, mbyJobSleep, byte, 1, G_QUEUE),
+        M(DS2764, miJobAccum, int, 2, G_QUEUE),
+        M(DS2764, miJobCapacity, int, 2, G_QUEUE),
+#endif
+#if DS_USE_BUS_STATS
+        M(DS2764, mulBusMicros, unsigned long, 4, G_STATS),
+        M(DS2764, mulBusSince, unsigned long, 4, G_STATS),
+        M(DS2764, mulSampleStart, unsigned long, 4, G_STATS),
+        M(DS2764, mulSampleMicros, unsigned long, 4, G_STATS),
+        M(DS2764, mulSampleMicrosMax, unsigned long, 4, G_STATS),
+        M(DS2764, mbyBusDepth, byte, 1, G_STATS),
+#endif
+#if DS_USE_SNAPSHOT
+        M(DS2764, msSnapshot, DSSnapshot, guiSnapshot, G_SNAPSHOT),
+        M(DS2764, mbySnapshotSeq, byte, 1, G_SNAPSHOT),
+#endif
+#if DS_USE_SYNC_SAMPLING
+        M(DS2764, mulFrameSeen, unsigned long, 4, G_SYNC),
+        M(DS2764, mulFrameRead, unsigned long, 4, G_SYNC),
+        M(DS2764, mulFrameDue, unsigned long, 4, G_SYNC),
+        M(DS2764, muiConvPeriod, unsigned int, 2, G_SYNC),
+        M(DS2764, mbyConvLearn, byte, 1, G_SYNC),
+        M(DS2764, mabConvGap, byte, 1, G_SYNC),
+        M(DS2764, mbyFresh, byte, 1, G_SYNC),
+#endif
+#if DS_USE_STANDBY
+        M(DS2764, mbStandby, boolean, 1, G_STANDBY),
+#endif
+#if DS_USE_BUS_TUNE
+        M(DS2764, mulClockMax, unsigned long, 4, G_TUNE),
+        M(DS2764, mulClockMin, unsigned long, 4, G_TUNE),
+        M(DS2764, mbyClockLevel, byte, 1, G_TUNE),
+        M(DS2764, mbyTuneTxns, byte, 1, G_TUNE),
+        M(DS2764, mbyTuneErrors, byte, 1, G_TUNE),
+        M(DS2764, mbyTuneClean, byte, 1, G_TUNE),
+        M(DS2764, mbyTuneBackoff, byte, 1, G_TUNE),
+        M(DS2764, muiBusErrors, unsigned int, 2, G_TUNE),
+#endif
+#if DS_USE_FILTER
+        M(DS2764, masFilter, DSFilterState, guiFilter, G_FILTER),
+#endif
+#if DS_USE_ARCHIVE
+        M(DS2764, mpArchive, Print *, 2, G_ARCHIVE),
+        M(DS2764, mulArchiveStart, unsigned long, 4, G_ARCHIVE),
+        M(DS2764, mauiArchiveTime, unsigned int, 2, G_ARCHIVE),
+        M(DS2764, maiArchive, int, 2, G_ARCHIVE),
+        M(DS2764, mbyArchiveCount, byte, 1, G_ARCHIVE),
+        M(DS2764, mbyArchiveCheck, byte, 1, G_ARCHIVE),
+#endif
+#if DS_USE_TRACE
+        M(DS2764, masTrace, DSTraceEvent, guiTrace, G_TRACE),
+        M(DS2764, mbyTraceNext, byte, 1, G_TRACE),
+        M(DS2764, mbyTraceCount, byte, 1, G_TRACE),
+        M(DS2764, mpTraceClock, DSClock, 2, G_TRACE),
+#endif
+#if DS_USE_CHARGE_MARK
+        M(DS2764, mulAccMillis, unsigned long, 4, G_MARK),
+        M(DS2764, mbyAccEpoch, byte, 1, G_MARK),
+#endif
+#if DS_USE_CHECKPOINT
+        M(DS2764, muiCycleCount, unsigned int, 2, G_CHECKPOINT),
+        M(DS2764, mlCycleDischarge, long, 4, G_CHECKPOINT),
+        M(DS2764, mulCheckpointMillis, unsigned long, 4, G_CHECKPOINT),
+        M(DS2764, mulCheckpointInterval, unsigned long, 4, G_CHECKPOINT),
+        M(DS2764, mbyCheckpointSeq, byte, 1, G_CHECKPOINT),
+#endif
+    };
+
+    sum("DS2764", aMembers, sizeof(aMembers) / sizeof(aMembers[0]), sizeof(DS2764), aiGroups);
+
+    for (int g = 0; g < G_STRUCT; g++) {
+        if (!aiGroups[g]) {
+            continue;		// switched off in this build
+        }
+        printf("  %-30s %4d  README %4d  %s\n", gaGroups[g].name, aiGroups[g],
+               gaGroups[g].readme, aiGroups[g] == gaGroups[g].readme ? "ok" : "FAILED");
+        giFailed += aiGroups[g] != gaGroups[g].readme;
+        if (g <= G_POLL) {
+            iTotal += aiGroups[g];
+        }
+    }
+    printf("  %-30s %4d  README %4d  %s\n", "default build", iTotal, 29,
+           iTotal == 29 ? "ok" : "FAILED");
+    giFailed += iTotal != 29;
+
+    printf(giFailed ? "FAILED\n" : "passed\n");
+    return giFailed != 0;
+}
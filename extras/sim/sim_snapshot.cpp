@@ -0,0 +1,150 @@
+// sim_snapshot.cpp
+// A writer thread refreshing as fast as it can, each refresh 10ms after the
+// last with the voltage and the temperature set from its count, and a
+// reader thread calling dsReadSnapshot: the voltage, temperature and clock
+// time in every snapshot read have to be from a single refresh.  The same
+// reads made by copying the record without the sequence check show how
+// often it would tear, and an uncontended read is timed.  With one CPU the
+// threads only swap on a time slice, so the same is done again with the
+// refresh run from a 20us timer signal, which interrupts the reader
+// anywhere the way a timer interrupt would on an AVR.
+// flags: -DDS_USE_SNAPSHOT=1 -pthread
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <Wire.h>
+#define private public
+#include "DS2764.h"
+#undef private
+#include "ds2764_sim.h"
+
+#define STEPS		512	// temperature steps, each with its own voltage
+#define REFRESHES	200000L	// by the writer thread while the reader runs
+#define INTERRUPTS	20000L	// by the timer signal while the reader runs
+#define READS		5000000L	// uncontended
+
+static DS2764   gauge;
+static int      gaiMilliVolts[STEPS];	// what each step's voltage decodes to
+static std::atomic<long> glRefreshes(0);
+static unsigned long gulFirst;		// clock time of the first refresh of a run, ms
+
+static void set(int aiStep) {
+    simSetTemp(aiStep);
+    simSetVoltage(3000 + aiStep * 5);
+}
+
+static void refresh(void) {
+    long    k = glRefreshes;
+
+    set(k % STEPS);
+    simMicros = (gulFirst + k * 10) * 1000;	// the refresh itself takes a few ms more
+    gauge.dsRefresh();
+    glRefreshes = k + 1;
+}
+
+static void writer(void) {
+    while (glRefreshes < REFRESHES) {
+        refresh();
+    }
+}
+
+static void interrupt(int) {
+    refresh();
+}
+
+// Reads snapshots with or without the sequence check for as long as the
+// writer thread, or the timer signal if abInterrupt, keeps refreshing, and
+// returns how many were not from a single refresh.
+static long contend(bool abInterrupt, bool abChecked, long &alReads) {
+    std::thread tWriter;
+    struct itimerval timer;
+    DSSnapshot snap;
+    long    lStop   = abInterrupt ? INTERRUPTS : REFRESHES;
+    long    lTorn   = 0;
+
+    glRefreshes = 0;
+    alReads     = 0;
+    gulFirst    = millis() + 10;
+    memset(&timer, 0, sizeof(timer));
+    if (abInterrupt) {
+        timer.it_value.tv_usec = timer.it_interval.tv_usec = 20;
+        signal(SIGALRM, interrupt);
+        setitimer(ITIMER_REAL, &timer, NULL);
+    }
+    else {
+        tWriter = std::thread(writer);
+    }
+    while (glRefreshes < lStop) {
+        if (abChecked) {
+            gauge.dsReadSnapshot(snap);
+        }
+        else {
+            memcpy(&snap, (const void *) &gauge.msSnapshot, sizeof(snap));
+        }
+        if (snap.millis < gulFirst) {
+            continue;	// from before the run
+        }
+        if (snap.temp < 0 || snap.temp >= STEPS || snap.millivolts != gaiMilliVolts[snap.temp]
+                || (long) ((snap.millis - gulFirst) / 10 % STEPS) != snap.temp) {
+            lTorn++;
+        }
+        alReads++;
+    }
+    if (abInterrupt) {
+        memset(&timer, 0, sizeof(timer));
+        setitimer(ITIMER_REAL, &timer, NULL);
+    }
+    else {
+        tWriter.join();
+    }
+    return lTorn;
+}
+
+int main() {
+    DSSnapshot snap;
+    std::chrono::steady_clock::time_point tStart;
+    long    lTorn;
+    long    lReads;
+    long    lSum    = 0;
+    int     iFailed = 0;
+
+    simReset();
+    simReg[0x00] = DS00CE | DS00DE;
+    simReg[0x08] = DS00PS;
+    set(0);
+    gauge.dsInit();
+    for (int i = 0; i < STEPS; i++) {
+        set(i);
+        gauge.dsRefresh();
+        gaiMilliVolts[i] = gauge.dsGetBatteryVoltage();
+    }
+
+    for (int iInterrupt = 0; iInterrupt < 2; iInterrupt++) {
+        long    lRefreshes = iInterrupt ? INTERRUPTS : REFRESHES;
+
+        printf("%s, %ld refreshes:\n", iInterrupt ? "timer signal" : "writer thread", lRefreshes);
+        lTorn = contend(iInterrupt, true, lReads);
+        printf("  dsReadSnapshot                %9ld reads, %6ld torn  %s\n",
+               lReads, lTorn, lTorn ? "FAILED" : "ok");
+        iFailed += lTorn != 0;
+        lTorn = contend(iInterrupt, false, lReads);
+        printf("  without the sequence check    %9ld reads, %6ld torn\n", lReads, lTorn);
+        // or the signal didn't land inside a copy and nothing was tested
+        iFailed += iInterrupt && lTorn == 0;
+    }
+
+    tStart = std::chrono::steady_clock::now();
+    for (long i = 0; i < READS; i++) {
+        gauge.dsReadSnapshot(snap);
+        lSum += snap.millivolts;
+    }
+    printf("uncontended dsReadSnapshot on this PC: %.1f ns (%ld)\n",
+           std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - tStart).count() / READS,
+           lSum & 1);
+
+    printf(iFailed ? "FAILED\n" : "passed\n");
+    return iFailed != 0;
+}
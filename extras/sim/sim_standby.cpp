@@ -0,0 +1,55 @@
+// sim_standby.cpp
+// An 8 hour off period with 1mA of leakage and a power switch press near
+// the end: dsRefresh every second against dsEnterStandby/dsPollStandby.
+// Wakes, bus transactions, time in the driver and how long the press took
+// to be seen.
+// flags: -DDS_USE_STANDBY=1
+#include <Wire.h>
+#include "DS2764.h"
+#include "ds2764_sim.h"
+
+static void run(bool abStandby) {
+    DS2764  gauge;
+    unsigned long ulSleep   = 1000;
+    unsigned long ulEnd, ulPress, ulSeen = 0, ulWakes = 0, ulBus = 0, ulTxns;
+
+    simReset();
+    simReg[0x00] = DS00CE | DS00DE;
+    simReg[0x08] = DS00PS;
+    simSetCurrent(-1);
+    gauge.dsInit();
+    simReg[0x08] &= ~DS00PS;		// press: power down
+    gauge.dsRefresh();
+    if (abStandby) {
+        gauge.dsEnterStandby();
+        ulSleep = DS_STANDBY_SLEEP;
+    }
+
+    ulTxns  = simTransactions;
+    ulEnd   = simMicros + 8UL * 3600 * 1000000;
+    ulPress = ulEnd - 700000;
+    while (simMicros < ulEnd && !ulSeen) {
+        unsigned long ulWake;
+
+        simMicros += ulSleep * 1000;
+        if (simMicros >= ulPress) {
+            simReg[0x08] &= ~DS00PS;
+        }
+        ulWakes++;
+        ulWake = simMicros;
+        if (abStandby ? gauge.dsPollStandby() : (gauge.dsRefresh(), gauge.dsIsPowerOn())) {
+            ulSeen = simMicros;
+        }
+        ulBus += simMicros - ulWake;
+    }
+    printf("%-8s sleep %lums: %lu wakes, %lu transactions, %.1f s in the driver, press seen after %lu ms, "
+           "charge/discharge %s\n", abStandby ? "standby" : "refresh", ulSleep, ulWakes,
+           simTransactions - ulTxns, ulBus / 1e6, (ulSeen - ulPress) / 1000,
+           (simReg[0x00] & (DS00CE | DS00DE)) == (DS00CE | DS00DE) ? "on" : "off");
+}
+
+int main() {
+    run(false);
+    run(true);
+    return 0;
+}
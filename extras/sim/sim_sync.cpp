@@ -0,0 +1,98 @@
+// sim_sync.cpp
+// dsRefresh every 10ms against a gauge that converts every 88ms: bus
+// transactions per refresh and how many distinct current readings were
+// seen, with and without DS_USE_SYNC_SAMPLING, and with the period learned,
+// also against a gauge converting every 120ms.  Every conversion has to be
+// seen, synchronised reads have to cost fewer transactions, and the learned
+// period has to be within PERIOD_ERROR of the real one.
+// flags:
+// flags: -DDS_USE_SYNC_SAMPLING=1
+#include <stdlib.h>
+#include <Wire.h>
+#include "DS2764.h"
+#include "ds2764_sim.h"
+
+#define CONVERSION_MS	88
+#define REFRESHES	3000
+#define PLAIN		8.0	// transactions a refresh without synchronising
+#define MAX_SYNC	6.0	// and the most with it
+#define PERIOD_ERROR	2	// ms
+
+static long glConversions = -1;
+static int  giPeriod;		// ms, how often the simulated gauge converts
+
+// Called before each read, brings the registers up to the latest conversion.
+static void convert(void) {
+    long    lDue = ((long)(simMicros / 1000) - 37) / giPeriod;
+
+    while (glConversions < lDue) {
+        glConversions++;
+        simSetCurrentRaw((int)((glConversions * 7919) % 2000) - 1000);
+        if (glConversions % 5 == 0) {
+            simSetVoltage(3400 + (int)(glConversions % 50) * 5);
+            simSetTemp(200 + (int)(glConversions % 7));
+        }
+    }
+}
+
+// Returns nonzero if the run failed.
+static int run(const char *asName, int aiPeriod, bool abLearn) {
+    DS2764  gauge;
+    unsigned long ulStart;
+    double  dPer;
+    long    lSeen   = 0;
+    int     iLast   = 0x7FFF;
+    int     iFailed = 0;
+
+    simReset();
+    simReg[0x00] = DS00CE | DS00DE;
+    simReg[0x08] = DS00PS;
+    simHook = convert;
+    glConversions = -1;
+    giPeriod = aiPeriod;
+    gauge.dsInit();
+#if DS_USE_SYNC_SAMPLING
+    if (abLearn) {
+        gauge.dsSetConversionPeriod(0);
+    }
+#else
+    (void) abLearn;
+#endif
+    ulStart = simTransactions;
+    for (int i = 0; i < REFRESHES; i++) {
+        gauge.dsRefresh();
+        if (gauge.dsGetCurrentRaw() != iLast) {
+            iLast = gauge.dsGetCurrentRaw();
+            lSeen++;
+        }
+        simMicros += 10000;
+    }
+    dPer = (double)(simTransactions - ulStart) / REFRESHES;
+    printf("%-16s %.1f transactions a refresh, %ld conversions, %ld distinct current readings",
+           asName, dPer, glConversions + 1, lSeen);
+    // every conversion changes the current
+    iFailed += lSeen != glConversions + 1;
+#if DS_USE_SYNC_SAMPLING
+    printf(", period %u ms", gauge.dsGetConversionPeriod());
+    iFailed += dPer > MAX_SYNC;
+    iFailed += abs((int) gauge.dsGetConversionPeriod() - aiPeriod) > PERIOD_ERROR;
+#else
+    iFailed += dPer != PLAIN;
+#endif
+    printf("  %s\n", iFailed ? "FAILED" : "ok");
+    return iFailed;
+}
+
+int main() {
+    int     iFailed = 0;
+
+#if DS_USE_SYNC_SAMPLING
+    iFailed += run("sync 88ms", CONVERSION_MS, false);
+    iFailed += run("sync learned", CONVERSION_MS, true);
+    iFailed += run("learned, 120ms", 120, true);
+#else
+    iFailed += run("plain", CONVERSION_MS, false);
+#endif
+    printf(iFailed ? "FAILED\n" : "passed\n");
+    return iFailed != 0;
+}
@@ -0,0 +1,2 @@
+// util/delay.h
+// Host stand-in, nothing in it is used by the library.
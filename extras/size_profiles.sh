@@ -0,0 +1,38 @@
+#!/bin/sh
+# size_profiles.sh
+# Builds examples/DS2764Basic once per DS_USE_xxx profile with arduino-cli and
+# prints a flash/RAM table from avr-size.  Needs arduino-cli with the
+# arduino:avr core installed (avr-size comes with the core's toolchain).
+#
+# Usage: extras/size_profiles.sh [fqbn]      default fqbn is arduino:avr:uno
+
+FQBN=${1:-arduino:avr:uno}
+LIBDIR=$(cd "$(dirname "$0")/.." && pwd)
+SKETCH=$LIBDIR/examples/DS2764Basic
+OUT=${TMPDIR:-/tmp}/ds2764_sizes
+
+ALL_OFF="-DDS_USE_POWER_SWITCH=0 -DDS_USE_SLEEP=0 -DDS_USE_CAPACITY_EEPROM=0 -DDS_USE_FLOAT=0 -DDS_USE_PROTECTION_POLL=0"
+
+AVR_SIZE=$(command -v avr-size || find "$HOME/.arduino15" -name avr-size -type f 2>/dev/null | head -n 1)
+if [ -z "$AVR_SIZE" ]; then
+    echo "avr-size not found, install the arduino:avr core" >&2
+    exit 1
+fi
+
+printf "%-22s %8s %8s\n" "Profile" "Flash" "RAM"
+while read -r NAME FLAGS; do
+    rm -rf "$OUT"
+    arduino-cli compile -b "$FQBN" --library "$LIBDIR" --output-dir "$OUT" \
+        --build-property "build.extra_flags=$FLAGS" "$SKETCH" >/dev/null || exit 1
+    # text + data is flash, data + bss is RAM
+    "$AVR_SIZE" "$OUT/DS2764Basic.ino.elf" | awk -v n="$NAME" \
+        'NR == 2 { printf "%-22s %8d %8d\n", n, $1 + $2, $2 + $3 }'
+done <<PROFILES
+full
+no-power-switch -DDS_USE_POWER_SWITCH=0
+no-sleep -DDS_USE_SLEEP=0
+no-capacity-eeprom -DDS_USE_CAPACITY_EEPROM=0
+no-float -DDS_USE_FLOAT=0
+no-protection-poll -DDS_USE_PROTECTION_POLL=0
+minimal $ALL_OFF
+PROFILES
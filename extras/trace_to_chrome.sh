@@ -0,0 +1,46 @@
+#!/bin/sh
+# trace_to_chrome.sh
+# Converts dsDumpTrace output (DS_USE_TRACE) into Chrome trace JSON for
+# chrome://tracing or https://ui.perfetto.dev.  Each "# DS2764 0x.." header
+# starts a new track named after the gauge address, so dumps from several
+# gauges, or from two firmware builds, can be captured into one file and
+# compared side by side.  Anything else on the serial log is skipped.
+#
+# The trace clock wraps every 71 minutes, which is unwrapped per track.  An
+# end whose begin was overwritten in the ring buffer is dropped.
+#
+# Usage: extras/trace_to_chrome.sh [dump.txt ...] > trace.json
+
+awk '
+BEGIN { printf "{\"traceEvents\":["; n = 0; track = 0 }
+
+{ sub(/\r$/, "") }
+
+$1 == "#" && $2 == "DS2764" {
+    track++
+    name[track] = "DS2764 " $3 " (" track ")"
+    last = ""; base = 0
+    printf "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", \
+        (n++ ? "," : ""), track, name[track]
+    next
+}
+
+track && ($1 == "B" || $1 == "E") && NF == 3 && $3 ~ /^[0-9]+$/ {
+    t = $3 + 0
+    if (last != "" && t < last) base += 4294967296
+    last = t
+    key = track SUBSEP $2
+    if ($1 == "B") {
+        open[key]++
+    }
+    else if (open[key] > 0) {
+        open[key]--
+    }
+    else {
+        next
+    }
+    printf ",\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.0f,\"pid\":1,\"tid\":%d}", $2, $1, base + t, track
+}
+
+END { printf "\n]}\n" }
+' "$@"